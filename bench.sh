@@ -0,0 +1,3 @@
+#!/bin/bash
+gcc main.c -lm -ltermbox -lpthread -O2 -Wall -o bench
+./bench --bench "$@"
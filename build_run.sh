@@ -1,3 +1,3 @@
 #!/bin/bash
-gcc main.c -lm -ltermbox -g -Wall
+gcc main.c -lm -ltermbox -lpthread -g -Wall
 ./a.out
@@ -1,647 +1,7001 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "tgraphics.h"
+#include "spatial.h"
+#include "pool.h"
 
 // Types
 
+// Gate inputs and wire fanouts are slices of two shared edge lists
+typedef union Edge {
+    struct Wire *wire;
+    struct Gate *gate;
+} Edge;
+
+typedef struct EdgeList {
+    Edge *items;
+    int len;
+    int capacity;
+    int garbage; // Items in slices that were abandoned
+} EdgeList;
+
 typedef struct Wire {
     int id;
+    int index; // Position in wire_list
     bool state;
+    struct Gate *driver; // Gate whose output is this wire
+    int first_fanout; // Gates that read this wire, in wire_fanouts
+    int num_of_fanout;
+    int fanout_capacity;
+    bool shown_state; // State on screen, only used by the UI thread
+    bool shown_hazard;
+    uint8_t transitions; // Changes since the timed engine was last quiet
+
+    // Wires that touch form a net. The state, driver and fanout above are
+    // only used on the net's root wire.
+    struct Wire *net; // Root wire of the net
+    struct Wire *next_in_net; // Circular list of the net's wires
+    int net_size; // Wires in the net, only set on the root
+    int net_index; // Position in net_list, only set on the root
+    bool net_dirty; // Waiting to be joined to the wires it touches
 
     int x0, y0;
     int x1, y1;
+
+    struct Gate *instance; // CUSTOM gate this is an inner wire of
+
+    // Bumped when the wire is freed, see Gate
+    uint32_t generation;
 } Wire;
 
+// Sub-circuits are compiled once into a list of parts, which every CUSTOM
+// gate using the definition copies into the netlist. The definition's nets
+// are numbered with the input pins first, then the output pins, then the
+// inner nets.
+#define MAX_PINS 16
+#define DEFINITION_NAME_LEN 32
+
+typedef struct Part {
+    int type;
+    int first_input; // Slice of Definition::part_inputs
+    int num_of_inputs;
+    int output; // Net
+    bool uses_pins; // Reconnected when the instance's pins change
+} Part;
+
+typedef struct Definition {
+    char name[DEFINITION_NAME_LEN];
+    int index; // Position in definitions
+    int num_of_inputs; // Pins
+    int num_of_outputs;
+    int num_of_nets;
+    Part *parts; // In evaluation order
+    int num_of_parts;
+    int *part_inputs; // Net read by each part input
+    int num_of_part_inputs;
+    int *net_fanout; // Part inputs reading each net
+    int output_parts[MAX_PINS]; // Part driving each output pin
+    int width, height;
+    char *ascii; // Drawing shared by every instance
+} Definition;
+
 typedef struct Gate {
-    enum { NOT, AND, OR, XOR, INPUT, CUSTOM } type;
-    Wire **inputs;
+    enum { NOT, AND, OR, XOR, INPUT, CUSTOM, DFF, CLOCK } type;
+    int first_input; // Slice of gate_inputs
     int num_of_inputs;
+    int input_capacity;
     Wire *output;
 
-    bool value; // Used for inputs
+    bool value; // Used for inputs, clocks and the state of flip-flops
+    bool last_clock; // Clock input of a flip-flop when it was last latched
+
+    // Timed engine. The output changes delay ticks after the inputs do, 0
+    // means the default delay of the gate's type.
+    uint8_t delay;
+    bool next_state; // Output once the pending changes have happened
+    int num_of_pending; // Changes scheduled on the timing wheel
+
+    int index; // Position in gate_list
+    bool oscillating; // Part of a feedback loop that failed to settle
+    bool queued; // Waiting in the event queue
+    bool dirty; // Connections need to be rebuilt
+    bool shown_value; // Value and oscillating on screen, only used by the UI
+    bool shown_oscillating;
 
     int x, y;
     int width, height;
+
+    // CUSTOM gates. Inputs are the nets at the input pins, the parts drive
+    // the nets at the output pins.
+    const Definition *definition;
+    struct Gate *parts; // One run of gates and wires for each instance
+    Wire *part_wires; // Indexed by the definition's nets
+    struct Gate *instance; // CUSTOM gate this is a part of
+
+    // Bumped when the gate is freed. Kept clear of the first bytes, which the
+    // pool uses to link free gates.
+    uint32_t generation;
 } Gate;
 
+#define NUM_OF_GATE_TYPES (CLOCK + 1)
+
+// Refers to a gate that may be deleted while the handle is held. Handles to
+// deleted gates resolve to NULL, even if the gate's memory has been reused.
+typedef struct GateHandle {
+    Gate *gate;
+    uint32_t generation;
+} GateHandle;
+
+typedef struct WireHandle {
+    Wire *wire;
+    uint32_t generation;
+} WireHandle;
+
+// Binary circuit files. All records have a fixed size and are stored in the
+// host's byte order. Gate inputs are indices into the wire records, listed
+// in the connection table. CUSTOM gates name their definition in the table
+// after it and are reconnected when they are loaded.
+#define CIRCUIT_MAGIC "LSIM"
+#define CIRCUIT_VERSION 4
+
+typedef struct CircuitHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_of_gates;
+    uint32_t num_of_wires;
+    uint32_t num_of_connections;
+    uint32_t num_of_definitions;
+} CircuitHeader;
+
+typedef struct GateRecord {
+    uint8_t type;
+    uint8_t value;
+    uint16_t definition; // Index into the definition table
+    int32_t x, y;
+    uint32_t first_input; // Index into the connection table
+    uint32_t num_of_inputs;
+    int32_t output; // Wire index, -1 if unconnected
+    uint8_t delay;
+    uint8_t reserved[3];
+} GateRecord;
+
+typedef struct WireRecord {
+    int32_t id;
+    int32_t x0, y0;
+    int32_t x1, y1;
+    int32_t net; // Index of the net's root wire
+    uint8_t state;
+    uint8_t reserved[3];
+} WireRecord;
+
+typedef struct DefinitionRecord {
+    char name[DEFINITION_NAME_LEN];
+} DefinitionRecord;
+
+// Counters for finding out where the time goes. The simulation counters
+// belong to the thread running the engines, the build counters are only
+// changed while the simulation thread is paused.
+typedef struct Stats {
+    long steps; // Updates run by an engine
+    double step_seconds;
+    long gate_evaluations;
+    long events; // Gates taken off the event queue, or timed changes
+    long builds; // Calls to build_representation_from_graphics()
+    double build_seconds;
+    double last_build_seconds;
+    int gates_removed; // By the last optimize_program()
+} Stats;
+
 // Global variables and constants
 
 const char help[] = "\033[1;96mHelp\033[39;49m\n\n"
                     "Key                 Description\n"
                     "------------------------------------------------\n"
                     "arrow keys, hjkl    Move the cursor.\n"
+                    "HJKL                Scroll half a screen.\n"
                     "ctrl + q            Quit the simulator.\n"
                     "a                   Place a new gate/IO.\n"
                     "w                   Place a new wire.\n"
                     "d                   Delete component.\n"
                     "m                   Move component under cursor.\n"
                     "i                   Toggle an input's value.\n"
-                    "v                   Output verilog to stdout.\n\n";
+                    "e                   Switch simulation engine.\n"
+                    "c                   Run one clock cycle.\n"
+                    "f                   Start/stop the clock.\n"
+                    "+/-                 Change the clock rate.\n"
+                    "</>                 Change a gate's delay (timed).\n"
+                    "v                   Write verilog to circuit.v.\n"
+                    "t                   Write truth table to a file.\n"
+                    "r                   Write the waveform to circuit.vcd.\n"
+                    "p                   Show performance counters.\n"
+                    "s                   Save the circuit.\n\n";
+
+const char usage[] = "Usage: %s [--threads n] [--lib circuit]... [circuit]\n"
+                     "       %s [--lib circuit]... --batch circuit stimulus "
+                     "[-o output]\n"
+                     "       %s [--lib circuit]... --emit-c output.c circuit\n"
+                     "       %s [--lib circuit]... --verilog output.v circuit\n"
+                     "       %s [--lib circuit]... --faults circuit stimulus "
+                     "[-o output]\n"
+                     "       %s [--lib circuit]... --truth-table circuit "
+                     "[-o output]\n"
+                     "       %s [--lib circuit]... [--bdd-nodes n] --equiv "
+                     "circuit circuit\n"
+                     "       %s [--threads n] --bench [gates]\n"
+                     "--stats writes performance counters to stderr after "
+                     "--batch, --faults,\n--emit-c, --verilog or --equiv. "
+                     "--cycles n runs n clock cycles for each --batch\nstep. "
+                     "--delay type=ticks sets the delay of a gate type in the "
+                     "timed engine.\n--vcd output.vcd writes the waveform of "
+                     "a --batch run, --vcd-window first last\nonly the part "
+                     "between two times. --wave-memory bytes sets how much "
+                     "the\nwaveform recorder keeps.\n";
+
+const char *gate_type_names[] = { "NOT", "AND", "OR", "XOR", "INPUT",
+                                  "CUSTOM", "DFF", "CLOCK" };
+
 
 bool running = true;
 bool simulate_circuit = false;
 
-int cursor_y, cursor_x;
+const char *circuit_path = "circuit.lsim";
+
+// A circuit read from a Verilog file keeps its net names, indexed by wire id,
+// and its ports in the order they were declared
+enum { PORT_NONE, PORT_INPUT, PORT_OUTPUT };
+
+typedef struct VerilogPort {
+    WireHandle wire;
+    int direction;
+} VerilogPort;
+
+char **verilog_names;
+int num_of_verilog_names; // Zero unless the circuit came from Verilog
+VerilogPort *verilog_ports;
+int num_of_verilog_ports;
+
+enum { ENGINE_LEVELIZED, ENGINE_EVENT, ENGINE_COMPILED, ENGINE_TIMED,
+       NUM_OF_ENGINES } sim_engine;
+const char *engine_names[] = { "levelized", "event driven", "compiled",
+                               "timed" };
+
+int cursor_y, cursor_x; // Board cell under the cursor
+
+// The screen shows the part of the board starting at this cell. Components
+// are placed in board cells, which can be anywhere right of and below (0, 0).
+int view_x, view_y;
 
 Gate **gate_list;
 int gate_list_len;
+int gate_list_capacity;
 
 Wire **wire_list;
 int wire_list_len;
+int wire_list_capacity;
 
 int last_wire_id;
 
-// Functions
+// Sub-circuits loaded with --lib
+Definition **definitions;
+int num_of_definitions;
 
-Gate *new_gate(int num_of_inputs, int type, int x, int y)
-{
-    // Allocate memory
-    Gate *gate = malloc(sizeof(Gate));
-    gate->inputs = malloc(num_of_inputs * sizeof(Wire *));
+Pool gate_pool = { sizeof(Gate) };
+Pool wire_pool = { sizeof(Wire) };
 
-    // Add gate to list
-    gate_list = realloc(gate_list, ++gate_list_len * sizeof(Gate *));
-    gate_list[gate_list_len - 1] = gate;
+EdgeList gate_inputs;  // Wire for each gate input
+EdgeList wire_fanouts; // Gate for each wire fanout
 
-    gate->type = type; // Set type
+// Spatial index
+enum { PIN_INPUT, PIN_OUTPUT, WIRE_END }; // pin_grid tags
+enum { AREA_GATE, AREA_WIRE }; // area_grid tags
 
-    gate->x = x;
-    gate->y = y;
-    if (type != CUSTOM) {
-        gate->width = 8;
-        gate->height = 3;
-    }
+SpatialHash pin_grid;  // Gate pins and wire ends by cell
+SpatialHash area_grid; // Cells covered by gates and wires, in 8x8 tiles
 
-    gate->value = 0;
+// Evaluation order built by levelize_circuit()
+#define MAX_FIXPOINT_PASSES 64
 
-    return gate;
-}
+Gate **sim_order;    // Gates sorted topologically
+int *scc_start;      // Start of each strongly connected component in sim_order
+bool *scc_cyclic;    // Component contains a feedback loop
+int num_of_sccs;
+int num_of_oscillating; // Feedback loops that did not settle on last update
 
-Wire *new_wire(int x0, int y0, int x1, int y1)
+// The netlist compiled into a flat program over a dense array of net states.
+// Gates become one instruction each in simulation order and every feedback
+// loop becomes an OP_LOOP followed by its body.
+enum {
+    OP_AND, OP_OR, OP_XOR, OP_NOT, // dest = a op b
+    OP_AND_N, OP_OR_N, OP_XOR_N,   // Sources a to a + b in program_sources
+    OP_INPUT,                      // dest = value of program_inputs[a],
+                                   // which are INPUT, DFF and CLOCK gates
+    OP_LOOP,                       // Repeat the next a instructions, SCC b
+    OP_CONST,                      // dest = a, left by optimize_program()
+    OP_COPY                        // dest = a
+};
+
+typedef struct Instruction {
+    uint8_t op;
+    int32_t dest; // Net index
+    int32_t a, b;
+} Instruction;
+
+Instruction *program;
+int program_len;
+int program_capacity;
+int *program_sources;
+int num_of_program_sources;
+int program_sources_capacity;
+Gate **program_inputs;
+int num_of_program_inputs;
+int program_inputs_capacity;
+uint8_t *program_states; // Indexed by Wire::net_index
+bool program_dirty = true; // Nets or order changed since it was compiled
+bool program_synced; // program_states match the wires
+
+// Sequential logic. A DFF latches its first input when its second input
+// rises and drives its output from the latched value, so levelize_circuit()
+// treats it as a source like an INPUT gate. CLOCK gates are sources toggled
+// once per half cycle.
+Gate **flip_flops; // Both lists are built by levelize_circuit()
+int num_of_flip_flops;
+bool *flip_flop_inputs; // Sampled before any flip-flop changes
+Gate **clocks;
+int num_of_clocks;
+long clock_cycles;
+
+// Free-running mode runs clock cycles at one of these rates, in Hz, with 0
+// meaning as fast as possible. Only used by the simulation thread.
+#define CLOCK_BATCH_SECONDS 0.01 // Longest run of cycles between commands
+const int clock_rates[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 0 };
+#define NUM_OF_CLOCK_RATES (int)(sizeof(clock_rates) / sizeof(int))
+int clock_rate_index = 1;
+bool free_running;
+double next_clock_time; // When the next cycle is due
+
+// Logic levels built by levelize_circuit(). Components in the same level only
+// read wires driven by lower levels, so they can be simulated in parallel.
+int *level_order;   // Components sorted by level
+int *level_start;   // Start of each level in level_order
+int *serial_start;  // Start of the components in each level that drive a
+                    // wire another gate also drives, simulated by one thread
+int num_of_levels;
+
+// Worker threads for the parallel engine. Worker 0 is the thread calling
+// update_circuit().
+#define MAX_WORKERS 64
+#define PARALLEL_MIN_GATES 4096 // Smaller circuits are simulated serially
+#define WORK_CHUNK 64 // Components taken from a range at a time
+
+typedef struct Worker {
+    // Part of the current level left to simulate, begin in the low 32 bits
+    // and end in the high 32 bits. Other workers steal from the end.
+    _Alignas(64) _Atomic uint64_t range;
+    int num_of_oscillating;
+    long gate_evaluations;
+    pthread_t thread;
+} Worker;
+
+Worker workers[MAX_WORKERS];
+int num_of_workers = 1;
+bool workers_started;
+pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t workers_wake = PTHREAD_COND_INITIALIZER;
+unsigned int parallel_update; // Bumped to start an update, under workers_lock
+atomic_int barrier_count;
+atomic_bool barrier_sense;
+
+// Gates whose connections need to be rebuilt after an edit
+GateHandle *dirty_gates;
+int num_of_dirty_gates;
+int dirty_gates_capacity;
+bool order_dirty; // The netlist changed and needs to be levelized again
+
+// Root wire of every net, numbered by update_nets()
+Wire **net_list;
+int num_of_nets;
+int net_list_capacity;
+bool nets_changed;
+
+// Wires that were added or moved and need to be joined to the wires they touch
+WireHandle *net_updates;
+int num_of_net_updates;
+int net_updates_capacity;
+
+// Rounds of joining nets and reconnecting gates per rebuild
+#define MAX_REBUILD_ROUNDS 4
+
+// Wire values for the bit parallel engine, one bit per input vector
+typedef uint64_t Lanes __attribute__((vector_size(32)));
+#define LANE_BITS (sizeof(Lanes) * 8)
+#define MAX_TRUTH_TABLE_INPUTS 24
+
+Lanes *lane_states; // Indexed by Wire::net_index
+int lane_states_capacity;
+
+// Stuck-at faults injected into the bit parallel engine. A net marked in
+// faulty_nets is forced to 0 in its stuck_at_0 lanes and to 1 in its
+// stuck_at_1 lanes. NULL outside of fault simulation.
+bool *faulty_nets;
+Lanes *stuck_at_0;
+Lanes *stuck_at_1;
+
+// Reduced ordered binary decision diagrams. Node 0 is false and node 1 is
+// true, every other node tests one input and is unique, so two functions are
+// the same exactly when they are the same node.
+#define BDD_FALSE 0
+#define BDD_TRUE 1
+#define DEFAULT_BDD_NODE_LIMIT (1 << 22)
+#define BDD_CACHE_SIZE (1 << 16) // Entries, a power of two
+
+typedef struct BddNode {
+    int var; // Input tested, INT_MAX for the terminals
+    int low, high; // Nodes for the input being 0 and 1
+    int next; // Next node in the same unique table bucket
+} BddNode;
+
+typedef struct BddCacheEntry {
+    int op; // OP_AND, OP_OR or OP_XOR, -1 if empty
+    int a, b;
+    int result;
+} BddCacheEntry;
+
+BddNode *bdd_nodes;
+int num_of_bdd_nodes;
+int bdd_nodes_capacity;
+int bdd_node_limit = DEFAULT_BDD_NODE_LIMIT;
+bool bdd_overflow; // The node limit was reached, the results are wrong
+int *bdd_unique; // Buckets of nodes by var, low and high
+int bdd_unique_size; // A power of two
+BddCacheEntry *bdd_cache; // Results of bdd_apply()
+
+// Board regions that changed since the last frame
+#define MAX_REDRAW_RECTS 256
+
+typedef struct Rect {
+    int x0, y0; // Inclusive corners
+    int x1, y1;
+} Rect;
+
+Rect redraw_rects[MAX_REDRAW_RECTS];
+int num_of_redraw_rects;
+bool redraw_all = true; // Clear the screen and draw everything
+int drawn_cursor_x = -1, drawn_cursor_y = -1;
+char drawn_status[256];
+
+Gate **visible_gates; // Components found by redraw_rect()
+int visible_gates_capacity;
+Wire **visible_wires;
+int visible_wires_capacity;
+
+// Gates waiting to be evaluated by the event driven engine
+GateHandle *event_queue;
+int event_queue_head;
+int event_queue_len;
+int event_queue_capacity;
+
+// Timed simulation. Output changes are scheduled on a timing wheel with one
+// slot per tick, which is long enough for the longest delay, so every
+// pending change is in the next TIMING_WHEEL_SLOTS ticks.
+#define TIMING_WHEEL_SLOTS 256
+#define MAX_GATE_DELAY (TIMING_WHEEL_SLOTS - 1)
+
+typedef struct TimedChange {
+    GateHandle gate;
+    bool state;
+} TimedChange;
+
+typedef struct TimingSlot {
+    TimedChange *changes;
+    int len;
+    int capacity;
+} TimingSlot;
+
+TimingSlot timing_wheel[TIMING_WHEEL_SLOTS];
+long num_of_timed_changes;
+long sim_time; // Tick the timed engine has reached
+
+// Delay of each gate type in ticks, changed with --delay
+int gate_delays[NUM_OF_GATE_TYPES] = {
+    [NOT] = 1, [AND] = 2, [OR] = 2, [XOR] = 3,
+    [INPUT] = 1, [CUSTOM] = 1, [DFF] = 2, [CLOCK] = 1
+};
+
+// Nets that changed since the timed engine was last quiet. Nets that changed
+// more than once glitched on the way to their final state and are shown as
+// hazards until the next change starts.
+WireHandle *hazard_nets;
+int num_of_hazard_nets;
+int hazard_nets_capacity;
+
+// Waveform recorder. Every thread that runs an engine appends the changes it
+// makes to its own ring, so recording takes no locks. Rings are split into
+// blocks that each start at a known time, and the oldest block is reused
+// when a ring is full. Records are varints, net index * 4 + state * 2 for a
+// change and ticks * 2 + 1 for a step forward in time.
+#define DEFAULT_WAVE_MEMORY (8 << 20) // Bytes for all the rings together
+#define WAVE_BLOCK_SIZE 4096
+#define MAX_WAVE_RECORD 16 // A step in time and a change
+
+typedef struct WaveRing {
+    uint8_t *data; // num_of_blocks blocks of WAVE_BLOCK_SIZE bytes
+    long *block_time; // Time the records in each block start from
+    int *block_len; // Bytes used in each block
+    int num_of_blocks;
+    int block; // Block being written
+    int oldest; // First block still holding records
+    bool wrapped; // Records older than the oldest block were dropped
+    long time; // Time of the last record
+} WaveRing;
+
+WaveRing wave_rings[MAX_WORKERS]; // By worker, only allocated if recording
+long wave_memory = DEFAULT_WAVE_MEMORY; // Changed with --wave-memory
+long wave_time; // Engine updates, or ticks of the timed engine
+long wave_start; // When recording last started
+_Thread_local int current_worker; // Index in workers of this thread
+
+// Simulation thread. It owns the wire states, input values and engine
+// settings while it runs. The UI draws from snapshots it publishes, sends
+// it commands and pauses it to edit the netlist.
+typedef struct Snapshot {
+    bool *net_states; // Indexed by Wire::net_index
+    bool *net_hazards;
+    bool *gate_values; // Indexed by Gate::index
+    bool *gate_oscillating;
+    int num_of_nets;
+    int num_of_gates;
+    int net_capacity;
+    int gate_capacity;
+    bool simulating;
+    int engine;
+    int num_of_oscillating;
+    bool free_running;
+    int clock_rate;
+    long clock_cycles;
+    long sim_time;
+    Stats stats;
+} Snapshot;
+
+// Three snapshots so the simulation can always write one while the UI reads
+// another. The third is the newest, waiting for the UI to pick it up.
+#define SNAPSHOT_NEW 4 // Set in ready_snapshot until the UI takes it
+Snapshot snapshots[3];
+atomic_int ready_snapshot = 0;
+int sim_snapshot = 1; // Only used by the simulation thread
+int ui_snapshot = 2;  // Only used by the UI thread
+
+typedef struct Command {
+    enum { COMMAND_TOGGLE_INPUT, COMMAND_TOGGLE_SIMULATION,
+           COMMAND_NEXT_ENGINE, COMMAND_CLOCK_CYCLE,
+           COMMAND_TOGGLE_FREE_RUNNING, COMMAND_CLOCK_FASTER,
+           COMMAND_CLOCK_SLOWER } type;
+    GateHandle gate;
+} Command;
+
+// Single producer, single consumer ring from the UI to the simulation
+#define COMMAND_QUEUE_LEN 256
+Command command_queue[COMMAND_QUEUE_LEN];
+atomic_uint command_head; // Only written by the simulation thread
+atomic_uint command_tail; // Only written by the UI thread
+
+pthread_t sim_thread;
+bool sim_thread_started;
+pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sim_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t sim_paused_cond = PTHREAD_COND_INITIALIZER;
+bool pause_requested; // These three are protected by sim_lock
+bool sim_paused;
+bool sim_quit;
+atomic_bool sim_changed; // A wire changed during the last update
+
+Stats stats;
+
+// Performance overlay in the status line, only used by the UI
+bool show_stats;
+Stats drawn_stats; // Counters when the last frame was drawn
+double last_draw_seconds;
+
+#define FRAME_TIME_MS 16
+
+// Functions
+
+// Memory
+
+static inline Wire *get_input(const Gate *gate, int i)
 {
-    Wire *wire = malloc(sizeof(Wire));
-    wire->x0 = x0;
-    wire->y0 = y0;
-    wire->x1 = x1;
-    wire->y1 = y1;
-    wire->state = 0;
-    wire_list = realloc(wire_list, ++wire_list_len * sizeof(Wire *));
-    wire_list[wire_list_len - 1] = wire;
-    wire->id = ++last_wire_id;
-    return wire;
+    return gate_inputs.items[gate->first_input + i].wire;
 }
 
-// Simulation
+static inline Gate *get_fanout(const Wire *wire, int i)
+{
+    return wire_fanouts.items[wire->first_fanout + i].gate;
+}
 
-void sim_and(const Gate *and)
+// Add a slice to the end of an edge list, returns the index of its first item
+int alloc_edges(EdgeList *list, int count)
 {
-    if (and->num_of_inputs > 0 && and->output != NULL) {
-        and->output->state = and->inputs[0]->state;
-        for (int i = 1; i < and->num_of_inputs; i++)
-            and->output->state = and->output->state & and->inputs[i]->state;
+    if (list->len + count > list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        if (list->capacity < list->len + count)
+            list->capacity = list->len + count;
+        list->items = realloc(list->items, list->capacity * sizeof(Edge));
     }
+    list->len += count;
+    return list->len - count;
 }
 
-void sim_or(const Gate *or)
+// Grow a slice, returns its new first item. Slices at the end of the list
+// grow in place, others are copied to the end and the old slice is left as
+// garbage until the list is compacted.
+int grow_edges(EdgeList *list, int first, int len, int capacity,
+               int new_capacity)
 {
-    if (or->num_of_inputs > 0 && or->output != NULL) {
-        or->output->state = or->inputs[0]->state;
-        for (int i = 1; i < or->num_of_inputs; i++)
-            or->output->state = or->output->state | or->inputs[i]->state;
+    if (first + capacity == list->len) {
+        alloc_edges(list, new_capacity - capacity);
+        return first;
     }
+
+    int new_first = alloc_edges(list, new_capacity);
+    memcpy(list->items + new_first, list->items + first, len * sizeof(Edge));
+    list->garbage += capacity;
+    return new_first;
 }
 
-void sim_not(const Gate *not)
+// Copy every live slice into a new list without the garbage between them
+void compact_gate_inputs()
 {
-    if (not->num_of_inputs > 0 && not->output != NULL) {
-        not->output->state = !not->inputs[0]->state;
+    EdgeList list = { malloc(gate_inputs.capacity * sizeof(Edge)), 0,
+                      gate_inputs.capacity, 0 };
+
+    for (int i = 0; i < gate_list_len; i++) {
+        Gate *gate = gate_list[i];
+        int first = alloc_edges(&list, gate->input_capacity);
+        memcpy(list.items + first, gate_inputs.items + gate->first_input,
+               gate->num_of_inputs * sizeof(Edge));
+        gate->first_input = first;
     }
+    free(gate_inputs.items);
+    gate_inputs = list;
 }
 
-void sim_xor(const Gate *xor)
+void compact_wire_fanouts()
 {
-    if (xor->num_of_inputs > 0 && xor->output != NULL) {
-        xor->output->state = xor->inputs[0]->state;
-        for (int i = 1; i < xor->num_of_inputs; i++)
-            xor->output->state = xor->output->state ^ xor->inputs[i]->state;
+    EdgeList list = { malloc(wire_fanouts.capacity * sizeof(Edge)), 0,
+                      wire_fanouts.capacity, 0 };
+
+    for (int i = 0; i < wire_list_len; i++) {
+        Wire *wire = wire_list[i];
+        int first = alloc_edges(&list, wire->fanout_capacity);
+        memcpy(list.items + first, wire_fanouts.items + wire->first_fanout,
+               wire->num_of_fanout * sizeof(Edge));
+        wire->first_fanout = first;
     }
+    free(wire_fanouts.items);
+    wire_fanouts = list;
 }
 
-void sim_input(const Gate *input)
+// Compact an edge list once more than half of it is garbage
+void collect_edge_garbage()
 {
-    if (input->output != NULL) {
-        input->output->state = input->value;
-    }
+    if (gate_inputs.garbage > 1024 && gate_inputs.garbage > gate_inputs.len / 2)
+        compact_gate_inputs();
+    if (wire_fanouts.garbage > 1024 &&
+        wire_fanouts.garbage > wire_fanouts.len / 2)
+        compact_wire_fanouts();
 }
 
-void sim_gate(const Gate *gate)
+// Make room for more gates and wires in the lists, doubling their size
+void reserve_components(int num_of_gates, int num_of_wires)
 {
-    switch (gate->type) {
-    case AND:
-        sim_and(gate);
-        break;
-    case OR:
-        sim_or(gate);
-        break;
-    case NOT:
-        sim_not(gate);
-        break;
-    case XOR:
-        sim_xor(gate);
-        break;
-    case INPUT:
-        sim_input(gate);
-        break;
-    case CUSTOM:
-        break;
+    if (gate_list_len + num_of_gates > gate_list_capacity) {
+        gate_list_capacity = gate_list_capacity ? gate_list_capacity * 2 : 64;
+        if (gate_list_capacity < gate_list_len + num_of_gates)
+            gate_list_capacity = gate_list_len + num_of_gates;
+        gate_list = realloc(gate_list, gate_list_capacity * sizeof(Gate *));
+    }
+    if (wire_list_len + num_of_wires > wire_list_capacity) {
+        wire_list_capacity = wire_list_capacity ? wire_list_capacity * 2 : 64;
+        if (wire_list_capacity < wire_list_len + num_of_wires)
+            wire_list_capacity = wire_list_len + num_of_wires;
+        wire_list = realloc(wire_list, wire_list_capacity * sizeof(Wire *));
     }
 }
 
-void gate_to_verilog(char *input_str, const Gate *gate, int output,
-                     int left_inp_id, int right_inp_id)
+static inline GateHandle get_gate_handle(Gate *gate)
 {
+    return (GateHandle){ gate, gate->generation };
+}
 
-    switch (gate->type) {
-    case AND:
-        sprintf(input_str, "assign w%d = w%d & w%d;\n", output, left_inp_id,
-                right_inp_id);
-        break;
-    case OR:
-        sprintf(input_str, "assign w%d = w%d | w%d;\n", output, left_inp_id,
-                right_inp_id);
-        break;
-    case NOT:
-        sprintf(input_str, "assign w%d = ~w%d;\n", output, left_inp_id);
-        break;
-    case XOR:
-        sprintf(input_str, "assign w%d = w%d ^ w%d;\n", output, left_inp_id,
-                right_inp_id);
-        break;
-    case INPUT:
-        break;
-    case CUSTOM:
-        break;
-    }
+static inline Gate *resolve_gate(GateHandle handle)
+{
+    return handle.gate->generation == handle.generation ? handle.gate : NULL;
 }
 
-void create_verilog()
+static inline WireHandle get_wire_handle(Wire *wire)
 {
-    char *verilog = malloc(25 * sizeof(char)); // Temp string for output
+    return (WireHandle){ wire, wire->generation };
+}
 
-    tb_shutdown();
-    printf("module main;\n");
-    for (int i = 0; i < wire_list_len; i++) { // Declare wires
-        sprintf(verilog, "wire w%d;\n", wire_list[i]->id);
-        printf("%s", verilog);
-    }
+static inline Wire *resolve_wire(WireHandle handle)
+{
+    return handle.wire->generation == handle.generation ? handle.wire : NULL;
+}
 
-    for (int i = 0; i < gate_list_len; i++) { // Ouput gates
-        if (gate_list[i] != NOT) {
-            if (gate_list[i]->num_of_inputs == 2 &&
-                gate_list[i]->output != NULL)
+// The Verilog name of a net, or w and its id if it has none
+const char *get_net_name(const Wire *net, char *buffer, size_t size)
+{
+    if (net->id < num_of_verilog_names && verilog_names[net->id] != NULL)
+        return verilog_names[net->id];
+    snprintf(buffer, size, "w%d", net->id);
+    return buffer;
+}
 
-                gate_to_verilog(verilog, gate_list[i], gate_list[i]->output->id,
-                                gate_list[i]->inputs[0]->id,
-                                gate_list[i]->inputs[1]->id);
-        } else {
-            if (gate_list[i]->num_of_inputs == 1 &&
-                gate_list[i]->output != NULL)
+// Statistics
 
-                gate_to_verilog(verilog, gate_list[i], gate_list[i]->output->id,
-                                gate_list[i]->inputs[0]->id, 0);
-        }
-        printf(verilog);
-    }
-    printf("endmodule\n");
-    tb_init();
-    free(verilog);
+double get_time_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
 }
 
-void update_circuit()
+// Write the counters as one name and value per line
+void write_stats(FILE *file, const Stats *stats)
 {
-    for (int j = 0; j < gate_list_len; j++)
-        for (int i = 0; i < gate_list_len; i++)
-            sim_gate(gate_list[i]);
+    fprintf(file, "gates %d\n", gate_list_len);
+    fprintf(file, "wires %d\n", wire_list_len);
+    fprintf(file, "nets %d\n", num_of_nets);
+    fprintf(file, "clock_cycles %ld\n", clock_cycles);
+    fprintf(file, "steps %ld\n", stats->steps);
+    fprintf(file, "step_seconds %.6f\n", stats->step_seconds);
+    fprintf(file, "gate_evaluations %ld\n", stats->gate_evaluations);
+    fprintf(file, "events %ld\n", stats->events);
+    fprintf(file, "builds %ld\n", stats->builds);
+    fprintf(file, "build_seconds %.6f\n", stats->build_seconds);
+    fprintf(file, "gates_removed %d\n", stats->gates_removed);
+    fprintf(file, "bdd_nodes %d\n", num_of_bdd_nodes);
 }
 
-void build_representation_from_graphics()
+// Redraw tracking. Anything that changes how a part of the screen looks marks
+// that part, and draw() only redraws the marked rectangles.
+
+// The part of the board on screen
+Rect get_view_rect()
 {
-    // Scan for connections between gates
-    for (int i = 0; i < gate_list_len; i++) {
-        Gate *cur_gate = gate_list[i];
-        cur_gate->output = NULL;
-        cur_gate->num_of_inputs = 0; // Reset gate inputs
-
-        for (int j = 0; j < wire_list_len; j++) {
-            Wire *cur_wire = wire_list[j];
-            // Connection to input
-            if (cur_wire->x1 == cur_gate->x && cur_wire->y1 >= cur_gate->y &&
-                cur_wire->y1 != cur_gate->y + 1 &&
-                cur_wire->y1 <= cur_gate->y + cur_gate->height) {
-
-                cur_gate->inputs = realloc(cur_gate->inputs,
-                        ++cur_gate->num_of_inputs * sizeof(Wire *));
-                cur_gate->inputs[cur_gate->num_of_inputs - 1] = cur_wire;
-            // Not gate input
-            } else if (cur_wire->x1 == cur_gate->x &&
-                       cur_wire->y1 == cur_gate->y + 1 &&
-                       cur_gate->type == NOT) {
-
-                cur_gate->inputs = realloc(cur_gate->inputs,
-                        ++cur_gate->num_of_inputs * sizeof(Wire *));
-                cur_gate->inputs[cur_gate->num_of_inputs - 1] = cur_wire;
-            // Outputs
-            } else if (cur_wire->x0 == cur_gate->x + cur_gate->width &&
-                       cur_wire->y0 == cur_gate->y + 1) {
-
-                cur_gate->output = cur_wire;
-            // Swap wires around
-            } else if ((cur_wire->x0 == cur_gate->x && 
-                       cur_wire->y0 >= cur_gate->y &&
-                       cur_wire->y0 != cur_gate->y + 1 &&
-                       cur_wire->y0 <= cur_gate->y + cur_gate->height) ||
-
-                       (cur_wire->x0 == cur_gate->x &&
-                       cur_wire->y0 == cur_gate->y + 1 &&
-                       cur_gate->type == NOT) ||
-
-                       (cur_wire->x0 == cur_gate->x + cur_gate->width &&
-                       cur_wire->y0 == cur_gate->y + 1)) {
-
-                int tmp_x = cur_wire->x0;
-                int tmp_y = cur_wire->y0;
-                cur_wire->y0 = cur_wire->y1;
-                cur_wire->x0 = cur_wire->x1;
-                cur_wire->x1 = tmp_x;
-                cur_wire->y1 = tmp_y;
-            }
-        }
-    }
-
-    /*
-    // Scan for connections between wires
-    for (int i = 0; i < wire_list_len; i++) {
-        for (int j = 0; j < wire_list_len; j++) {
-            if (j == i) continue;
-            Wire *wire_a = wire_list[i];
-            Wire *wire_b = wire_list[j];
-
-            // Check for wire connection
-            if (((wire_b->x1 == wire_a->x0 && wire_b->y1 < wire_a->y1) ||
-                (wire_b->x1 < wire_a->x1 && wire_b->y1 == wire_a->y1)  ||
-                (wire_b->x1 == wire_a->x1 || wire_b->y1 == wire_a->y1))
-                ||
-                ((wire_b->x0 == wire_a->x0 && wire_b->y0 < wire_a->y1) ||
-                (wire_b->x0 < wire_a->x1 && wire_b->y0 == wire_a->y1)  ||
-                (wire_b->x0 == wire_a->x1 || wire_b->y0 == wire_a->y1))) {
-                
-                if (wire_b->state || wire_a->state) {
-                    wire_b->state = wire_b->state | wire_a->state;
-                }
-            }
-        }
+    return (Rect){ view_x, view_y, view_x + tb_width() - 1,
+                   view_y + tb_height() - 1 };
+}
+
+// Mark a rectangle of the board. Rectangles off the screen are dropped, the
+// whole screen is redrawn when it scrolls.
+void mark_rect_redraw(int x0, int y0, int x1, int y1)
+{
+    if (redraw_all) return;
+
+    Rect rect = { x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1,
+                  x0 < x1 ? x1 : x0, y0 < y1 ? y1 : y0 };
+    Rect view = get_view_rect();
+    if (rect.x1 < view.x0 || rect.y1 < view.y0 ||
+        rect.x0 > view.x1 || rect.y0 > view.y1)
+        return;
+
+    if (num_of_redraw_rects == MAX_REDRAW_RECTS) { // Cheaper to draw it all
+        redraw_all = true;
+        return;
     }
-    */
+    redraw_rects[num_of_redraw_rects++] = rect;
 }
 
-// Graphics
+void mark_gate_redraw(const Gate *gate)
+{
+    if (gate->instance != NULL) return; // Parts aren't drawn
 
-void draw_wire(const Wire *wire)
+    // The output pin sticks out one cell to the right
+    mark_rect_redraw(gate->x, gate->y, gate->x + gate->width,
+                     gate->y + gate->height - 1);
+}
+
+void mark_wire_redraw(const Wire *wire)
 {
-    if (wire->state) {
-        tb_change_cell(wire->x0, wire->y0, '-', TB_BLUE|TB_BOLD, TB_DEFAULT);
-        tb_change_cell(wire->x1, wire->y1, '-', TB_BLUE|TB_BOLD, TB_DEFAULT);
-        draw_line(wire->x0, wire->y0 + 1, wire->x0, wire->y1, '-',
-                  TB_BLUE|TB_BOLD, TB_DEFAULT);
-        draw_line(wire->x0, wire->y1, wire->x1, wire->y1, '-', TB_BLUE|TB_BOLD,
-                  TB_DEFAULT);
-    } else {
-        tb_change_cell(wire->x0, wire->y0, '-', TB_RED|TB_BOLD, TB_DEFAULT);
-        tb_change_cell(wire->x1, wire->y1, '-', TB_RED|TB_BOLD, TB_DEFAULT);
-        draw_line(wire->x0, wire->y0 + 1, wire->x0, wire->y1, '-',
-                  TB_RED|TB_BOLD, TB_DEFAULT);
-        draw_line(wire->x0, wire->y1, wire->x1, wire->y1, '-', TB_RED|TB_BOLD,
-                  TB_DEFAULT);
+    if (wire->instance != NULL) return;
+    mark_rect_redraw(wire->x0, wire->y0, wire->x0, wire->y1);
+    mark_rect_redraw(wire->x0, wire->y1, wire->x1, wire->y1);
+}
+
+// Waveform recording
+
+// Drop everything recorded, net indices are about to change
+void clear_waveform()
+{
+    for (int i = 0; i < MAX_WORKERS && wave_rings[i].data != NULL; i++) {
+        WaveRing *ring = &wave_rings[i];
+        ring->block = 0;
+        ring->oldest = 0;
+        ring->wrapped = false;
+        ring->time = wave_time;
+        ring->block_time[0] = wave_time;
+        ring->block_len[0] = 0;
     }
+    wave_start = wave_time;
 }
 
-char *get_gate_ascii(const Gate *gate)
+// Split wave_memory between a ring for each worker and start recording
+void start_waveform()
 {
-    switch (gate->type) {
-    case AND:
-        return "-#######\n"
-               " # AND #-\n"
-               "-#######";
-    case OR:
-        return "-#######\n"
-               " # OR  #-\n"
-               "-#######";
-    case NOT:
-        return " #######\n"
-               "-# NOT #-\n"
-               " #######";
-    case XOR:
-        return "-#######\n"
-               " # XOR #-\n"
-               "-#######";
-    case INPUT:
-        return "########\n"
-               "# Inp  #-\n"
-               "########";
-    case CUSTOM:
-        break;
+    int num_of_blocks = wave_memory / num_of_workers / WAVE_BLOCK_SIZE;
+    if (num_of_blocks < 2) num_of_blocks = 2;
+
+    for (int i = 0; i < num_of_workers; i++) {
+        WaveRing *ring = &wave_rings[i];
+        ring->data = malloc((size_t)num_of_blocks * WAVE_BLOCK_SIZE);
+        ring->block_time = malloc(num_of_blocks * sizeof(long));
+        ring->block_len = malloc(num_of_blocks * sizeof(int));
+        ring->num_of_blocks = num_of_blocks;
     }
-    return "";
+    clear_waveform();
 }
 
-void draw_circuit()
+static inline uint8_t *put_varint(uint8_t *p, uint64_t value)
 {
-    for (int i = 0; i < gate_list_len; i++) {
-        if (gate_list[i]->type == INPUT) {
-            if (gate_list[i]->value == 1)
-                draw_text(get_gate_ascii(gate_list[i]),
-                          gate_list[i]->x, gate_list[i]->y,
-                          TB_BLUE|TB_BOLD, TB_DEFAULT);
-            else
-                draw_text(get_gate_ascii(gate_list[i]),
-                          gate_list[i]->x, gate_list[i]->y,
-                          TB_RED|TB_BOLD, TB_DEFAULT);
-        } else {
-            draw_text(get_gate_ascii(gate_list[i]),
-                      gate_list[i]->x, gate_list[i]->y,
-                      TB_GREEN, TB_DEFAULT);
-        }
+    while (value >= 0x80) {
+        *p++ = (value & 0x7f) | 0x80;
+        value >>= 7;
     }
-    for (int i = 0; i < wire_list_len; i++)
-        draw_wire(wire_list[i]);
+    *p++ = value;
+    return p;
 }
 
-void draw()
+const uint8_t *get_varint(const uint8_t *p, uint64_t *value)
 {
-    tb_clear();
-    draw_circuit();
-    tb_change_cell(cursor_x, cursor_y, '+', TB_WHITE, TB_DEFAULT);
-    if (simulate_circuit) draw_text("Simulation running.", 0, tb_height() - 1,
-                                    TB_WHITE, TB_DEFAULT);
-    tb_present();
+    *value = 0;
+    for (int shift = 0;; shift += 7) {
+        *value |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) return p;
+    }
 }
 
-// User Input
+// Append a change to the calling thread's ring
+void record_wave_change(const Wire *net)
+{
+    WaveRing *ring = &wave_rings[current_worker];
 
-int get_gate_under_cursor()
+    if (ring->block_len[ring->block] > WAVE_BLOCK_SIZE - MAX_WAVE_RECORD) {
+        ring->block = (ring->block + 1) % ring->num_of_blocks;
+        if (ring->block == ring->oldest) { // Full, drop the oldest block
+            ring->oldest = (ring->oldest + 1) % ring->num_of_blocks;
+            ring->wrapped = true;
+        }
+        ring->block_time[ring->block] = ring->time;
+        ring->block_len[ring->block] = 0;
+    }
+
+    uint8_t *block = ring->data + (size_t)ring->block * WAVE_BLOCK_SIZE;
+    uint8_t *p = block + ring->block_len[ring->block];
+    if (ring->time != wave_time) {
+        p = put_varint(p, (uint64_t)(wave_time - ring->time) * 2 + 1);
+        ring->time = wave_time;
+    }
+    p = put_varint(p, (uint64_t)net->net_index * 4 + net->state * 2);
+    ring->block_len[ring->block] = p - block;
+}
+
+// Earliest time every ring still has all the changes from
+long get_waveform_start()
 {
-    for (int i = 0; i < gate_list_len; i++)
-        if (cursor_x >= gate_list[i]->x &&
-            cursor_y >= gate_list[i]->y &&
-            cursor_x < gate_list[i]->width + gate_list[i]->x &&
-            cursor_y < gate_list[i]->height + gate_list[i]->y)
-            return i;
-    return -1;
+    long start = wave_start;
+    for (int i = 0; i < MAX_WORKERS && wave_rings[i].data != NULL; i++) {
+        const WaveRing *ring = &wave_rings[i];
+        if (ring->wrapped && ring->block_time[ring->oldest] > start)
+            start = ring->block_time[ring->oldest];
+    }
+    return start;
 }
 
-int get_wire_under_cursor()
+typedef struct WaveChange {
+    long time;
+    int order; // Position in its ring, times are shared between rings
+    int net;
+    bool state;
+} WaveChange;
+
+int compare_wave_change(const void *a, const void *b)
 {
-    for (int i = 0; i < wire_list_len; i++)
-        if ((cursor_x == wire_list[i]->x0 && cursor_y < wire_list[i]->y1) ||
-            (cursor_x < wire_list[i]->x1 && cursor_y == wire_list[i]->y1) ||
-            (cursor_x == wire_list[i]->x1 || cursor_y == wire_list[i]->y1))
-            return i;
-    return -1;
+    const WaveChange *change_a = a;
+    const WaveChange *change_b = b;
+    if (change_a->time != change_b->time)
+        return change_a->time < change_b->time ? -1 : 1;
+    return change_a->order - change_b->order;
 }
 
-void handle_cursor_input(const struct tb_event *event)
+// VCD identifier of a net, printable characters in base 94
+void write_vcd_id(FILE *file, int net)
 {
-    if (event->key == TB_KEY_ARROW_DOWN || event->ch == 'j' ||
-        event->ch == 'J') {
-        if (!(cursor_y + 2 > tb_height())) cursor_y++;
-    } else if (event->key == TB_KEY_ARROW_UP || event->ch == 'k' ||
-               event->ch == 'K') {
-        if (!(cursor_y - 1 < 0)) cursor_y--;
-    } else if (event->key == TB_KEY_ARROW_LEFT || event->ch == 'h' ||
-               event->ch == 'H') {
-        if (!(cursor_x - 1 < 0)) cursor_x--;
-    } else if (event->key == TB_KEY_ARROW_RIGHT || event->ch == 'l' ||
-               event->ch == 'L') {
-        if (!(cursor_x + 2 > tb_width())) cursor_x++;
-    }
+    do {
+        putc('!' + net % 94, file);
+        net /= 94;
+    } while (net > 0);
 }
 
-void move_component_at_cursor()
+// Write the recorded changes of the board's nets between two times as a VCD
+// file. The values at the first time are worked out backwards from the
+// current states, so the simulation must not be running. The window is
+// limited to what is still recorded. Returns false if the file can't be
+// written.
+bool write_vcd(const char *path, long first, long last)
 {
-    struct tb_event event;
-    int gate_index = get_gate_under_cursor();
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return false;
 
-    if (gate_index >= 0) { // If there is a gate under the cursor
-        Gate *gate_to_move = gate_list[gate_index];
+    if (first < get_waveform_start()) first = get_waveform_start();
+    if (last > wave_time) last = wave_time;
+
+    // Decode every ring, from the oldest block on
+    WaveChange *changes = NULL;
+    int num_of_changes = 0;
+    int changes_capacity = 0;
+    for (int i = 0; i < MAX_WORKERS && wave_rings[i].data != NULL; i++) {
+        const WaveRing *ring = &wave_rings[i];
+        int order = 0;
+        for (int block = ring->oldest;;
+             block = (block + 1) % ring->num_of_blocks) {
+            const uint8_t *p = ring->data + (size_t)block * WAVE_BLOCK_SIZE;
+            const uint8_t *end = p + ring->block_len[block];
+            long time = ring->block_time[block];
+
+            while (p < end) {
+                uint64_t record;
+                p = get_varint(p, &record);
+                if (record & 1) {
+                    time += record >> 1;
+                    continue;
+                }
+                if (time <= first) continue; // Only needed for the states
+                if (num_of_changes == changes_capacity) {
+                    changes_capacity = changes_capacity ?
+                                       changes_capacity * 2 : 1024;
+                    changes = realloc(changes, changes_capacity *
+                                               sizeof(WaveChange));
+                }
+                changes[num_of_changes++] = (WaveChange){
+                    time, order++, record >> 2, record >> 1 & 1
+                };
+            }
+            if (block == ring->block) break;
+        }
+    }
+    qsort(changes, num_of_changes, sizeof(WaveChange), compare_wave_change);
+
+    // Every change flipped its net, so before the first one after the
+    // window starts the net had the other state
+    bool *states = malloc(num_of_nets + 1);
+    for (int i = 0; i < num_of_nets; i++) states[i] = net_list[i]->state;
+    for (int i = num_of_changes - 1; i >= 0; i--)
+        states[changes[i].net] = !changes[i].state;
+
+    fprintf(file, "$version logic-simulator $end\n"
+                  "$comment Times are engine updates, or ticks of the timed "
+                  "engine $end\n"
+                  "$timescale 1ns $end\n$scope module circuit $end\n");
+    for (int i = 0; i < num_of_nets; i++) {
+        if (net_list[i]->instance != NULL) continue;
+        char buffer[16];
+        fprintf(file, "$var wire 1 ");
+        write_vcd_id(file, i);
+        fprintf(file, " %s $end\n",
+                get_net_name(net_list[i], buffer, sizeof(buffer)));
+    }
+    fprintf(file, "$upscope $end\n$enddefinitions $end\n#%ld\n$dumpvars\n",
+            first);
+    for (int i = 0; i < num_of_nets; i++) {
+        if (net_list[i]->instance != NULL) continue;
+        putc('0' + states[i], file);
+        write_vcd_id(file, i);
+        putc('\n', file);
+    }
+    fprintf(file, "$end\n");
+
+    long time = first;
+    for (int i = 0; i < num_of_changes && changes[i].time <= last; i++) {
+        if (net_list[changes[i].net]->instance != NULL) continue;
+        if (changes[i].time != time) {
+            time = changes[i].time;
+            fprintf(file, "#%ld\n", time);
+        }
+        putc('0' + changes[i].state, file);
+        write_vcd_id(file, changes[i].net);
+        putc('\n', file);
+    }
+
+    free(states);
+    free(changes);
+    return fclose(file) == 0;
+}
+
+// Called by every engine when a wire's state changes
+void note_wire_change(const Wire *wire)
+{
+    if (wave_rings[0].data != NULL && wire->net->instance == NULL)
+        record_wave_change(wire->net);
+
+    // Only written once per update so parallel workers don't fight over it
+    if (!atomic_load_explicit(&sim_changed, memory_order_relaxed))
+        atomic_store_explicit(&sim_changed, true, memory_order_relaxed);
+}
+
+// Dirty tracking. Edits mark the gates whose pins they touched and only those
+// gates are reconnected by the next call to build_representation_from_graphics
+
+void mark_gate_dirty(Gate *gate)
+{
+    if (gate->instance != NULL) gate = gate->instance; // Parts are rebuilt
+    if (gate->dirty) return;                           // with the instance
+
+    if (num_of_dirty_gates == dirty_gates_capacity) {
+        dirty_gates_capacity = dirty_gates_capacity ?
+                               dirty_gates_capacity * 2 : 64;
+        dirty_gates = realloc(dirty_gates,
+                              dirty_gates_capacity * sizeof(GateHandle));
+    }
+    gate->dirty = true;
+    dirty_gates[num_of_dirty_gates++] = get_gate_handle(gate);
+}
+
+// Mark every gate with a pin on the given cell
+void mark_pins_dirty(int x, int y)
+{
+    for (int e = spatial_find(&pin_grid, x, y); e >= 0;
+         e = spatial_find_next(&pin_grid, e))
+        if (pin_grid.entries[e].tag != WIRE_END)
+            mark_gate_dirty(pin_grid.entries[e].item);
+}
+
+void mark_wire_dirty(const Wire *wire)
+{
+    mark_pins_dirty(wire->x0, wire->y0);
+    mark_pins_dirty(wire->x1, wire->y1);
+}
+
+// Nets. Wires that touch are joined into one net, kept as a union-find
+// where every wire points straight at its net's root and joining two nets
+// relabels the smaller one. The root wire holds the state, driver and fanout
+// of the whole net, so gates only ever connect to root wires.
+
+// Join a wire to the wires it touches on the next update_nets()
+void queue_net_update(Wire *wire)
+{
+    if (wire->net_dirty) return;
+
+    if (num_of_net_updates == net_updates_capacity) {
+        net_updates_capacity = net_updates_capacity ?
+                               net_updates_capacity * 2 : 64;
+        net_updates = realloc(net_updates,
+                              net_updates_capacity * sizeof(WireHandle));
+    }
+    wire->net_dirty = true;
+    net_updates[num_of_net_updates++] = get_wire_handle(wire);
+}
+
+// The gates connected to a net have to be reconnected when its root changes
+void mark_net_gates_dirty(const Wire *root)
+{
+    if (root->driver != NULL) mark_gate_dirty(root->driver);
+    for (int i = 0; i < root->num_of_fanout; i++)
+        mark_gate_dirty(get_fanout(root, i));
+}
+
+void join_nets(Wire *a, Wire *b)
+{
+    Wire *root = a->net;
+    Wire *other = b->net;
+    if (root == other) return;
+    if (root->net_size < other->net_size) {
+        Wire *tmp = root;
+        root = other;
+        other = tmp;
+    }
+
+    mark_net_gates_dirty(other);
+    Wire *wire = other;
+    do {
+        wire->net = root;
+        wire = wire->next_in_net;
+    } while (wire != other);
+
+    // Splice the two circular lists together
+    Wire *next = root->next_in_net;
+    root->next_in_net = other->next_in_net;
+    other->next_in_net = next;
+    root->net_size += other->net_size;
+    nets_changed = true;
+}
+
+// Take a wire out of its net before it is moved or deleted. Union-find can't
+// split a net, so the other wires become nets of their own and are joined up
+// again by the next update_nets().
+void split_net(Wire *wire)
+{
+    mark_net_gates_dirty(wire->net);
+
+    Wire *member = wire;
+    do {
+        Wire *next = member->next_in_net;
+        member->net = member;
+        member->next_in_net = member;
+        member->net_size = 1;
+        if (member != wire) queue_net_update(member);
+        member = next;
+    } while (member != wire);
+    nets_changed = true;
+}
+
+// Spatial index
+
+// Rows of a gate's input pins, which are all in the gate's left column.
+// Returns the number of pins.
+int get_gate_input_pins(const Gate *gate, int *pin_y)
+{
+    switch (gate->type) {
+    case AND:
+    case OR:
+    case XOR:
+    case DFF: // Data, then clock
+        pin_y[0] = gate->y;
+        pin_y[1] = gate->y + 2;
+        return 2;
+    case NOT:
+        pin_y[0] = gate->y + 1;
+        return 1;
+    case INPUT:
+    case CLOCK:
+        break;
+    case CUSTOM:
+        for (int i = 0; i < gate->definition->num_of_inputs; i++)
+            pin_y[i] = gate->y + 1 + 2 * i;
+        return gate->definition->num_of_inputs;
+    }
+    return 0;
+}
+
+// Rows of a gate's output pins, one column right of the gate
+int get_gate_output_pins(const Gate *gate, int *pin_y)
+{
+    if (gate->type != CUSTOM) {
+        pin_y[0] = gate->y + 1;
+        return 1;
+    }
+    for (int i = 0; i < gate->definition->num_of_outputs; i++)
+        pin_y[i] = gate->y + 1 + 2 * i;
+    return gate->definition->num_of_outputs;
+}
+
+void index_gate(Gate *gate)
+{
+    int pin_y[MAX_PINS];
+    int num_of_pins = get_gate_input_pins(gate, pin_y);
+
+    for (int i = 0; i < num_of_pins; i++)
+        spatial_insert(&pin_grid, gate->x, pin_y[i], gate, PIN_INPUT);
+    num_of_pins = get_gate_output_pins(gate, pin_y);
+    for (int i = 0; i < num_of_pins; i++)
+        spatial_insert(&pin_grid, gate->x + gate->width, pin_y[i], gate,
+                       PIN_OUTPUT);
+    spatial_insert_rect(&area_grid, gate->x, gate->y,
+                        gate->x + gate->width - 1, gate->y + gate->height - 1,
+                        gate, AREA_GATE);
+    mark_gate_redraw(gate);
+}
+
+void unindex_gate(Gate *gate)
+{
+    int pin_y[MAX_PINS];
+    int num_of_pins = get_gate_input_pins(gate, pin_y);
+
+    for (int i = 0; i < num_of_pins; i++)
+        spatial_remove(&pin_grid, gate->x, pin_y[i], gate);
+    num_of_pins = get_gate_output_pins(gate, pin_y);
+    for (int i = 0; i < num_of_pins; i++)
+        spatial_remove(&pin_grid, gate->x + gate->width, pin_y[i], gate);
+    spatial_remove_rect(&area_grid, gate->x, gate->y,
+                        gate->x + gate->width - 1, gate->y + gate->height - 1,
+                        gate);
+    mark_gate_redraw(gate);
+}
+
+// Wires run vertically from (x0, y0) and then horizontally to (x1, y1)
+void index_wire_area(Wire *wire)
+{
+    spatial_insert_rect(&area_grid, wire->x0, wire->y0, wire->x0, wire->y1,
+                        wire, AREA_WIRE);
+    spatial_insert_rect(&area_grid, wire->x0, wire->y1, wire->x1, wire->y1,
+                        wire, AREA_WIRE);
+    mark_wire_redraw(wire);
+}
+
+void unindex_wire_area(Wire *wire)
+{
+    spatial_remove_rect(&area_grid, wire->x0, wire->y0, wire->x0, wire->y1,
+                        wire);
+    spatial_remove_rect(&area_grid, wire->x0, wire->y1, wire->x1, wire->y1,
+                        wire);
+    mark_wire_redraw(wire);
+}
+
+void index_wire(Wire *wire)
+{
+    spatial_insert(&pin_grid, wire->x0, wire->y0, wire, WIRE_END);
+    if (wire->x1 != wire->x0 || wire->y1 != wire->y0)
+        spatial_insert(&pin_grid, wire->x1, wire->y1, wire, WIRE_END);
+    index_wire_area(wire);
+    queue_net_update(wire);
+}
+
+void unindex_wire(Wire *wire)
+{
+    split_net(wire);
+    spatial_remove(&pin_grid, wire->x0, wire->y0, wire);
+    spatial_remove(&pin_grid, wire->x1, wire->y1, wire);
+    unindex_wire_area(wire);
+}
+
+bool wire_covers_cell(const Wire *wire, int x, int y)
+{
+    int min_x = wire->x0 < wire->x1 ? wire->x0 : wire->x1;
+    int max_x = wire->x0 < wire->x1 ? wire->x1 : wire->x0;
+    int min_y = wire->y0 < wire->y1 ? wire->y0 : wire->y1;
+    int max_y = wire->y0 < wire->y1 ? wire->y1 : wire->y0;
+
+    return (x == wire->x0 && y >= min_y && y <= max_y) ||
+           (y == wire->y1 && x >= min_x && x <= max_x);
+}
+
+// Join a wire's net with every wire that has an end on it, and with every
+// wire that one of its ends lies on. Wires that only cross don't connect.
+void join_touching_wires(Wire *wire)
+{
+    int size = 1 << area_grid.shift;
+    int rects[2][4] = { { wire->x0, wire->y0, wire->x0, wire->y1 },
+                        { wire->x0, wire->y1, wire->x1, wire->y1 } };
+
+    for (int r = 0; r < 2; r++) {
+        int x0 = rects[r][0] < rects[r][2] ? rects[r][0] : rects[r][2];
+        int x1 = rects[r][0] < rects[r][2] ? rects[r][2] : rects[r][0];
+        int y0 = rects[r][1] < rects[r][3] ? rects[r][1] : rects[r][3];
+        int y1 = rects[r][1] < rects[r][3] ? rects[r][3] : rects[r][1];
+
+        for (int y = y0 >> area_grid.shift; y <= y1 >> area_grid.shift; y++) {
+            for (int x = x0 >> area_grid.shift; x <= x1 >> area_grid.shift;
+                 x++) {
+                for (int e = spatial_find(&area_grid, x * size, y * size);
+                     e >= 0; e = spatial_find_next(&area_grid, e)) {
+                    Wire *other = area_grid.entries[e].item;
+                    if (area_grid.entries[e].tag != AREA_WIRE ||
+                        other == wire || other->net == wire->net)
+                        continue;
+
+                    if (wire_covers_cell(wire, other->x0, other->y0) ||
+                        wire_covers_cell(wire, other->x1, other->y1) ||
+                        wire_covers_cell(other, wire->x0, wire->y0) ||
+                        wire_covers_cell(other, wire->x1, wire->y1))
+                        join_nets(wire, other);
+                }
+            }
+        }
+    }
+}
+
+int compare_gate_index(const void *a, const void *b)
+{
+    return (*(Gate **)a)->index - (*(Gate **)b)->index;
+}
+
+int compare_wire_index(const void *a, const void *b)
+{
+    return (*(Wire **)a)->index - (*(Wire **)b)->index;
+}
+
+// Find the components overlapping a rectangle of the board with the spatial
+// index, sorted into the order they are drawn in
+void find_visible_components(Rect rect, int *num_of_gates, int *num_of_wires)
+{
+    // Gates are one cell wider than their area because of the output pin
+    int shift = area_grid.shift;
+    int size = 1 << shift;
+    *num_of_gates = 0;
+    *num_of_wires = 0;
+    for (int y = rect.y0 >> shift; y <= rect.y1 >> shift; y++) {
+        for (int x = (rect.x0 - 1) >> shift; x <= rect.x1 >> shift; x++) {
+            for (int e = spatial_find(&area_grid, x * size, y * size);
+                 e >= 0; e = spatial_find_next(&area_grid, e)) {
+                if (*num_of_gates == visible_gates_capacity) {
+                    visible_gates_capacity = visible_gates_capacity ?
+                                             visible_gates_capacity * 2 : 64;
+                    visible_gates = realloc(visible_gates,
+                            visible_gates_capacity * sizeof(Gate *));
+                }
+                if (*num_of_wires == visible_wires_capacity) {
+                    visible_wires_capacity = visible_wires_capacity ?
+                                             visible_wires_capacity * 2 : 64;
+                    visible_wires = realloc(visible_wires,
+                            visible_wires_capacity * sizeof(Wire *));
+                }
+
+                if (area_grid.entries[e].tag == AREA_GATE)
+                    visible_gates[(*num_of_gates)++] =
+                        area_grid.entries[e].item;
+                else
+                    visible_wires[(*num_of_wires)++] =
+                        area_grid.entries[e].item;
+            }
+        }
+    }
+
+    // Components in more than one tile are found more than once
+    qsort(visible_gates, *num_of_gates, sizeof(Gate *), compare_gate_index);
+    qsort(visible_wires, *num_of_wires, sizeof(Wire *), compare_wire_index);
+    int len = 0;
+    for (int i = 0; i < *num_of_gates; i++)
+        if (len == 0 || visible_gates[i] != visible_gates[len - 1])
+            visible_gates[len++] = visible_gates[i];
+    *num_of_gates = len;
+    len = 0;
+    for (int i = 0; i < *num_of_wires; i++)
+        if (len == 0 || visible_wires[i] != visible_wires[len - 1])
+            visible_wires[len++] = visible_wires[i];
+    *num_of_wires = len;
+}
+
+// Add a gate to the list without placing it on the board
+Gate *alloc_gate(int num_of_inputs, int type, int x, int y)
+{
+    // Allocate memory
+    Gate *gate = pool_alloc(&gate_pool);
+    gate->first_input = alloc_edges(&gate_inputs, num_of_inputs);
+    gate->input_capacity = num_of_inputs;
+
+    // Add gate to list
+    reserve_components(1, 0);
+    gate_list[gate_list_len++] = gate;
+    gate->index = gate_list_len - 1;
+
+    gate->type = type; // Set type
+
+    gate->x = x;
+    gate->y = y;
+    if (type != CUSTOM) {
+        gate->width = 8;
+        gate->height = 3;
+    }
+
+    gate->value = 0;
+    gate->last_clock = false;
+    gate->delay = 0;
+    gate->num_of_pending = 0;
+    gate->num_of_inputs = 0;
+    gate->output = NULL;
+    gate->oscillating = false;
+    gate->queued = false;
+    gate->dirty = false;
+    gate->shown_value = 0;
+    gate->shown_oscillating = false;
+    gate->definition = NULL;
+    gate->parts = NULL;
+    gate->part_wires = NULL;
+    gate->instance = NULL;
+    return gate;
+}
+
+Gate *new_gate(int num_of_inputs, int type, int x, int y)
+{
+    Gate *gate = alloc_gate(num_of_inputs, type, x, y);
+    index_gate(gate);
+    mark_gate_dirty(gate);
+    return gate;
+}
+
+// Place an instance of a sub-circuit. Its parts are added when it is first
+// connected.
+Gate *new_custom_gate(const Definition *definition, int x, int y)
+{
+    Gate *gate = alloc_gate(definition->num_of_inputs, CUSTOM, x, y);
+    gate->definition = definition;
+    gate->width = definition->width;
+    gate->height = definition->height;
+    index_gate(gate);
+    mark_gate_dirty(gate);
+    return gate;
+}
+
+// Add a wire to the list without placing it on the board
+Wire *alloc_wire(int x0, int y0, int x1, int y1)
+{
+    Wire *wire = pool_alloc(&wire_pool);
+    wire->x0 = x0;
+    wire->y0 = y0;
+    wire->x1 = x1;
+    wire->y1 = y1;
+    wire->state = 0;
+    wire->driver = NULL;
+    wire->first_fanout = 0;
+    wire->num_of_fanout = 0;
+    wire->fanout_capacity = 0;
+    wire->shown_state = 0;
+    wire->shown_hazard = false;
+    wire->transitions = 0;
+    wire->net = wire;
+    wire->next_in_net = wire;
+    wire->net_size = 1;
+    wire->net_dirty = false;
+    wire->instance = NULL;
+    reserve_components(0, 1);
+    wire_list[wire_list_len++] = wire;
+    wire->index = wire_list_len - 1;
+    wire->id = ++last_wire_id;
+    nets_changed = true;
+    return wire;
+}
+
+Wire *new_wire(int x0, int y0, int x1, int y1)
+{
+    Wire *wire = alloc_wire(x0, y0, x1, y1);
+    index_wire(wire);
+    mark_wire_dirty(wire);
+    return wire;
+}
+
+// Simulation
+
+void sim_and(const Gate *and)
+{
+    if (and->num_of_inputs > 0 && and->output != NULL) {
+        const Edge *inputs = gate_inputs.items + and->first_input;
+        bool state = inputs[0].wire->state;
+        for (int i = 1; i < and->num_of_inputs; i++)
+            state = state & inputs[i].wire->state;
+        and->output->state = state;
+    }
+}
+
+void sim_or(const Gate *or)
+{
+    if (or->num_of_inputs > 0 && or->output != NULL) {
+        const Edge *inputs = gate_inputs.items + or->first_input;
+        bool state = inputs[0].wire->state;
+        for (int i = 1; i < or->num_of_inputs; i++)
+            state = state | inputs[i].wire->state;
+        or->output->state = state;
+    }
+}
+
+void sim_not(const Gate *not)
+{
+    if (not->num_of_inputs > 0 && not->output != NULL) {
+        not->output->state = !get_input(not, 0)->state;
+    }
+}
+
+void sim_xor(const Gate *xor)
+{
+    if (xor->num_of_inputs > 0 && xor->output != NULL) {
+        const Edge *inputs = gate_inputs.items + xor->first_input;
+        bool state = inputs[0].wire->state;
+        for (int i = 1; i < xor->num_of_inputs; i++)
+            state = state ^ inputs[i].wire->state;
+        xor->output->state = state;
+    }
+}
+
+void sim_input(const Gate *input)
+{
+    if (input->output != NULL) {
+        input->output->state = input->value;
+    }
+}
+
+void sim_gate(const Gate *gate)
+{
+    bool old_state = gate->output != NULL && gate->output->state;
+
+    switch (gate->type) {
+    case AND:
+        sim_and(gate);
+        break;
+    case OR:
+        sim_or(gate);
+        break;
+    case NOT:
+        sim_not(gate);
+        break;
+    case XOR:
+        sim_xor(gate);
+        break;
+    case INPUT:
+    case DFF: // Latched by latch_flip_flops()
+    case CLOCK:
+        sim_input(gate);
+        break;
+    case CUSTOM: // Simulated by its parts
+        break;
+    }
+
+    if (gate->output != NULL && gate->output->state != old_state)
+        note_wire_change(gate->output);
+}
+
+// Evaluate a strongly connected component. Components without feedback are
+// a single gate and only need one pass, loops are iterated until they settle.
+bool sim_scc(int scc, long *evaluations)
+{
+    int start = scc_start[scc];
+    int end = scc_start[scc + 1];
+
+    if (!scc_cyclic[scc]) {
+        sim_gate(sim_order[start]);
+        (*evaluations)++;
+        return true;
+    }
+
+    for (int pass = 0; pass < MAX_FIXPOINT_PASSES; pass++) {
+        bool changed = false;
+        *evaluations += end - start;
+        for (int i = start; i < end; i++) {
+            Gate *gate = sim_order[i];
+            bool old_state = gate->output != NULL && gate->output->state;
+            sim_gate(gate);
+            if (gate->output != NULL && gate->output->state != old_state)
+                changed = true;
+        }
+        if (!changed) return true;
+    }
+    return false;
+}
+
+// Parallel simulation
+
+// Wait for every worker to get here. The last one to arrive flips the shared
+// sense, which releases the others.
+void barrier_wait(bool *sense)
+{
+    int last = num_of_workers - 1;
+    *sense = !*sense;
+    if (atomic_fetch_add(&barrier_count, 1) == last) {
+        atomic_store(&barrier_count, 0);
+        atomic_store(&barrier_sense, *sense);
+    } else {
+        for (int spins = 0; atomic_load(&barrier_sense) != *sense; spins++)
+            if (spins > 1000) sched_yield();
+    }
+}
+
+static inline uint64_t pack_range(uint32_t begin, uint32_t end)
+{
+    return (uint64_t)end << 32 | begin;
+}
+
+// Take up to WORK_CHUNK components from the front of a worker's range
+bool take_work(Worker *worker, int *begin, int *end)
+{
+    uint64_t range = atomic_load(&worker->range);
+    for (;;) {
+        uint32_t first = (uint32_t)range;
+        uint32_t last = range >> 32;
+        if (first >= last) return false;
+
+        uint32_t next = last - first > WORK_CHUNK ? first + WORK_CHUNK : last;
+        if (atomic_compare_exchange_weak(&worker->range, &range,
+                                         pack_range(next, last))) {
+            *begin = first;
+            *end = next;
+            return true;
+        }
+    }
+}
+
+// Take the back half of another worker's range and make it our own
+bool steal_work(Worker *thief, Worker *victim)
+{
+    uint64_t range = atomic_load(&victim->range);
+    for (;;) {
+        uint32_t first = (uint32_t)range;
+        uint32_t last = range >> 32;
+        if (first >= last) return false;
+
+        uint32_t middle = first + (last - first) / 2;
+        if (atomic_compare_exchange_weak(&victim->range, &range,
+                                         pack_range(first, middle))) {
+            atomic_store(&thief->range, pack_range(middle, last));
+            return true;
+        }
+    }
+}
+
+void sim_level_components(Worker *worker, int begin, int end)
+{
+    for (int i = begin; i < end; i++) {
+        int scc = level_order[i];
+        bool settled = sim_scc(scc, &worker->gate_evaluations);
+        if (!settled) worker->num_of_oscillating++;
+        for (int j = scc_start[scc]; j < scc_start[scc + 1]; j++)
+            sim_order[j]->oscillating = !settled;
+    }
+}
+
+// Simulate every level, with a barrier after each one. Each worker starts
+// with an equal share of a level and steals from the others when it runs
+// out.
+void run_worker_levels(int id, bool *sense)
+{
+    Worker *worker = &workers[id];
+    worker->num_of_oscillating = 0;
+    worker->gate_evaluations = 0;
+
+    for (int level = 0; level < num_of_levels; level++) {
+        long first = level_start[level];
+        long len = serial_start[level] - first;
+        atomic_store(&worker->range,
+                     pack_range(first + len * id / num_of_workers,
+                                first + len * (id + 1) / num_of_workers));
+
+        int begin, end;
+        for (;;) {
+            while (take_work(worker, &begin, &end))
+                sim_level_components(worker, begin, end);
+
+            bool stolen = false;
+            for (int i = 1; i < num_of_workers && !stolen; i++)
+                stolen = steal_work(worker,
+                                    &workers[(id + i) % num_of_workers]);
+            if (!stolen) break;
+        }
+        barrier_wait(sense);
+
+        if (serial_start[level] < level_start[level + 1]) {
+            if (id == 0)
+                sim_level_components(worker, serial_start[level],
+                                     level_start[level + 1]);
+            barrier_wait(sense);
+        }
+    }
+}
+
+void *parallel_worker(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    bool sense = false;
+    unsigned int done = 0;
+
+    current_worker = id;
+    for (;;) {
+        pthread_mutex_lock(&workers_lock);
+        while (parallel_update == done)
+            pthread_cond_wait(&workers_wake, &workers_lock);
+        done = parallel_update;
+        pthread_mutex_unlock(&workers_lock);
+
+        run_worker_levels(id, &sense);
+    }
+    return NULL;
+}
+
+// Start the worker threads, falling back to fewer workers if some fail
+void start_workers()
+{
+    for (int i = 1; i < num_of_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, parallel_worker,
+                           (void *)(intptr_t)i) != 0) {
+            num_of_workers = i;
+            break;
+        }
+    }
+    workers_started = true;
+}
+
+void update_circuit_parallel()
+{
+    static bool sense = false;
+
+    if (!workers_started) start_workers();
+
+    pthread_mutex_lock(&workers_lock);
+    parallel_update++;
+    pthread_cond_broadcast(&workers_wake);
+    pthread_mutex_unlock(&workers_lock);
+
+    run_worker_levels(0, &sense);
+
+    num_of_oscillating = 0;
+    for (int i = 0; i < num_of_workers; i++) {
+        num_of_oscillating += workers[i].num_of_oscillating;
+        stats.gate_evaluations += workers[i].gate_evaluations;
+    }
+}
+
+void update_circuit()
+{
+    if (num_of_workers > 1 && gate_list_len >= PARALLEL_MIN_GATES) {
+        update_circuit_parallel();
+        return;
+    }
+
+    long evaluations = 0;
+    num_of_oscillating = 0;
+    for (int i = 0; i < num_of_sccs; i++) {
+        bool settled = sim_scc(i, &evaluations);
+        if (!settled) num_of_oscillating++;
+        for (int j = scc_start[i]; j < scc_start[i + 1]; j++)
+            sim_order[j]->oscillating = !settled;
+    }
+    stats.gate_evaluations += evaluations;
+}
+
+// Event driven simulation
+
+void schedule_gate(Gate *gate)
+{
+    if (gate->queued) return;
+
+    if (event_queue_len == event_queue_capacity) { // Grow and unwrap queue
+        int old_capacity = event_queue_capacity;
+        event_queue_capacity = old_capacity ? old_capacity * 2 : 64;
+        event_queue = realloc(event_queue,
+                              event_queue_capacity * sizeof(GateHandle));
+        // Entries that wrapped around now follow on from the old end
+        for (int i = 0; i < event_queue_head; i++)
+            event_queue[old_capacity + i] = event_queue[i];
+    }
+
+    gate->queued = true;
+    event_queue[(event_queue_head + event_queue_len++) %
+                event_queue_capacity] = get_gate_handle(gate);
+}
+
+void schedule_all_gates()
+{
+    for (int i = 0; i < gate_list_len; i++)
+        schedule_gate(gate_list[i]);
+}
+
+// Only evaluate gates whose inputs changed. Each evaluation that changes a
+// wire schedules the gates reading it. Loops that keep generating events are
+// cut off after MAX_FIXPOINT_PASSES evaluations per gate and resumed on the
+// next update.
+void update_circuit_events()
+{
+    long budget = (long)MAX_FIXPOINT_PASSES * gate_list_len;
+    long events = 0;
+
+    while (event_queue_len > 0 && budget-- > 0) {
+        Gate *gate = resolve_gate(event_queue[event_queue_head]);
+        event_queue_head = (event_queue_head + 1) % event_queue_capacity;
+        event_queue_len--;
+        if (gate == NULL) continue; // Deleted while it was queued
+
+        events++;
+        gate->queued = false;
+        gate->oscillating = false;
+
+        if (gate->output == NULL) {
+            sim_gate(gate);
+            continue;
+        }
+
+        bool old_state = gate->output->state;
+        sim_gate(gate);
+        if (gate->output->state != old_state) {
+            Wire *output = gate->output;
+            for (int i = 0; i < output->num_of_fanout; i++)
+                schedule_gate(get_fanout(output, i));
+        }
+    }
+    stats.events += events;
+    stats.gate_evaluations += events;
+
+    num_of_oscillating = 0;
+    for (int i = 0; i < event_queue_len; i++) {
+        Gate *gate = resolve_gate(
+                event_queue[(event_queue_head + i) % event_queue_capacity]);
+        if (gate == NULL) continue;
+        gate->oscillating = true;
+        num_of_oscillating = 1;
+    }
+}
+
+// Timed simulation
+
+// Output a gate would drive with its current inputs
+bool get_gate_result(const Gate *gate)
+{
+    if (gate->type == INPUT || gate->type == DFF || gate->type == CLOCK)
+        return gate->value;
+    if (gate->num_of_inputs == 0) return gate->output->state;
+
+    const Edge *inputs = gate_inputs.items + gate->first_input;
+    bool state = inputs[0].wire->state;
+    for (int i = 1; i < gate->num_of_inputs; i++) {
+        if (gate->type == AND)
+            state = state & inputs[i].wire->state;
+        else if (gate->type == OR)
+            state = state | inputs[i].wire->state;
+        else
+            state = state ^ inputs[i].wire->state;
+    }
+    return gate->type == NOT ? !state : state;
+}
+
+int get_gate_delay(const Gate *gate)
+{
+    return gate->delay > 0 ? gate->delay : gate_delays[gate->type];
+}
+
+// Forget the hazards of the last change before a new one starts
+void clear_hazards()
+{
+    for (int i = 0; i < num_of_hazard_nets; i++) {
+        Wire *net = resolve_wire(hazard_nets[i]);
+        if (net != NULL) net->transitions = 0;
+    }
+    num_of_hazard_nets = 0;
+}
+
+// Count a change of a net towards its hazards
+void note_net_transition(Wire *net)
+{
+    if (net->transitions == 0) {
+        if (num_of_hazard_nets == hazard_nets_capacity) {
+            hazard_nets_capacity = hazard_nets_capacity ?
+                                   hazard_nets_capacity * 2 : 64;
+            hazard_nets = realloc(hazard_nets,
+                                  hazard_nets_capacity * sizeof(WireHandle));
+        }
+        hazard_nets[num_of_hazard_nets++] = get_wire_handle(net);
+    }
+    if (net->transitions < UINT8_MAX) net->transitions++;
+}
+
+// Schedule a gate's output to change if its inputs now give a different
+// value than the one it is heading for. Every change is kept, so pulses
+// shorter than a gate's delay still get through.
+void evaluate_timed(Gate *gate)
+{
+    gate->oscillating = false;
+    if (gate->output == NULL || gate->type == CUSTOM) return;
+
+    bool state = gate->num_of_pending > 0 ? gate->next_state :
+                                            gate->output->state;
+    bool result = get_gate_result(gate);
+    if (result == state) return;
+
+    TimingSlot *slot = &timing_wheel[(sim_time + get_gate_delay(gate)) %
+                                     TIMING_WHEEL_SLOTS];
+    if (slot->len == slot->capacity) {
+        slot->capacity = slot->capacity ? slot->capacity * 2 : 16;
+        slot->changes = realloc(slot->changes,
+                                slot->capacity * sizeof(TimedChange));
+    }
+    slot->changes[slot->len++] = (TimedChange){ get_gate_handle(gate),
+                                                result };
+    num_of_timed_changes++;
+    gate->next_state = result;
+    gate->num_of_pending++;
+}
+
+// Drop every pending change, when switching to another engine
+void clear_timing_wheel()
+{
+    for (int i = 0; i < TIMING_WHEEL_SLOTS; i++) {
+        TimingSlot *slot = &timing_wheel[i];
+        for (int j = 0; j < slot->len; j++) {
+            Gate *gate = resolve_gate(slot->changes[j].gate);
+            if (gate != NULL) gate->num_of_pending = 0;
+        }
+        slot->len = 0;
+    }
+    num_of_timed_changes = 0;
+    clear_hazards();
+}
+
+// Advance time one tick at a time. Gates scheduled with schedule_gate() are
+// evaluated at the current tick, then the changes due at the next tick are
+// made and the gates reading the changed nets are evaluated in turn. Like
+// the event driven engine, an update stops after MAX_FIXPOINT_PASSES changes
+// per gate and carries on from there next time, so oscillators keep running
+// without holding up the thread.
+void update_circuit_timed()
+{
+    long budget = (long)MAX_FIXPOINT_PASSES * gate_list_len;
+    long changes = 0;
+    long evaluations = 0;
+
+    if (num_of_timed_changes == 0 && event_queue_len > 0) clear_hazards();
+    for (;;) {
+        while (event_queue_len > 0) {
+            Gate *gate = resolve_gate(event_queue[event_queue_head]);
+            event_queue_head = (event_queue_head + 1) % event_queue_capacity;
+            event_queue_len--;
+            if (gate == NULL) continue; // Deleted while it was queued
+
+            gate->queued = false;
+            evaluate_timed(gate);
+            evaluations++;
+        }
+        if (num_of_timed_changes == 0 || changes >= budget) break;
+
+        sim_time++;
+        wave_time++;
+        TimingSlot *slot = &timing_wheel[sim_time % TIMING_WHEEL_SLOTS];
+        for (int i = 0; i < slot->len; i++) {
+            Gate *gate = resolve_gate(slot->changes[i].gate);
+            if (gate == NULL) continue; // Deleted while it was pending
+
+            changes++;
+            gate->num_of_pending--;
+            gate->oscillating = false;
+            Wire *output = gate->output;
+            if (output == NULL || output->state == slot->changes[i].state)
+                continue;
+
+            output->state = slot->changes[i].state;
+            note_wire_change(output);
+            note_net_transition(output);
+            for (int j = 0; j < output->num_of_fanout; j++)
+                schedule_gate(get_fanout(output, j));
+        }
+        num_of_timed_changes -= slot->len;
+        slot->len = 0;
+    }
+    stats.events += changes;
+    stats.gate_evaluations += evaluations;
+
+    // Gates that still have changes coming are part of an oscillator
+    num_of_oscillating = num_of_timed_changes > 0;
+    for (int i = 0; i < TIMING_WHEEL_SLOTS && num_of_timed_changes > 0; i++) {
+        for (int j = 0; j < timing_wheel[i].len; j++) {
+            Gate *gate = resolve_gate(timing_wheel[i].changes[j].gate);
+            if (gate != NULL) gate->oscillating = true;
+        }
+    }
+}
+
+// Compiled simulation
+
+void emit_instruction(int op, int dest, int a, int b)
+{
+    if (program_len == program_capacity) {
+        program_capacity = program_capacity ? program_capacity * 2 : 256;
+        program = realloc(program, program_capacity * sizeof(Instruction));
+    }
+    program[program_len++] = (Instruction){ op, dest, a, b };
+}
+
+void compile_gate(Gate *gate)
+{
+    static const int binary_ops[] = { [AND] = OP_AND, [OR] = OP_OR,
+                                      [XOR] = OP_XOR };
+    static const int wide_ops[] = { [AND] = OP_AND_N, [OR] = OP_OR_N,
+                                    [XOR] = OP_XOR_N };
+    if (gate->output == NULL) return;
+    int dest = gate->output->net_index;
+
+    switch (gate->type) {
+    case INPUT:
+    case DFF:
+    case CLOCK:
+        if (num_of_program_inputs == program_inputs_capacity) {
+            program_inputs_capacity = program_inputs_capacity ?
+                                      program_inputs_capacity * 2 : 64;
+            program_inputs = realloc(program_inputs, program_inputs_capacity *
+                                                     sizeof(Gate *));
+        }
+        program_inputs[num_of_program_inputs] = gate;
+        emit_instruction(OP_INPUT, dest, num_of_program_inputs++, 0);
+        break;
+    case NOT:
+        if (gate->num_of_inputs > 0)
+            emit_instruction(OP_NOT, dest, get_input(gate, 0)->net_index, 0);
+        break;
+    case AND:
+    case OR:
+    case XOR:
+        if (gate->num_of_inputs == 2) {
+            emit_instruction(binary_ops[gate->type], dest,
+                             get_input(gate, 0)->net_index,
+                             get_input(gate, 1)->net_index);
+        } else if (gate->num_of_inputs > 0) {
+            if (num_of_program_sources + gate->num_of_inputs >
+                program_sources_capacity) {
+                program_sources_capacity = (num_of_program_sources +
+                                            gate->num_of_inputs) * 2;
+                program_sources = realloc(program_sources,
+                                          program_sources_capacity *
+                                          sizeof(int));
+            }
+            emit_instruction(wide_ops[gate->type], dest,
+                             num_of_program_sources, gate->num_of_inputs);
+            for (int i = 0; i < gate->num_of_inputs; i++)
+                program_sources[num_of_program_sources++] =
+                    get_input(gate, i)->net_index;
+        }
+        break;
+    case CUSTOM: // Compiled through its parts
+        break;
+    }
+}
+
+// Optimization. The program is simplified after it is compiled, leaving the
+// gates on the board alone:
+//  - Nets that no instruction writes keep their value, so gates reading them
+//    are folded into constants or copies of their other inputs.
+//  - Reads of a net that is a copy of another net read that net instead.
+//  - Gates computing the same thing from the same nets as an earlier gate
+//    (structural hashing) become copies of it.
+//  - Instructions whose nets nothing looks at are removed.
+// Feedback loops are kept as they are.
+
+// Simplify an AND, OR or XOR of the given nets and emit it into the new
+// program. Sources are rewritten in place.
+void emit_optimized_gate(int op, int dest, int *sources, int len,
+                         const int *alias, const int8_t *constant)
+{
+    int kept = 0;
+    int invert = 0; // XOR with constant ones
+    int one = -1; // A net that is always 1, for an inverted wide XOR
+
+    for (int i = 0; i < len; i++) {
+        int net = alias[sources[i]];
+        if (constant[net] < 0) {
+            sources[kept++] = net;
+        } else if (op == OP_XOR) {
+            invert ^= constant[net];
+            if (constant[net]) one = net;
+        } else if (constant[net] == (op == OP_OR)) { // Decides the output
+            emit_instruction(OP_CONST, dest, op == OP_OR, 0);
+            return;
+        }
+    }
+
+    // Insertion sort, gates rarely have more than a few inputs
+    for (int i = 1; i < kept; i++)
+        for (int j = i; j > 0 && sources[j - 1] > sources[j]; j--) {
+            int tmp = sources[j];
+            sources[j] = sources[j - 1];
+            sources[j - 1] = tmp;
+        }
+    len = kept;
+    kept = 0;
+    for (int i = 0; i < len; i++) {
+        if (kept > 0 && sources[kept - 1] == sources[i]) {
+            if (op == OP_XOR) kept--; // x ^ x cancels out
+            continue; // x & x and x | x are x
+        }
+        sources[kept++] = sources[i];
+    }
+
+    if (kept == 0) {
+        emit_instruction(OP_CONST, dest, op == OP_AND ? 1 : invert, 0);
+    } else if (kept == 1) {
+        emit_instruction(invert ? OP_NOT : OP_COPY, dest, sources[0], 0);
+    } else {
+        if (invert) sources[kept++] = one;
+        if (kept == 2) {
+            emit_instruction(op, dest, sources[0], sources[1]);
+            return;
+        }
+        if (num_of_program_sources + kept > program_sources_capacity) {
+            program_sources_capacity = (num_of_program_sources + kept) * 2;
+            program_sources = realloc(program_sources,
+                                      program_sources_capacity * sizeof(int));
+        }
+        emit_instruction(op == OP_AND ? OP_AND_N : op == OP_OR ? OP_OR_N :
+                         OP_XOR_N, dest, num_of_program_sources, kept);
+        for (int i = 0; i < kept; i++)
+            program_sources[num_of_program_sources++] = sources[i];
+    }
+}
+
+uint32_t hash_instruction(const Instruction *instruction)
+{
+    uint32_t hash = instruction->op * 2654435761u;
+    if (instruction->op >= OP_AND_N && instruction->op <= OP_XOR_N) {
+        for (int i = 0; i < instruction->b; i++)
+            hash = (hash ^ program_sources[instruction->a + i]) * 16777619u;
+    } else {
+        hash = (hash ^ instruction->a) * 16777619u;
+        hash = (hash ^ instruction->b) * 16777619u;
+    }
+    return hash;
+}
+
+bool same_instruction(const Instruction *a, const Instruction *b)
+{
+    if (a->op != b->op || a->b != b->b) return false;
+    if (a->op < OP_AND_N || a->op > OP_XOR_N) return a->a == b->a;
+    for (int i = 0; i < a->b; i++)
+        if (program_sources[a->a + i] != program_sources[b->a + i])
+            return false;
+    return true;
+}
+
+// Whether every net an instruction reads is written at most once, so it
+// holds the same value wherever the program reads it
+bool has_single_writer_operands(const Instruction *instruction,
+                                const int *writers)
+{
+    if (instruction->op >= OP_AND_N && instruction->op <= OP_XOR_N) {
+        for (int i = 0; i < instruction->b; i++)
+            if (writers[program_sources[instruction->a + i]] > 1)
+                return false;
+        return true;
+    }
+    return writers[instruction->a] <= 1 &&
+           (instruction->op == OP_NOT || writers[instruction->b] <= 1);
+}
+
+// Simplify the program. The nets marked in observable, and the nets read by
+// flip-flops, are kept up to date.
+void optimize_program(const bool *observable)
+{
+    Instruction *old_program = program;
+    int old_len = program_len;
+    int *old_sources = program_sources;
+
+    int *writers = calloc(num_of_nets + 1, sizeof(int));
+    int *alias = malloc((num_of_nets + 1) * sizeof(int));
+    int8_t *constant = malloc(num_of_nets + 1);
+    int *definition = malloc((num_of_nets + 1) * sizeof(int));
+    int *sources = NULL;
+    int sources_capacity = 0;
+    int num_of_buckets = 64;
+    while (num_of_buckets < 2 * old_len) num_of_buckets *= 2;
+    int *buckets = malloc(num_of_buckets * sizeof(int));
+    for (int i = 0; i < num_of_buckets; i++) buckets[i] = -1;
+
+    // Nets written more than once, or inside a loop, are left as they are
+    int old_gates = 0;
+    for (int pc = 0; pc < old_len; pc++) {
+        if (old_program[pc].op == OP_LOOP) {
+            for (int i = pc + 1; i <= pc + old_program[pc].a; i++)
+                writers[old_program[i].dest] += 2;
+            old_gates += old_program[pc].a;
+            pc += old_program[pc].a;
+            continue;
+        }
+        writers[old_program[pc].dest]++;
+        old_gates++;
+    }
+    for (int i = 0; i < num_of_nets; i++) {
+        alias[i] = i;
+        constant[i] = writers[i] == 0 ? net_list[i]->state : -1;
+        definition[i] = -1;
+    }
+
+    program = NULL;
+    program_len = 0;
+    program_capacity = 0;
+    program_sources = NULL;
+    num_of_program_sources = 0;
+    program_sources_capacity = 0;
+
+    for (int pc = 0; pc < old_len; pc++) {
+        Instruction instruction = old_program[pc];
+        int dest = instruction.dest;
+
+        // Loop bodies keep one instruction for each of their gates, with
+        // the same rewriting of sources as everywhere else
+        if (instruction.op == OP_LOOP || instruction.op == OP_INPUT) {
+            int end = pc + 1 + (instruction.op == OP_LOOP ? instruction.a : 0);
+            for (; pc < end; pc++) {
+                instruction = old_program[pc];
+                int pair[2] = { instruction.a, instruction.b };
+                int net = alias[instruction.a];
+                switch (instruction.op) {
+                case OP_NOT:
+                    if (constant[net] >= 0)
+                        emit_instruction(OP_CONST, instruction.dest,
+                                         !constant[net], 0);
+                    else
+                        emit_instruction(OP_NOT, instruction.dest, net, 0);
+                    break;
+                case OP_AND:
+                case OP_OR:
+                case OP_XOR:
+                    emit_optimized_gate(instruction.op, instruction.dest,
+                                        pair, 2, alias, constant);
+                    break;
+                case OP_AND_N:
+                case OP_OR_N:
+                case OP_XOR_N:
+                    emit_optimized_gate(instruction.op - OP_AND_N + OP_AND,
+                                        instruction.dest,
+                                        old_sources + instruction.a,
+                                        instruction.b, alias, constant);
+                    break;
+                default: // OP_LOOP and OP_INPUT
+                    emit_instruction(instruction.op, instruction.dest,
+                                     instruction.a, instruction.b);
+                }
+            }
+            pc--;
+            continue;
+        }
+
+        int len = instruction.op >= OP_AND_N && instruction.op <= OP_XOR_N ?
+                  instruction.b : instruction.op == OP_NOT ? 1 : 2;
+        if (len > sources_capacity) {
+            sources_capacity = len * 2;
+            sources = realloc(sources, sources_capacity * sizeof(int));
+        }
+        if (instruction.op >= OP_AND_N && instruction.op <= OP_XOR_N) {
+            memcpy(sources, old_sources + instruction.a, len * sizeof(int));
+            instruction.op += OP_AND - OP_AND_N;
+        } else {
+            sources[0] = instruction.a;
+            sources[1] = instruction.b;
+        }
+
+        int first = program_len;
+        if (instruction.op == OP_NOT) {
+            int net = alias[sources[0]];
+            int inverted = definition[net] >= 0 &&
+                           program[definition[net]].op == OP_NOT &&
+                           writers[program[definition[net]].a] <= 1 ?
+                           program[definition[net]].a : -1;
+            if (constant[net] >= 0)
+                emit_instruction(OP_CONST, dest, !constant[net], 0);
+            else if (inverted >= 0) // Double negation
+                emit_instruction(OP_COPY, dest, inverted, 0);
+            else
+                emit_instruction(OP_NOT, dest, net, 0);
+        } else {
+            emit_optimized_gate(instruction.op, dest, sources, len, alias,
+                                constant);
+        }
+
+        // Reuse an earlier gate that computes the same thing. Nets written
+        // more than once may have changed in between.
+        Instruction *emitted = &program[first];
+        if (emitted->op != OP_CONST && emitted->op != OP_COPY &&
+            has_single_writer_operands(emitted, writers)) {
+            uint32_t bucket = hash_instruction(emitted) & (num_of_buckets - 1);
+            for (; buckets[bucket] >= 0;
+                 bucket = (bucket + 1) & (num_of_buckets - 1)) {
+                if (!same_instruction(&program[buckets[bucket]], emitted))
+                    continue;
+                num_of_program_sources -= emitted->op >= OP_AND_N &&
+                                          emitted->op <= OP_XOR_N ?
+                                          emitted->b : 0;
+                *emitted = (Instruction){ OP_COPY, dest,
+                                          program[buckets[bucket]].dest, 0 };
+                break;
+            }
+            if (emitted->op != OP_COPY && writers[dest] == 1)
+                buckets[bucket] = first;
+        }
+
+        if (writers[dest] != 1) continue; // Can't stand in for the net
+        if (emitted->op == OP_CONST) constant[dest] = emitted->a;
+        else if (emitted->op == OP_COPY && writers[emitted->a] <= 1)
+            alias[dest] = emitted->a;
+        else definition[dest] = first;
+    }
+
+    // Remove instructions nothing needs, working back from the outputs.
+    // Loops are kept whole if anything needs a net they write.
+    bool *needed = malloc(num_of_nets + 1);
+    int *loop_start = malloc((program_len + 1) * sizeof(int));
+    bool *keep = calloc(program_len + 1, sizeof(bool));
+    for (int i = 0; i < num_of_nets; i++) needed[i] = observable[i];
+    for (int i = 0; i < num_of_flip_flops; i++)
+        for (int j = 0; j < flip_flops[i]->num_of_inputs; j++)
+            needed[get_input(flip_flops[i], j)->net_index] = true;
+    for (int pc = 0; pc < program_len; pc++) {
+        loop_start[pc] = -1;
+        if (program[pc].op != OP_LOOP) continue;
+        for (int i = pc; i <= pc + program[pc].a; i++) loop_start[i] = pc;
+        pc += program[pc].a;
+    }
+
+    for (int pc = program_len - 1; pc >= 0; pc--) {
+        int start = loop_start[pc] >= 0 ? loop_start[pc] : pc;
+        if (start == pc && !needed[program[pc].dest]) continue;
+        if (start != pc) {
+            bool used = false;
+            for (int i = start + 1; i <= pc && !used; i++)
+                used = needed[program[i].dest];
+            if (!used) { // Skip the whole loop
+                pc = start;
+                continue;
+            }
+        }
+        for (; pc >= start; pc--) {
+            const Instruction *instruction = &program[pc];
+            keep[pc] = true;
+            switch (instruction->op) {
+            case OP_AND:
+            case OP_OR:
+            case OP_XOR:
+                needed[instruction->b] = true;
+                // fall through
+            case OP_NOT:
+            case OP_COPY:
+                needed[instruction->a] = true;
+                break;
+            case OP_AND_N:
+            case OP_OR_N:
+            case OP_XOR_N:
+                for (int i = 0; i < instruction->b; i++)
+                    needed[program_sources[instruction->a + i]] = true;
+                break;
+            }
+        }
+        pc++;
+    }
+
+    // Compact what is left, along with its sources
+    int *new_sources = malloc((num_of_program_sources + 1) * sizeof(int));
+    int new_gates = 0;
+    int kept = 0;
+    num_of_program_sources = 0;
+    for (int pc = 0; pc < program_len; pc++) {
+        Instruction instruction = program[pc];
+        if (!keep[pc]) continue;
+        if (instruction.op >= OP_AND_N && instruction.op <= OP_XOR_N) {
+            memcpy(new_sources + num_of_program_sources,
+                   program_sources + instruction.a,
+                   instruction.b * sizeof(int));
+            instruction.a = num_of_program_sources;
+            num_of_program_sources += instruction.b;
+        }
+        if (instruction.op != OP_LOOP && instruction.op != OP_CONST &&
+            instruction.op != OP_COPY)
+            new_gates++;
+        program[kept++] = instruction;
+    }
+    program_len = kept;
+    free(program_sources);
+    program_sources = new_sources;
+    program_sources_capacity = num_of_program_sources + 1;
+    stats.gates_removed = old_gates - new_gates;
+
+    free(old_program);
+    free(old_sources);
+    free(writers);
+    free(alias);
+    free(constant);
+    free(definition);
+    free(sources);
+    free(buckets);
+    free(needed);
+    free(loop_start);
+    free(keep);
+}
+
+// Turn the order found by levelize_circuit() into a program and optimize
+// it. Only the nets marked in observable are sure to be kept up to date, or
+// every net with a wire on the board if it is NULL.
+void compile_program(const bool *observable)
+{
+    program_len = 0;
+    num_of_program_sources = 0;
+    num_of_program_inputs = 0;
+
+    for (int scc = 0; scc < num_of_sccs; scc++) {
+        if (!scc_cyclic[scc]) {
+            compile_gate(sim_order[scc_start[scc]]);
+            continue;
+        }
+
+        int loop = program_len;
+        emit_instruction(OP_LOOP, 0, 0, scc);
+        for (int i = scc_start[scc]; i < scc_start[scc + 1]; i++)
+            compile_gate(sim_order[i]);
+        program[loop].a = program_len - loop - 1;
+        if (program[loop].a == 0) program_len = loop; // Nothing to repeat
+    }
+
+    bool *on_board = NULL;
+    if (observable == NULL) {
+        on_board = calloc(num_of_nets + 1, sizeof(bool));
+        for (int i = 0; i < wire_list_len; i++)
+            if (wire_list[i]->instance == NULL)
+                on_board[wire_list[i]->net->net_index] = true;
+        observable = on_board;
+    }
+    optimize_program(observable);
+    free(on_board);
+
+    program_states = realloc(program_states, num_of_nets + 1);
+    program_dirty = false;
+    program_synced = false;
+}
+
+// Run part of the program. Returns true if any net changed.
+bool run_instructions(int begin, int end)
+{
+    uint8_t *states = program_states;
+    bool changed = false;
+    stats.gate_evaluations += end - begin; // Loops are counted per pass
+
+    for (int pc = begin; pc < end; pc++) {
+        const Instruction *instruction = &program[pc];
+        uint8_t value = 0;
+
+        switch (instruction->op) {
+        case OP_AND:
+            value = states[instruction->a] & states[instruction->b];
+            break;
+        case OP_OR:
+            value = states[instruction->a] | states[instruction->b];
+            break;
+        case OP_XOR:
+            value = states[instruction->a] ^ states[instruction->b];
+            break;
+        case OP_NOT:
+            value = states[instruction->a] ^ 1;
+            break;
+        case OP_AND_N:
+            value = 1;
+            for (int i = 0; i < instruction->b; i++)
+                value &= states[program_sources[instruction->a + i]];
+            break;
+        case OP_OR_N:
+            for (int i = 0; i < instruction->b; i++)
+                value |= states[program_sources[instruction->a + i]];
+            break;
+        case OP_XOR_N:
+            for (int i = 0; i < instruction->b; i++)
+                value ^= states[program_sources[instruction->a + i]];
+            break;
+        case OP_INPUT:
+            value = program_inputs[instruction->a]->value;
+            break;
+        case OP_CONST:
+            value = instruction->a;
+            break;
+        case OP_COPY:
+            value = states[instruction->a];
+            break;
+        case OP_LOOP: {
+            int body_end = pc + 1 + instruction->a;
+            int scc = instruction->b;
+            bool settled = false;
+            stats.gate_evaluations -= body_end - pc;
+
+            for (int pass = 0; pass < MAX_FIXPOINT_PASSES; pass++) {
+                if (!run_instructions(pc + 1, body_end)) {
+                    settled = true;
+                    break;
+                }
+                changed = true;
+            }
+            if (!settled) num_of_oscillating++;
+            for (int i = scc_start[scc]; i < scc_start[scc + 1]; i++)
+                sim_order[i]->oscillating = !settled;
+            pc = body_end - 1;
+            continue;
+        }
+        }
+
+        // Only nets that change are written back to their wires
+        if (states[instruction->dest] != value) {
+            states[instruction->dest] = value;
+            net_list[instruction->dest]->state = value;
+            note_wire_change(net_list[instruction->dest]);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+void update_circuit_compiled()
+{
+    if (program_dirty) compile_program(NULL);
+    if (!program_synced) { // Another engine may have changed the wires
+        for (int i = 0; i < num_of_nets; i++)
+            program_states[i] = net_list[i]->state;
+        for (int i = 0; i < gate_list_len; i++)
+            gate_list[i]->oscillating = false;
+        program_synced = true;
+    }
+
+    num_of_oscillating = 0;
+    run_instructions(0, program_len);
+}
+
+// Group the components found by levelize_circuit() into logic levels. A
+// component's level is one more than the highest level driving its inputs.
+void compute_levels()
+{
+    int *gate_scc = malloc(gate_list_len * sizeof(int));
+    int *scc_level = malloc(num_of_sccs * sizeof(int));
+    bool *scc_serial = malloc(num_of_sccs * sizeof(bool));
+
+    for (int scc = 0; scc < num_of_sccs; scc++)
+        for (int i = scc_start[scc]; i < scc_start[scc + 1]; i++)
+            gate_scc[sim_order[i]->index] = scc;
+
+    // Components come sources first, so their drivers already have a level
+    num_of_levels = 0;
+    for (int scc = 0; scc < num_of_sccs; scc++) {
+        int level = 0;
+        scc_serial[scc] = false;
+        for (int i = scc_start[scc]; i < scc_start[scc + 1]; i++) {
+            Gate *gate = sim_order[i];
+            for (int j = 0; j < gate->num_of_inputs && gate->type != DFF;
+                 j++) {
+                Gate *driver = get_input(gate, j)->driver;
+                if (driver == NULL || gate_scc[driver->index] == scc) continue;
+                if (scc_level[gate_scc[driver->index]] >= level)
+                    level = scc_level[gate_scc[driver->index]] + 1;
+            }
+            if (gate->output != NULL && gate->output->driver != gate)
+                scc_serial[scc] = true;
+        }
+        scc_level[scc] = level;
+        if (level >= num_of_levels) num_of_levels = level + 1;
+    }
+
+    // Counting sort by level, with the serial components at the end of each
+    level_order = realloc(level_order, num_of_sccs * sizeof(int));
+    level_start = realloc(level_start, (num_of_levels + 1) * sizeof(int));
+    serial_start = realloc(serial_start, num_of_levels * sizeof(int));
+    int *parallel_len = calloc(num_of_levels, sizeof(int));
+    int *serial_len = calloc(num_of_levels, sizeof(int));
+
+    for (int scc = 0; scc < num_of_sccs; scc++) {
+        if (scc_serial[scc]) serial_len[scc_level[scc]]++;
+        else parallel_len[scc_level[scc]]++;
+    }
+    level_start[0] = 0;
+    for (int level = 0; level < num_of_levels; level++) {
+        serial_start[level] = level_start[level] + parallel_len[level];
+        level_start[level + 1] = serial_start[level] + serial_len[level];
+        parallel_len[level] = level_start[level]; // Next free slot
+        serial_len[level] = serial_start[level];
+    }
+    for (int scc = 0; scc < num_of_sccs; scc++) {
+        int level = scc_level[scc];
+        if (scc_serial[scc]) level_order[serial_len[level]++] = scc;
+        else level_order[parallel_len[level]++] = scc;
+    }
+
+    free(gate_scc);
+    free(scc_level);
+    free(scc_serial);
+    free(parallel_len);
+    free(serial_len);
+}
+
+// Sort the gates topologically using Tarjan's algorithm. The search follows
+// each gate back to the drivers of its inputs so components are emitted
+// sources first, which is the order they need to be simulated in. Flip-flops
+// are sources, so loops through them are not feedback loops.
+void levelize_circuit()
+{
+    int *index = malloc(gate_list_len * sizeof(int));
+    int *lowlink = malloc(gate_list_len * sizeof(int));
+    bool *on_stack = malloc(gate_list_len * sizeof(bool));
+    int *stack = malloc(gate_list_len * sizeof(int));
+    int *frame_gate = malloc(gate_list_len * sizeof(int)); // DFS call stack
+    int *frame_edge = malloc(gate_list_len * sizeof(int));
+    int stack_len = 0;
+    int next_index = 0;
+    int order_len = 0;
+
+    sim_order = realloc(sim_order, gate_list_len * sizeof(Gate *));
+    scc_start = realloc(scc_start, (gate_list_len + 1) * sizeof(int));
+    scc_cyclic = realloc(scc_cyclic, gate_list_len * sizeof(bool));
+    num_of_sccs = 0;
+
+    for (int i = 0; i < gate_list_len; i++) {
+        gate_list[i]->index = i;
+        index[i] = -1;
+        on_stack[i] = false;
+    }
+
+    for (int root = 0; root < gate_list_len; root++) {
+        if (index[root] >= 0) continue;
+
+        int depth = 0;
+        frame_gate[0] = root;
+        frame_edge[0] = 0;
+        index[root] = lowlink[root] = next_index++;
+        stack[stack_len++] = root;
+        on_stack[root] = true;
+
+        while (depth >= 0) {
+            int v = frame_gate[depth];
+            Gate *gate = gate_list[v];
+
+            if (frame_edge[depth] < gate->num_of_inputs &&
+                gate->type != DFF) {
+                Gate *driver = get_input(gate, frame_edge[depth]++)->driver;
+                if (driver == NULL) continue;
+
+                int w = driver->index;
+                if (index[w] < 0) { // Descend into the driver
+                    depth++;
+                    frame_gate[depth] = w;
+                    frame_edge[depth] = 0;
+                    index[w] = lowlink[w] = next_index++;
+                    stack[stack_len++] = w;
+                    on_stack[w] = true;
+                } else if (on_stack[w] && index[w] < lowlink[v]) {
+                    lowlink[v] = index[w];
+                }
+                continue;
+            }
+
+            if (lowlink[v] == index[v]) { // v is the root of a component
+                bool cyclic = false;
+                scc_start[num_of_sccs] = order_len;
+                int w;
+                do {
+                    w = stack[--stack_len];
+                    on_stack[w] = false;
+                    sim_order[order_len++] = gate_list[w];
+                } while (w != v);
+
+                if (order_len - scc_start[num_of_sccs] > 1) {
+                    cyclic = true;
+                } else if (gate->type != DFF) { // Or a gate feeding itself
+                    for (int i = 0; i < gate->num_of_inputs; i++)
+                        if (get_input(gate, i)->driver == gate) cyclic = true;
+                }
+                scc_cyclic[num_of_sccs++] = cyclic;
+            }
+
+            depth--;
+            if (depth >= 0 && lowlink[v] < lowlink[frame_gate[depth]])
+                lowlink[frame_gate[depth]] = lowlink[v];
+        }
+    }
+    scc_start[num_of_sccs] = order_len;
+    compute_levels();
+    program_dirty = true;
+
+    num_of_flip_flops = 0;
+    num_of_clocks = 0;
+    flip_flops = realloc(flip_flops, gate_list_len * sizeof(Gate *));
+    flip_flop_inputs = realloc(flip_flop_inputs, gate_list_len);
+    clocks = realloc(clocks, gate_list_len * sizeof(Gate *));
+    for (int i = 0; i < gate_list_len; i++) {
+        if (gate_list[i]->type == DFF)
+            flip_flops[num_of_flip_flops++] = gate_list[i];
+        else if (gate_list[i]->type == CLOCK)
+            clocks[num_of_clocks++] = gate_list[i];
+    }
+
+    free(index);
+    free(lowlink);
+    free(on_stack);
+    free(stack);
+    free(frame_gate);
+    free(frame_edge);
+}
+
+// Sequential simulation
+
+void run_engine()
+{
+    if (sim_engine != ENGINE_TIMED) wave_time++; // It counts ticks instead
+    if (sim_engine == ENGINE_EVENT)
+        update_circuit_events();
+    else if (sim_engine == ENGINE_COMPILED)
+        update_circuit_compiled();
+    else if (sim_engine == ENGINE_TIMED)
+        update_circuit_timed();
+    else
+        update_circuit();
+}
+
+// Latch every flip-flop whose clock rose since it was last latched. They all
+// sample their data input before any of them changes, so a chain of them
+// shifts by one place per edge. Returns true if an output changed.
+bool latch_flip_flops()
+{
+    bool changed = false;
+
+    for (int i = 0; i < num_of_flip_flops; i++) {
+        const Gate *flip_flop = flip_flops[i];
+        flip_flop_inputs[i] = flip_flop->num_of_inputs > 0 &&
+                              get_input(flip_flop, 0)->state;
+    }
+    for (int i = 0; i < num_of_flip_flops; i++) {
+        Gate *flip_flop = flip_flops[i];
+        bool clock = flip_flop->num_of_inputs > 1 &&
+                     get_input(flip_flop, 1)->state;
+        bool rising = clock && !flip_flop->last_clock;
+
+        flip_flop->last_clock = clock;
+        if (rising && flip_flop->value != flip_flop_inputs[i]) {
+            flip_flop->value = flip_flop_inputs[i];
+            schedule_gate(flip_flop);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Run the engine until the flip-flops stop changing. Flip-flops clocked by
+// other flip-flops take one more round for each one in the chain.
+void settle_circuit()
+{
+    run_engine();
+    for (int round = 0; round < MAX_FIXPOINT_PASSES && latch_flip_flops();
+         round++)
+        run_engine();
+}
+
+// Raise every CLOCK and settle, then lower them again and settle
+void run_clock_cycle()
+{
+    for (int phase = 0; phase < 2; phase++) {
+        for (int i = 0; i < num_of_clocks; i++) {
+            clocks[i]->value = phase == 0;
+            schedule_gate(clocks[i]);
+        }
+        settle_circuit();
+    }
+    clock_cycles++;
+}
+
+// Run the clock cycles that are due in free-running mode. Cycles are run for
+// at most CLOCK_BATCH_SECONDS at a time, and ones missed by more than that
+// are dropped instead of being caught up on.
+void run_free_clock()
+{
+    int rate = clock_rates[clock_rate_index];
+    double now = get_time_seconds();
+    double end = now + CLOCK_BATCH_SECONDS;
+
+    if (rate == 0 || next_clock_time < now - CLOCK_BATCH_SECONDS)
+        next_clock_time = now;
+    for (int cycle = 0; now >= next_clock_time && now < end; cycle++) {
+        run_clock_cycle();
+        if (rate > 0) next_clock_time += 1.0 / rate;
+        if (rate > 0 || cycle % 16 == 15) now = get_time_seconds();
+        if (rate == 0) next_clock_time = now;
+    }
+}
+
+// Bit parallel simulation
+
+// Compile the lane kernel for AVX2 as well when the compiler can pick the
+// version to use at load time
+#if defined(__GNUC__) && defined(__x86_64__)
+#define LANE_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define LANE_KERNEL
+#endif
+
+static inline void sim_gate_lanes(const Gate *gate, Lanes *states,
+                                  Lanes *value)
+{
+    const Edge *inputs = gate_inputs.items + gate->first_input;
+
+    *value = states[inputs[0].wire->net_index];
+    switch (gate->type) {
+    case AND:
+        for (int i = 1; i < gate->num_of_inputs; i++)
+            *value &= states[inputs[i].wire->net_index];
+        break;
+    case OR:
+        for (int i = 1; i < gate->num_of_inputs; i++)
+            *value |= states[inputs[i].wire->net_index];
+        break;
+    case XOR:
+        for (int i = 1; i < gate->num_of_inputs; i++)
+            *value ^= states[inputs[i].wire->net_index];
+        break;
+    case NOT:
+        *value = ~*value;
+        break;
+    case INPUT:
+    case CUSTOM:
+    case DFF:
+    case CLOCK:
+        break;
+    }
+}
+
+// Evaluate the whole circuit for LANE_BITS input vectors at once. Inputs are
+// set by the caller. Returns false if a feedback loop did not settle.
+LANE_KERNEL
+bool sim_circuit_lanes(Lanes *states)
+{
+    bool settled = true;
+    long evaluations = 0;
+
+    for (int scc = 0; scc < num_of_sccs; scc++) {
+        int passes = scc_cyclic[scc] ? MAX_FIXPOINT_PASSES : 1;
+        bool changed = true;
+
+        for (int pass = 0; pass < passes && changed; pass++) {
+            changed = false;
+            evaluations += scc_start[scc + 1] - scc_start[scc];
+            for (int i = scc_start[scc]; i < scc_start[scc + 1]; i++) {
+                const Gate *gate = sim_order[i];
+                Lanes value;
+                if (gate->type == INPUT || gate->type == DFF ||
+                    gate->num_of_inputs == 0 || gate->output == NULL)
+                    continue; // Sources keep the value they started with
+
+                sim_gate_lanes(gate, states, &value);
+                int net = gate->output->net_index;
+                if (faulty_nets != NULL && faulty_nets[net])
+                    value = (value & ~stuck_at_0[net]) | stuck_at_1[net];
+                Lanes diff = value ^ states[net];
+                for (unsigned int w = 0; w < LANE_BITS / 64; w++)
+                    if (diff[w]) changed = true;
+                states[net] = value;
+            }
+        }
+        if (changed && scc_cyclic[scc]) settled = false;
+    }
+    stats.gate_evaluations += evaluations;
+    return settled;
+}
+
+// Start every wire's lanes at its current value so floating wires behave the
+// same way as in the other engines
+void reset_lane_states()
+{
+    if (num_of_nets > lane_states_capacity) {
+        free(lane_states);
+        lane_states_capacity = num_of_nets * 2;
+        lane_states = aligned_alloc(sizeof(Lanes),
+                                    lane_states_capacity * sizeof(Lanes));
+    }
+    for (int i = 0; i < num_of_nets; i++) {
+        Lanes value = {0};
+        lane_states[i] = value - (uint64_t)net_list[i]->state;
+    }
+}
+
+int compare_gate_position(const void *a, const void *b)
+{
+    const Gate *gate_a = *(Gate **)a;
+    const Gate *gate_b = *(Gate **)b;
+    if (gate_a->y != gate_b->y) return gate_a->y - gate_b->y;
+    return gate_a->x - gate_b->x;
+}
+
+int compare_wire_position(const void *a, const void *b)
+{
+    const Wire *wire_a = *(Wire **)a;
+    const Wire *wire_b = *(Wire **)b;
+    if (wire_a->y1 != wire_b->y1) return wire_a->y1 - wire_b->y1;
+    return wire_a->x1 - wire_b->x1;
+}
+
+// The circuit's inputs are its INPUT gates and its outputs are the driven
+// nets that no gate reads, leaving out the nets inside sub-circuits. Both are
+// sorted top to bottom, then left to right. Circuits read from Verilog use
+// the ports they declare instead, in their order. The caller frees the lists.
+void get_circuit_ports(Gate ***inputs, int *num_of_inputs,
+                       Wire ***outputs, int *num_of_outputs)
+{
+    *inputs = malloc((gate_list_len + 1) * sizeof(Gate *));
+    *outputs = malloc((num_of_nets + 1) * sizeof(Wire *));
+    *num_of_inputs = 0;
+    *num_of_outputs = 0;
+
+    if (num_of_verilog_names > 0) {
+        for (int i = 0; i < num_of_verilog_ports; i++) {
+            Wire *wire = resolve_wire(verilog_ports[i].wire);
+            if (wire == NULL) continue; // Deleted on the board
+            if (verilog_ports[i].direction == PORT_OUTPUT)
+                (*outputs)[(*num_of_outputs)++] = wire->net;
+            else if (wire->net->driver != NULL &&
+                     wire->net->driver->type == INPUT)
+                (*inputs)[(*num_of_inputs)++] = wire->net->driver;
+        }
+        return;
+    }
+
+    for (int i = 0; i < gate_list_len; i++)
+        if (gate_list[i]->type == INPUT)
+            (*inputs)[(*num_of_inputs)++] = gate_list[i];
+    for (int i = 0; i < num_of_nets; i++)
+        if (net_list[i]->driver != NULL && net_list[i]->num_of_fanout == 0 &&
+            net_list[i]->instance == NULL)
+            (*outputs)[(*num_of_outputs)++] = net_list[i];
+
+    qsort(*inputs, *num_of_inputs, sizeof(Gate *), compare_gate_position);
+    qsort(*outputs, *num_of_outputs, sizeof(Wire *), compare_wire_position);
+}
+
+// Lane word for one input, where input k is bit (num_of_inputs - 1 - k) of
+// the vector number so rows come out in counting order
+uint64_t get_input_lane_word(int bit, uint64_t first_vector)
+{
+    static const uint64_t patterns[6] = {
+        0xaaaaaaaaaaaaaaaaull, 0xccccccccccccccccull, 0xf0f0f0f0f0f0f0f0ull,
+        0xff00ff00ff00ff00ull, 0xffff0000ffff0000ull, 0xffffffff00000000ull
+    };
+
+    if (bit < 6) return patterns[bit];
+    return (first_vector >> bit) & 1 ? ~0ull : 0;
+}
+
+// Write the outputs for every combination of the circuit's inputs. Returns
+// NULL, or why the table could not be written. If a feedback loop doesn't
+// settle, the rows before it are kept and the table ends there.
+const char *write_truth_table(FILE *file)
+{
+    Gate **inputs;
+    Wire **outputs;
+    int num_of_inputs, num_of_outputs;
+    const char *error = NULL;
+
+    get_circuit_ports(&inputs, &num_of_inputs, &outputs, &num_of_outputs);
+    if (num_of_inputs > MAX_TRUTH_TABLE_INPUTS) {
+        free(inputs);
+        free(outputs);
+        return "Too many inputs for a truth table.";
+    }
+
+    char buffer[16];
+    fprintf(file, "# inputs:");
+    for (int i = 0; i < num_of_inputs; i++) {
+        if (inputs[i]->output != NULL)
+            fprintf(file, " %s", get_net_name(inputs[i]->output->net, buffer,
+                                              sizeof(buffer)));
+        else
+            fprintf(file, " -");
+    }
+    fprintf(file, "\n# outputs:");
+    for (int i = 0; i < num_of_outputs; i++)
+        fprintf(file, " %s",
+                get_net_name(outputs[i], buffer, sizeof(buffer)));
+    fprintf(file, "\n");
+
+    reset_lane_states();
+
+    int row_len = num_of_inputs + 3 + num_of_outputs + 1;
+    char *row = malloc(row_len);
+    memset(row, ' ', row_len);
+    row[num_of_inputs + 1] = '|';
+    row[row_len - 1] = '\n';
+
+    uint64_t num_of_rows = 1ull << num_of_inputs;
+    for (uint64_t first = 0; first < num_of_rows; first += LANE_BITS) {
+        // Drive the inputs with LANE_BITS consecutive vectors
+        for (int i = 0; i < num_of_inputs; i++) {
+            if (inputs[i]->output == NULL) continue;
+
+            int bit = num_of_inputs - 1 - i;
+            Lanes *lanes = &lane_states[inputs[i]->output->net_index];
+            for (unsigned int w = 0; w < LANE_BITS / 64; w++)
+                (*lanes)[w] = get_input_lane_word(bit, first + w * 64);
+        }
+
+        if (!sim_circuit_lanes(lane_states)) {
+            error = "A feedback loop did not settle, the truth table is "
+                    "incomplete.";
+            break;
+        }
+
+        for (uint64_t v = 0; v < LANE_BITS && first + v < num_of_rows; v++) {
+            for (int i = 0; i < num_of_inputs; i++)
+                row[i] = '0' + ((first + v) >> (num_of_inputs - 1 - i) & 1);
+            for (int i = 0; i < num_of_outputs; i++) {
+                uint64_t word = lane_states[outputs[i]->net_index][v / 64];
+                row[num_of_inputs + 3 + i] = '0' + (word >> (v % 64) & 1);
+            }
+            fwrite(row, 1, row_len, file);
+        }
+    }
+
+    free(row);
+    free(inputs);
+    free(outputs);
+    return error;
+}
+
+// Symbolic simulation. Every net is turned into a BDD over the circuit's
+// inputs, so circuits with too many inputs for a truth table can still be
+// compared.
+
+// Empty the node store, unique table and computed cache
+void reset_bdds()
+{
+    bdd_unique_size = 1024;
+    free(bdd_unique);
+    bdd_unique = malloc(bdd_unique_size * sizeof(int));
+    for (int i = 0; i < bdd_unique_size; i++) bdd_unique[i] = -1;
+    if (bdd_cache == NULL)
+        bdd_cache = malloc(BDD_CACHE_SIZE * sizeof(BddCacheEntry));
+    for (int i = 0; i < BDD_CACHE_SIZE; i++) bdd_cache[i].op = -1;
+
+    if (bdd_nodes_capacity == 0) {
+        bdd_nodes_capacity = 1024;
+        bdd_nodes = malloc(bdd_nodes_capacity * sizeof(BddNode));
+    }
+    bdd_nodes[BDD_FALSE] = (BddNode){ INT_MAX, BDD_FALSE, BDD_FALSE, -1 };
+    bdd_nodes[BDD_TRUE] = (BddNode){ INT_MAX, BDD_TRUE, BDD_TRUE, -1 };
+    num_of_bdd_nodes = 2;
+    bdd_overflow = false;
+}
+
+uint32_t hash_bdd_node(int var, int low, int high)
+{
+    return (var * 2654435761u) ^ (low * 2246822519u) ^ (high * 3266489917u);
+}
+
+// The node testing var, made if it doesn't exist yet. Sets bdd_overflow
+// instead of going over bdd_node_limit.
+int make_bdd_node(int var, int low, int high)
+{
+    if (low == high) return low; // The test makes no difference
+
+    uint32_t bucket = hash_bdd_node(var, low, high) & (bdd_unique_size - 1);
+    for (int node = bdd_unique[bucket]; node >= 0;
+         node = bdd_nodes[node].next) {
+        const BddNode *existing = &bdd_nodes[node];
+        if (existing->var == var && existing->low == low &&
+            existing->high == high)
+            return node;
+    }
+    if (num_of_bdd_nodes >= bdd_node_limit) {
+        bdd_overflow = true;
+        return BDD_FALSE;
+    }
+
+    if (num_of_bdd_nodes == bdd_nodes_capacity) {
+        bdd_nodes_capacity *= 2;
+        bdd_nodes = realloc(bdd_nodes, bdd_nodes_capacity * sizeof(BddNode));
+    }
+    if (num_of_bdd_nodes >= bdd_unique_size) { // Keep the chains short
+        bdd_unique_size *= 2;
+        bdd_unique = realloc(bdd_unique, bdd_unique_size * sizeof(int));
+        for (int i = 0; i < bdd_unique_size; i++) bdd_unique[i] = -1;
+        for (int i = 2; i < num_of_bdd_nodes; i++) {
+            BddNode *node = &bdd_nodes[i];
+            uint32_t j = hash_bdd_node(node->var, node->low, node->high) &
+                         (bdd_unique_size - 1);
+            node->next = bdd_unique[j];
+            bdd_unique[j] = i;
+        }
+        bucket = hash_bdd_node(var, low, high) & (bdd_unique_size - 1);
+    }
+
+    int node = num_of_bdd_nodes++;
+    bdd_nodes[node] = (BddNode){ var, low, high, bdd_unique[bucket] };
+    bdd_unique[bucket] = node;
+    return node;
+}
+
+// Combine two functions with OP_AND, OP_OR or OP_XOR
+int apply_bdd(int op, int a, int b)
+{
+    if (bdd_overflow) return BDD_FALSE;
+    switch (op) {
+    case OP_AND:
+        if (a == BDD_FALSE || b == BDD_FALSE) return BDD_FALSE;
+        if (a == BDD_TRUE || a == b) return b;
+        if (b == BDD_TRUE) return a;
+        break;
+    case OP_OR:
+        if (a == BDD_TRUE || b == BDD_TRUE) return BDD_TRUE;
+        if (a == BDD_FALSE || a == b) return b;
+        if (b == BDD_FALSE) return a;
+        break;
+    case OP_XOR:
+        if (a == b) return BDD_FALSE;
+        if (a == BDD_FALSE) return b;
+        if (b == BDD_FALSE) return a;
+        break;
+    }
+    if (a > b) { // All three commute, so only one order is cached
+        int tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    BddCacheEntry *entry = &bdd_cache[(hash_bdd_node(op, a, b) >> 7) &
+                                      (BDD_CACHE_SIZE - 1)];
+    if (entry->op == op && entry->a == a && entry->b == b)
+        return entry->result;
+
+    // Split on the first input either of them tests
+    BddNode node_a = bdd_nodes[a], node_b = bdd_nodes[b];
+    int var = node_a.var < node_b.var ? node_a.var : node_b.var;
+    int low = apply_bdd(op, node_a.var == var ? node_a.low : a,
+                        node_b.var == var ? node_b.low : b);
+    int high = apply_bdd(op, node_a.var == var ? node_a.high : a,
+                         node_b.var == var ? node_b.high : b);
+    int result = make_bdd_node(var, low, high);
+
+    if (!bdd_overflow) *entry = (BddCacheEntry){ op, a, b, result };
+    return result;
+}
+
+// Find the function of every net, with input i of the list being variable
+// i. Floating nets keep their value. The circuit must not have feedback
+// loops. Returns NULL if bdd_node_limit was reached, or after printing an
+// error if a gate has no function of its inputs, such as a flip-flop. The
+// caller frees the list.
+int *build_net_bdds(Gate **inputs, int num_of_inputs)
+{
+    int *bdds = malloc((num_of_nets + 1) * sizeof(int));
+
+    for (int i = 0; i < num_of_nets; i++)
+        bdds[i] = net_list[i]->state ? BDD_TRUE : BDD_FALSE;
+    for (int i = 0; i < num_of_inputs; i++)
+        if (inputs[i]->output != NULL)
+            bdds[inputs[i]->output->net_index] =
+                make_bdd_node(i, BDD_FALSE, BDD_TRUE);
+
+    for (int i = 0; i < scc_start[num_of_sccs] && !bdd_overflow; i++) {
+        const Gate *gate = sim_order[i];
+        if (gate->type == INPUT || gate->type == CUSTOM ||
+            gate->num_of_inputs == 0 || gate->output == NULL)
+            continue;
+
+        int value = bdds[get_input(gate, 0)->net_index];
+        int op;
+        switch (gate->type) {
+        case NOT:
+            bdds[gate->output->net_index] = apply_bdd(OP_XOR, value,
+                                                      BDD_TRUE);
+            continue;
+        case AND: op = OP_AND; break;
+        case OR: op = OP_OR; break;
+        case XOR: op = OP_XOR; break;
+        default: // Flip-flops and clocks
+            fprintf(stderr, "%s gates have no BDD.\n",
+                    gate_type_names[gate->type]);
+            free(bdds);
+            return NULL;
+        }
+
+        for (int j = 1; j < gate->num_of_inputs; j++)
+            value = apply_bdd(op, value, bdds[get_input(gate, j)->net_index]);
+        bdds[gate->output->net_index] = value;
+    }
+
+    if (bdd_overflow) {
+        free(bdds);
+        return NULL;
+    }
+    return bdds;
+}
+
+// Pick input values that make a function other than false true. Inputs it
+// doesn't depend on are left alone.
+void find_bdd_solution(int node, bool *values)
+{
+    while (node != BDD_TRUE) { // Every other node leads to true
+        const BddNode *test = &bdd_nodes[node];
+        values[test->var] = test->low == BDD_FALSE;
+        node = test->low == BDD_FALSE ? test->high : test->low;
+    }
+}
+
+void add_fanout(Wire *wire, Gate *gate)
+{
+    if (wire->num_of_fanout == wire->fanout_capacity) {
+        int old_capacity = wire->fanout_capacity;
+        wire->fanout_capacity = old_capacity ? old_capacity * 2 : 4;
+        wire->first_fanout = grow_edges(&wire_fanouts, wire->first_fanout,
+                                        wire->num_of_fanout, old_capacity,
+                                        wire->fanout_capacity);
+    }
+    wire_fanouts.items[wire->first_fanout + wire->num_of_fanout++].gate = gate;
+}
+
+void remove_fanout(Wire *wire, const Gate *gate)
+{
+    Edge *fanout = wire_fanouts.items + wire->first_fanout;
+
+    for (int i = 0; i < wire->num_of_fanout; i++) {
+        if (fanout[i].gate == gate) {
+            fanout[i] = fanout[--wire->num_of_fanout];
+            return;
+        }
+    }
+}
+
+// Append an input to a gate. Returns true if a different wire was connected
+// to that input before the gate was reconnected.
+bool connect_gate_input(Gate *gate, Wire *wire, int old_num_of_inputs)
+{
+    int slot = gate->num_of_inputs++;
+    bool changed = slot >= old_num_of_inputs || get_input(gate, slot) != wire;
+
+    if (gate->num_of_inputs > gate->input_capacity) {
+        int old_capacity = gate->input_capacity;
+        gate->input_capacity = gate->num_of_inputs * 2;
+        gate->first_input = grow_edges(&gate_inputs, gate->first_input,
+                                       slot, old_capacity,
+                                       gate->input_capacity);
+    }
+    gate_inputs.items[gate->first_input + slot].wire = wire;
+    add_fanout(wire, gate);
+    return changed;
+}
+
+// Remove a gate from the netlist before it is freed
+void detach_gate(Gate *gate)
+{
+    for (int i = 0; i < gate->num_of_inputs; i++)
+        remove_fanout(get_input(gate, i), gate);
+    if (gate->output != NULL && gate->output->driver == gate)
+        gate->output->driver = NULL;
+    gate->num_of_inputs = 0;
+    gate->output = NULL;
+    order_dirty = true;
+}
+
+// Remove a wire from the netlist before it is freed
+void detach_wire(Wire *wire)
+{
+    for (int i = 0; i < wire->num_of_fanout; i++) {
+        Gate *gate = get_fanout(wire, i);
+        Edge *inputs = gate_inputs.items + gate->first_input;
+        int num_of_inputs = 0;
+        for (int j = 0; j < gate->num_of_inputs; j++)
+            if (inputs[j].wire != wire)
+                inputs[num_of_inputs++] = inputs[j];
+        gate->num_of_inputs = num_of_inputs;
+        schedule_gate(gate);
+    }
+    wire->num_of_fanout = 0;
+
+    if (wire->driver != NULL && wire->driver->output == wire)
+        wire->driver->output = NULL;
+    wire->driver = NULL;
+    order_dirty = true;
+}
+
+// Unlink a component from the netlist and the spatial index and free it.
+// The last component in the list is moved into its place, so deleting takes
+// constant time apart from the component's own connections.
+void delete_wire(Wire *wire)
+{
+    if (wire->instance == NULL)
+        unindex_wire(wire); // Splits the net while the gates are attached
+    detach_wire(wire);
+    wire_fanouts.garbage += wire->fanout_capacity;
+
+    Wire *last = wire_list[--wire_list_len];
+    wire_list[wire->index] = last;
+    last->index = wire->index;
+    mark_wire_redraw(last); // Now drawn in a different order
+
+    wire->generation++; // Invalidates handles in the net update queue
+    pool_free(&wire_pool, wire);
+}
+
+void delete_gate(Gate *gate)
+{
+    if (gate->parts != NULL) { // Parts first, they are attached to the wires
+        for (int i = 0; i < gate->definition->num_of_parts; i++)
+            delete_gate(&gate->parts[i]);
+        for (int i = 0; i < gate->definition->num_of_nets; i++)
+            delete_wire(&gate->part_wires[i]);
+    }
+    detach_gate(gate);
+    if (gate->instance == NULL) unindex_gate(gate);
+    gate_inputs.garbage += gate->input_capacity;
+
+    Gate *last = gate_list[--gate_list_len];
+    gate_list[gate->index] = last;
+    last->index = gate->index;
+    mark_gate_redraw(last); // Now drawn in a different order
+
+    gate->generation++; // Invalidates handles in the dirty list and queue
+    pool_free(&gate_pool, gate);
+}
+
+// Make (x0, y0) the end of a wire that is at the given cell. The corner
+// moves, so the wire may touch different wires afterwards.
+void swap_wire_ends(Wire *wire)
+{
+    split_net(wire);
+    unindex_wire_area(wire);
+    int tmp_x = wire->x0;
+    int tmp_y = wire->y0;
+    wire->y0 = wire->y1;
+    wire->x0 = wire->x1;
+    wire->x1 = tmp_x;
+    wire->y1 = tmp_y;
+    index_wire_area(wire);
+    queue_net_update(wire);
+}
+
+// Sub-circuit instances
+
+const Definition *find_definition(const char *name)
+{
+    for (int i = 0; i < num_of_definitions; i++)
+        if (strcmp(definitions[i]->name, name) == 0) return definitions[i];
+    return NULL;
+}
+
+// Add the parts of an instance as one run of gates and one of wires, with
+// one slice of each edge list between them
+void add_instance_parts(Gate *gate)
+{
+    const Definition *definition = gate->definition;
+    int first_input = alloc_edges(&gate_inputs,
+                                  definition->num_of_part_inputs);
+    int next_fanout = alloc_edges(&wire_fanouts,
+                                  definition->num_of_part_inputs);
+
+    gate->parts = pool_alloc_many(&gate_pool, definition->num_of_parts);
+    gate->part_wires = pool_alloc_many(&wire_pool, definition->num_of_nets);
+    reserve_components(definition->num_of_parts, definition->num_of_nets);
+
+    for (int i = 0; i < definition->num_of_nets; i++) {
+        Wire *wire = &gate->part_wires[i];
+        wire->id = ++last_wire_id;
+        wire->net = wire;
+        wire->next_in_net = wire;
+        wire->net_size = 1;
+        wire->first_fanout = next_fanout;
+        wire->fanout_capacity = definition->net_fanout[i];
+        next_fanout += wire->fanout_capacity;
+        wire->instance = gate;
+        wire->index = wire_list_len;
+        wire_list[wire_list_len++] = wire;
+    }
+
+    for (int i = 0; i < definition->num_of_parts; i++) {
+        const Part *part = &definition->parts[i];
+        Gate *gate_part = &gate->parts[i];
+        gate_part->type = part->type;
+        gate_part->first_input = first_input + part->first_input;
+        gate_part->input_capacity = part->num_of_inputs;
+        gate_part->instance = gate;
+        gate_part->index = gate_list_len;
+        gate_list[gate_list_len++] = gate_part;
+    }
+    nets_changed = true;
+}
+
+// Wire for one of an instance's nets. Pins with nothing connected use the
+// instance's own wire for that net.
+Wire *get_instance_net(const Gate *gate, Wire **pins, int net)
+{
+    const Definition *definition = gate->definition;
+    if (net < definition->num_of_inputs + definition->num_of_outputs &&
+        pins[net] != NULL)
+        return pins[net];
+    return &gate->part_wires[net];
+}
+
+// Connect the instance to the nets on its pins, along with every part that
+// reads or drives a pin, or all parts when they were just added. Returns true
+// if any connection changed.
+bool connect_instance(Gate *gate, Wire **pins, bool all_parts)
+{
+    const Definition *definition = gate->definition;
+    int old_num_of_inputs = gate->num_of_inputs;
+    bool changed = false;
+
+    // The instance itself reads its inputs so they can be saved and exported
+    for (int i = 0; i < old_num_of_inputs; i++)
+        remove_fanout(get_input(gate, i), gate);
+    gate->num_of_inputs = 0;
+    for (int i = 0; i < definition->num_of_inputs; i++)
+        if (connect_gate_input(gate, get_instance_net(gate, pins, i),
+                               old_num_of_inputs))
+            changed = true;
+
+    for (int i = 0; i < definition->num_of_parts; i++) {
+        const Part *part = &definition->parts[i];
+        Gate *gate_part = &gate->parts[i];
+        if (!all_parts && !part->uses_pins) continue;
+
+        old_num_of_inputs = gate_part->num_of_inputs;
+        for (int j = 0; j < old_num_of_inputs; j++)
+            remove_fanout(get_input(gate_part, j), gate_part);
+        gate_part->num_of_inputs = 0;
+        for (int j = 0; j < part->num_of_inputs; j++) {
+            int net = definition->part_inputs[part->first_input + j];
+            if (connect_gate_input(gate_part,
+                                   get_instance_net(gate, pins, net),
+                                   old_num_of_inputs))
+                changed = true;
+        }
+        if (gate_part->num_of_inputs != old_num_of_inputs) changed = true;
+
+        Wire *output = get_instance_net(gate, pins, part->output);
+        if (gate_part->output != output) {
+            if (gate_part->output != NULL &&
+                gate_part->output->driver == gate_part)
+                gate_part->output->driver = NULL;
+            gate_part->output = output;
+            changed = true;
+        }
+        output->driver = gate_part;
+        schedule_gate(gate_part);
+    }
+    return changed;
+}
+
+// Look up the nets on an instance's pins, adding its parts the first time
+void reconnect_custom_gate(Gate *gate)
+{
+    const Definition *definition = gate->definition;
+    int num_of_inputs = definition->num_of_inputs;
+    Wire *pins[2 * MAX_PINS];
+    int pin_y[MAX_PINS];
+
+    // Inputs end at (x1, y1), outputs start at (x0, y0)
+    get_gate_input_pins(gate, pin_y);
+    for (int i = 0; i < num_of_inputs; i++) {
+        pins[i] = NULL;
+        for (int e = spatial_find(&pin_grid, gate->x, pin_y[i]); e >= 0;
+             e = spatial_find_next(&pin_grid, e)) {
+            if (pin_grid.entries[e].tag != WIRE_END) continue;
+
+            Wire *wire = pin_grid.entries[e].item;
+            if (wire->x1 != gate->x || wire->y1 != pin_y[i])
+                swap_wire_ends(wire);
+            pins[i] = wire;
+        }
+    }
+
+    int out_x = gate->x + gate->width;
+    get_gate_output_pins(gate, pin_y);
+    for (int i = 0; i < definition->num_of_outputs; i++) {
+        pins[num_of_inputs + i] = NULL;
+        for (int e = spatial_find(&pin_grid, out_x, pin_y[i]); e >= 0;
+             e = spatial_find_next(&pin_grid, e)) {
+            if (pin_grid.entries[e].tag != WIRE_END) continue;
+
+            Wire *wire = pin_grid.entries[e].item;
+            if (wire->x0 != out_x || wire->y0 != pin_y[i])
+                swap_wire_ends(wire);
+            pins[num_of_inputs + i] = wire;
+        }
+    }
+
+    // Only look up the nets once every wire is turned the right way around
+    for (int i = 0; i < num_of_inputs + definition->num_of_outputs; i++)
+        if (pins[i] != NULL) pins[i] = pins[i]->net;
+
+    bool added = gate->parts == NULL;
+    if (added) add_instance_parts(gate);
+    if (connect_instance(gate, pins, added)) {
+        schedule_gate(gate);
+        order_dirty = true;
+    }
+}
+
+// Look up the wire ends touching a gate's pins and patch its connections
+void reconnect_gate(Gate *gate)
+{
+    if (gate->type == CUSTOM) {
+        reconnect_custom_gate(gate);
+        return;
+    }
+
+    Wire *old_output = gate->output;
+    int old_num_of_inputs = gate->num_of_inputs;
+    bool changed = false;
+    int pin_y[2];
+    int num_of_pins = get_gate_input_pins(gate, pin_y);
+
+    // Detach from the old wires
+    for (int i = 0; i < gate->num_of_inputs; i++)
+        remove_fanout(get_input(gate, i), gate);
+    if (gate->output != NULL && gate->output->driver == gate)
+        gate->output->driver = NULL;
+    gate->output = NULL;
+    gate->num_of_inputs = 0;
+
+    // Inputs end at (x1, y1). A flip-flop's clock is only connected along
+    // with its data input, so the clock is always the second input.
+    for (int i = 0; i < num_of_pins; i++) {
+        if (gate->type == DFF && gate->num_of_inputs < i) break;
+        for (int e = spatial_find(&pin_grid, gate->x, pin_y[i]); e >= 0;
+             e = spatial_find_next(&pin_grid, e)) {
+            if (pin_grid.entries[e].tag != WIRE_END) continue;
+
+            Wire *wire = pin_grid.entries[e].item;
+            if (wire->x1 != gate->x || wire->y1 != pin_y[i])
+                swap_wire_ends(wire);
+            if (gate->type == DFF && gate->num_of_inputs > i) continue;
+            if (connect_gate_input(gate, wire->net, old_num_of_inputs))
+                changed = true;
+        }
+    }
+
+    // Outputs start at (x0, y0)
+    int out_x = gate->x + gate->width;
+    int out_y = gate->y + 1;
+    for (int e = spatial_find(&pin_grid, out_x, out_y); e >= 0;
+         e = spatial_find_next(&pin_grid, e)) {
+        if (pin_grid.entries[e].tag != WIRE_END) continue;
+
+        Wire *wire = pin_grid.entries[e].item;
+        if (wire->x0 != out_x || wire->y0 != out_y)
+            swap_wire_ends(wire);
+        gate->output = wire->net;
+        wire->net->driver = gate;
+    }
+
+    if (changed || gate->num_of_inputs != old_num_of_inputs ||
+        gate->output != old_output) {
+        schedule_gate(gate);
+        order_dirty = true;
+    }
+}
+
+// Join the queued wires to the wires they touch and number the nets
+void update_nets()
+{
+    for (int i = 0; i < num_of_net_updates; i++) {
+        Wire *wire = resolve_wire(net_updates[i]);
+        if (wire == NULL || !wire->net_dirty) continue;
+        wire->net_dirty = false;
+        join_touching_wires(wire);
+        nets_changed = true;
+    }
+    num_of_net_updates = 0;
+    if (!nets_changed) return;
+
+    if (wire_list_len > net_list_capacity) {
+        net_list_capacity = wire_list_len * 2;
+        net_list = realloc(net_list, net_list_capacity * sizeof(Wire *));
+    }
+    num_of_nets = 0;
+    for (int i = 0; i < wire_list_len; i++) {
+        if (wire_list[i]->net != wire_list[i]) continue;
+        wire_list[i]->net_index = num_of_nets;
+        net_list[num_of_nets++] = wire_list[i];
+    }
+    nets_changed = false;
+    program_dirty = true;
+    clear_waveform();
+}
+
+void build_representation_from_graphics()
+{
+    double start = get_time_seconds();
+
+    // Reconnecting a gate can turn a wire around and change its net, which
+    // marks more gates. Those are left for the next round.
+    for (int round = 0; round < MAX_REBUILD_ROUNDS; round++) {
+        update_nets();
+        if (num_of_dirty_gates == 0) break;
+
+        int num_of_gates = num_of_dirty_gates;
+        for (int i = 0; i < num_of_gates; i++) {
+            Gate *gate = resolve_gate(dirty_gates[i]);
+            if (gate == NULL) continue; // Deleted after it was marked
+            gate->dirty = false;
+            reconnect_gate(gate);
+        }
+        num_of_dirty_gates -= num_of_gates;
+        memmove(dirty_gates, dirty_gates + num_of_gates,
+                num_of_dirty_gates * sizeof(GateHandle));
+    }
+    update_nets();
+    collect_edge_garbage();
+
+    if (order_dirty) {
+        levelize_circuit();
+        order_dirty = false;
+    }
+
+    stats.builds++;
+    stats.last_build_seconds = get_time_seconds() - start;
+    stats.build_seconds += stats.last_build_seconds;
+}
+
+// Files
+
+// Text circuits have one component per line:
+//   gate <type> <x> <y> <value> [delay]
+//   custom <definition> <x> <y>
+//   wire <x0> <y0> <x1> <y1>
+bool save_text_circuit(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return false;
+
+    fprintf(file, "# logic-simulator circuit\n");
+    for (int i = 0; i < gate_list_len; i++) {
+        const Gate *gate = gate_list[i];
+        if (gate->instance != NULL) continue; // Added again with the instance
+        if (gate->type == CUSTOM)
+            fprintf(file, "custom %s %d %d\n", gate->definition->name,
+                    gate->x, gate->y);
+        else if (gate->delay > 0)
+            fprintf(file, "gate %s %d %d %d %d\n",
+                    gate_type_names[gate->type], gate->x, gate->y,
+                    gate->value, gate->delay);
+        else
+            fprintf(file, "gate %s %d %d %d\n", gate_type_names[gate->type],
+                    gate->x, gate->y, gate->value);
+    }
+    for (int i = 0; i < wire_list_len; i++)
+        if (wire_list[i]->instance == NULL)
+            fprintf(file, "wire %d %d %d %d\n", wire_list[i]->x0,
+                    wire_list[i]->y0, wire_list[i]->x1, wire_list[i]->y1);
+
+    return fclose(file) == 0;
+}
+
+bool load_text_circuit(const char *path, FILE *file)
+{
+    char line[256];
+    int line_num = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char type_name[DEFINITION_NAME_LEN];
+        int x0, y0, x1, y1, value, delay = 0;
+        line_num++;
+
+        if (line[0] == '#' || line[0] == '\n') continue;
+
+        if (sscanf(line, "gate %15s %d %d %d %d", type_name, &x0, &y0,
+                   &value, &delay) >= 4) {
+            int type = -1;
+            for (int i = 0; i < NUM_OF_GATE_TYPES; i++)
+                if (strcmp(type_name, gate_type_names[i]) == 0) type = i;
+            if (type < 0 || type == CUSTOM) {
+                fprintf(stderr, "%s:%d: Unknown gate type %s.\n", path,
+                        line_num, type_name);
+                fclose(file);
+                return false;
+            }
+            if (delay < 0 || delay > MAX_GATE_DELAY) {
+                fprintf(stderr, "%s:%d: Invalid delay %d.\n", path,
+                        line_num, delay);
+                fclose(file);
+                return false;
+            }
+            Gate *gate = new_gate(type == NOT ? 1 : 2, type, x0, y0);
+            gate->value = value != 0;
+            gate->delay = delay;
+        } else if (sscanf(line, "custom %31s %d %d", type_name, &x0,
+                          &y0) == 3) {
+            const Definition *definition = find_definition(type_name);
+            if (definition == NULL) {
+                fprintf(stderr, "%s:%d: Unknown sub-circuit %s.\n", path,
+                        line_num, type_name);
+                fclose(file);
+                return false;
+            }
+            new_custom_gate(definition, x0, y0);
+        } else if (sscanf(line, "wire %d %d %d %d", &x0, &y0, &x1, &y1) == 4) {
+            new_wire(x0, y0, x1, y1);
+        } else {
+            fprintf(stderr, "%s:%d: Invalid line.\n", path, line_num);
+            fclose(file);
+            return false;
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+bool save_binary_circuit(const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    CircuitHeader header = { CIRCUIT_MAGIC, CIRCUIT_VERSION, 0, 0, 0,
+                             num_of_definitions };
+    uint32_t first_input = 0;
+
+    if (file == NULL) return false;
+
+    // Parts of sub-circuits are left out, so wires get new indices
+    build_representation_from_graphics(); // Save up to date connections
+    int *wire_indices = malloc((wire_list_len + 1) * sizeof(int));
+    for (int i = 0; i < wire_list_len; i++)
+        if (wire_list[i]->instance == NULL)
+            wire_indices[i] = header.num_of_wires++;
+    for (int i = 0; i < gate_list_len; i++) {
+        const Gate *gate = gate_list[i];
+        if (gate->instance != NULL) continue;
+        header.num_of_gates++;
+        if (gate->type != CUSTOM)
+            header.num_of_connections += gate->num_of_inputs;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (int i = 0; i < gate_list_len; i++) {
+        const Gate *gate = gate_list[i];
+        if (gate->instance != NULL) continue;
+
+        // Instances are reconnected when they are loaded
+        bool custom = gate->type == CUSTOM;
+        GateRecord record = { gate->type, gate->value,
+                              custom ? gate->definition->index : 0,
+                              gate->x, gate->y, first_input,
+                              custom ? 0 : gate->num_of_inputs,
+                              gate->output && !custom ?
+                              wire_indices[gate->output->index] : -1,
+                              gate->delay, {0} };
+        fwrite(&record, sizeof(record), 1, file);
+        first_input += record.num_of_inputs;
+    }
+
+    for (int i = 0; i < wire_list_len; i++) {
+        const Wire *wire = wire_list[i];
+        if (wire->instance != NULL) continue;
+        WireRecord record = { wire->id, wire->x0, wire->y0, wire->x1, wire->y1,
+                              wire_indices[wire->net->index], wire->state,
+                              {0} };
+        fwrite(&record, sizeof(record), 1, file);
+    }
+
+    for (int i = 0; i < gate_list_len; i++) {
+        const Gate *gate = gate_list[i];
+        if (gate->instance != NULL || gate->type == CUSTOM) continue;
+        for (int j = 0; j < gate->num_of_inputs; j++) {
+            uint32_t wire_index = wire_indices[get_input(gate, j)->index];
+            fwrite(&wire_index, sizeof(wire_index), 1, file);
+        }
+    }
+
+    for (int i = 0; i < num_of_definitions; i++) {
+        DefinitionRecord record = {0};
+        strcpy(record.name, definitions[i]->name);
+        fwrite(&record, sizeof(record), 1, file);
+    }
+
+    free(wire_indices);
+    return fclose(file) == 0;
+}
+
+// Check that every count and index in a mapped binary circuit is in range
+bool check_binary_circuit(const char *data, size_t size)
+{
+    const CircuitHeader *header = (const CircuitHeader *)data;
+    if (header->version != CIRCUIT_VERSION) return false;
+
+    size_t expected = sizeof(CircuitHeader) +
+                      (size_t)header->num_of_gates * sizeof(GateRecord) +
+                      (size_t)header->num_of_wires * sizeof(WireRecord) +
+                      (size_t)header->num_of_connections * sizeof(uint32_t) +
+                      (size_t)header->num_of_definitions *
+                      sizeof(DefinitionRecord);
+    if (size != expected) return false;
+
+    const GateRecord *gates = (const GateRecord *)(header + 1);
+    const WireRecord *wires = (const WireRecord *)(gates + header->num_of_gates);
+    const uint32_t *connections = (const uint32_t *)(wires +
+                                                     header->num_of_wires);
+    const DefinitionRecord *definition_records = (const DefinitionRecord *)
+        (connections + header->num_of_connections);
+
+    for (uint32_t i = 0; i < header->num_of_gates; i++) {
+        if (gates[i].type >= NUM_OF_GATE_TYPES ||
+            gates[i].first_input > header->num_of_connections ||
+            gates[i].num_of_inputs > header->num_of_connections -
+                                     gates[i].first_input ||
+            gates[i].output >= (int32_t)header->num_of_wires ||
+            gates[i].output < -1)
+            return false;
+        if (gates[i].type == CUSTOM &&
+            (gates[i].definition >= header->num_of_definitions ||
+             gates[i].num_of_inputs != 0 || gates[i].output != -1))
+            return false;
+    }
+    for (uint32_t i = 0; i < header->num_of_definitions; i++)
+        if (definition_records[i].name[DEFINITION_NAME_LEN - 1] != '\0')
+            return false;
+    for (uint32_t i = 0; i < header->num_of_wires; i++) {
+        int32_t net = wires[i].net;
+        if (net < 0 || net >= (int32_t)header->num_of_wires ||
+            wires[net].net != net)
+            return false;
+    }
+    for (uint32_t i = 0; i < header->num_of_connections; i++)
+        if (connections[i] >= header->num_of_wires) return false;
+    return true;
+}
+
+// Map a binary circuit and build its components straight from the records.
+// Gates and wires are each allocated as one run from their pool, the edges
+// as one slice of each edge list, and the connections are restored from the
+// table instead of being extracted again.
+bool load_binary_circuit(const char *path, int fd)
+{
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(CircuitHeader))
+        return false;
+
+    size_t size = info.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return false;
+
+    if (!check_binary_circuit(data, size)) {
+        fprintf(stderr, "%s: Invalid or unsupported circuit file.\n", path);
+        munmap((void *)data, size);
+        return false;
+    }
+
+    const CircuitHeader *header = (const CircuitHeader *)data;
+    const GateRecord *gate_records = (const GateRecord *)(header + 1);
+    const WireRecord *wire_records = (const WireRecord *)(gate_records +
+                                                          header->num_of_gates);
+    const uint32_t *connections = (const uint32_t *)(wire_records +
+                                                     header->num_of_wires);
+    const DefinitionRecord *definition_records = (const DefinitionRecord *)
+        (connections + header->num_of_connections);
+    int num_of_gates = header->num_of_gates;
+    int num_of_wires = header->num_of_wires;
+    int first_gate = gate_list_len;
+    int first_wire = wire_list_len;
+
+    // The sub-circuits have to be loaded with --lib
+    const Definition **file_definitions =
+        malloc((header->num_of_definitions + 1) * sizeof(Definition *));
+    for (uint32_t i = 0; i < header->num_of_definitions; i++) {
+        file_definitions[i] = find_definition(definition_records[i].name);
+        if (file_definitions[i] != NULL) continue;
+
+        fprintf(stderr, "%s: Unknown sub-circuit %s.\n", path,
+                definition_records[i].name);
+        free(file_definitions);
+        munmap((void *)data, size);
+        return false;
+    }
+
+    Gate *gates = pool_alloc_many(&gate_pool, num_of_gates);
+    Wire *wires = pool_alloc_many(&wire_pool, num_of_wires);
+    int first_input = alloc_edges(&gate_inputs, header->num_of_connections);
+    int next_fanout = alloc_edges(&wire_fanouts, header->num_of_connections);
+
+    memset(gates, 0, num_of_gates * sizeof(Gate));
+    memset(wires, 0, num_of_wires * sizeof(Wire));
+    reserve_components(num_of_gates, num_of_wires);
+
+    for (int i = 0; i < num_of_wires; i++) {
+        const WireRecord *record = &wire_records[i];
+        Wire *wire = &wires[i];
+        wire->id = last_wire_id + record->id;
+        wire->state = record->state;
+        wire->x0 = record->x0;
+        wire->y0 = record->y0;
+        wire->x1 = record->x1;
+        wire->y1 = record->y1;
+        wire->index = wire_list_len;
+        wire_list[wire_list_len++] = wire;
+        wire->net = &wires[record->net];
+        wire->next_in_net = wire;
+    }
+
+    // Link each net's wires into a list starting at its root
+    for (int i = 0; i < num_of_wires; i++) {
+        Wire *root = wires[i].net;
+        root->net_size++;
+        if (root == &wires[i]) continue;
+        wires[i].next_in_net = root->next_in_net;
+        root->next_in_net = &wires[i];
+    }
+
+    // Give each wire its part of the fanout slice
+    for (uint32_t i = 0; i < header->num_of_connections; i++)
+        wires[connections[i]].fanout_capacity++;
+    for (int i = 0; i < num_of_wires; i++) {
+        wires[i].first_fanout = next_fanout;
+        next_fanout += wires[i].fanout_capacity;
+    }
+
+    for (int i = 0; i < num_of_gates; i++) {
+        const GateRecord *record = &gate_records[i];
+        Gate *gate = &gates[i];
+        gate->type = record->type;
+        gate->value = record->value;
+        gate->delay = record->delay;
+        gate->x = record->x;
+        gate->y = record->y;
+        gate->width = 8;
+        gate->height = 3;
+        if (gate->type == CUSTOM) {
+            gate->definition = file_definitions[record->definition];
+            gate->width = gate->definition->width;
+            gate->height = gate->definition->height;
+        }
+        gate->first_input = first_input + record->first_input;
+        gate->num_of_inputs = record->num_of_inputs;
+        gate->input_capacity = record->num_of_inputs;
+        for (int j = 0; j < gate->num_of_inputs; j++) {
+            Wire *wire = &wires[connections[record->first_input + j]];
+            gate_inputs.items[gate->first_input + j].wire = wire;
+            wire_fanouts.items[wire->first_fanout +
+                               wire->num_of_fanout++].gate = gate;
+        }
+        if (record->output >= 0) {
+            gate->output = &wires[record->output];
+            gate->output->driver = gate;
+        }
+        if (gate->type == DFF && gate->num_of_inputs > 1) // Not an edge
+            gate->last_clock = get_input(gate, 1)->net->state;
+        gate->index = gate_list_len;
+        gate_list[gate_list_len++] = gate;
+    }
+
+    // Roughly three pins and four tiles for each gate and wire
+    spatial_reserve(&pin_grid, 3 * (num_of_gates + num_of_wires));
+    spatial_reserve(&area_grid, 4 * (num_of_gates + num_of_wires));
+    int num_of_old_updates = num_of_net_updates;
+    for (int i = first_wire; i < wire_list_len; i++) {
+        index_wire(wire_list[i]);
+        wire_list[i]->net_dirty = false; // Nets were saved with the circuit
+        if (wire_list[i]->id > last_wire_id) last_wire_id = wire_list[i]->id;
+    }
+    num_of_net_updates = num_of_old_updates;
+    nets_changed = true;
+    for (int i = first_gate; i < gate_list_len; i++) {
+        index_gate(gate_list[i]);
+        schedule_gate(gate_list[i]);
+        if (gate_list[i]->type == CUSTOM) mark_gate_dirty(gate_list[i]);
+    }
+    order_dirty = true;
+
+    free(file_definitions);
+    munmap((void *)data, size);
+    return true;
+}
+
+// Verilog netlists. Every net is named w<id> after its root wire, and
+// sub-circuits are written as modules of their own.
+
+bool is_verilog_path(const char *path)
+{
+    size_t len = strlen(path);
+    return len >= 2 && strcmp(path + len - 2, ".v") == 0;
+}
+
+void write_gate_verilog(FILE *file, const Gate *gate)
+{
+    static const char operators[] = { [AND] = '&', [OR] = '|', [XOR] = '^' };
+    if (gate->output == NULL || gate->num_of_inputs == 0) return;
+
+    switch (gate->type) {
+    case NOT:
+        fprintf(file, "assign w%d = ~w%d;\n", gate->output->id,
+                get_input(gate, 0)->id);
+        break;
+    case AND:
+    case OR:
+    case XOR:
+        fprintf(file, "assign w%d = w%d", gate->output->id,
+                get_input(gate, 0)->id);
+        for (int i = 1; i < gate->num_of_inputs; i++)
+            fprintf(file, " %c w%d", operators[gate->type],
+                    get_input(gate, i)->id);
+        fprintf(file, ";\n");
+        break;
+    case DFF:
+        if (gate->num_of_inputs > 1)
+            fprintf(file, "always @(posedge w%d) w%d <= w%d;\n",
+                    get_input(gate, 1)->id, gate->output->id,
+                    get_input(gate, 0)->id);
+        break;
+    case INPUT: // Ports of the module
+    case CLOCK:
+    case CUSTOM: // Written by write_instance_verilog()
+        break;
+    }
+}
+
+// Write a sub-circuit as a module. Its nets are named by their number in the
+// definition, with the pins first.
+void write_definition_verilog(FILE *file, const Definition *definition)
+{
+    static const char operators[] = { [AND] = '&', [OR] = '|', [XOR] = '^' };
+    int num_of_pins = definition->num_of_inputs + definition->num_of_outputs;
+
+    bool *registers = calloc(definition->num_of_nets, sizeof(bool));
+
+    for (int i = 0; i < definition->num_of_parts; i++)
+        if (definition->parts[i].type == DFF)
+            registers[definition->parts[i].output] = true;
+
+    fprintf(file, "module %s(", definition->name);
+    for (int i = 0; i < num_of_pins; i++)
+        fprintf(file, "%s%s%s w%d", i > 0 ? ", " : "",
+                i < definition->num_of_inputs ? "input" : "output",
+                registers[i] ? " reg" : "", i);
+    fprintf(file, ");\n");
+    for (int i = num_of_pins; i < definition->num_of_nets; i++)
+        fprintf(file, "%s w%d;\n", registers[i] ? "reg" : "wire", i);
+
+    for (int i = 0; i < definition->num_of_parts; i++) {
+        const Part *part = &definition->parts[i];
+        const int *inputs = definition->part_inputs + part->first_input;
+
+        if (part->type == DFF) {
+            if (part->num_of_inputs > 1)
+                fprintf(file, "always @(posedge w%d) w%d <= w%d;\n",
+                        inputs[1], part->output, inputs[0]);
+            continue;
+        }
+        if (part->type == NOT) {
+            fprintf(file, "assign w%d = ~w%d;\n", part->output, inputs[0]);
+            continue;
+        }
+        fprintf(file, "assign w%d = w%d", part->output, inputs[0]);
+        for (int j = 1; j < part->num_of_inputs; j++)
+            fprintf(file, " %c w%d", operators[part->type], inputs[j]);
+        fprintf(file, ";\n");
+    }
+    fprintf(file, "endmodule\n\n");
+    free(registers);
+}
+
+// Write an instance of a sub-circuit, leaving unconnected pins empty
+void write_instance_verilog(FILE *file, const Gate *gate)
+{
+    const Definition *definition = gate->definition;
+    if (gate->parts == NULL) return;
+
+    fprintf(file, "%s u%d(", definition->name, gate->index);
+    for (int i = 0; i < gate->num_of_inputs; i++) {
+        const Wire *wire = get_input(gate, i);
+        if (i > 0) fprintf(file, ", ");
+        if (wire->instance == NULL) fprintf(file, "w%d", wire->id);
+    }
+    for (int i = 0; i < definition->num_of_outputs; i++) {
+        int part = definition->output_parts[i];
+        const Wire *wire = part >= 0 ? gate->parts[part].output : NULL;
+        if (i > 0 || gate->num_of_inputs > 0) fprintf(file, ", ");
+        if (wire != NULL && wire->instance == NULL)
+            fprintf(file, "w%d", wire->id);
+    }
+    fprintf(file, ");\n");
+}
+
+// Write the circuit as a module called main. Its ports are the same as the
+// inputs and outputs of --batch, in the same order, with the clocks as extra
+// inputs after the others.
+void write_verilog(FILE *file)
+{
+    Gate **inputs;
+    Wire **outputs;
+    int num_of_inputs, num_of_outputs;
+    int num_of_ports = 0;
+
+    for (int i = 0; i < num_of_definitions; i++)
+        write_definition_verilog(file, definitions[i]);
+
+    get_circuit_ports(&inputs, &num_of_inputs, &outputs, &num_of_outputs);
+    fprintf(file, "module main(");
+    for (int i = 0; i < num_of_inputs; i++) {
+        if (inputs[i]->output == NULL) continue;
+        fprintf(file, "%s\n    input w%d", num_of_ports++ > 0 ? "," : "",
+                inputs[i]->output->id);
+    }
+    for (int i = 0; i < gate_list_len; i++) {
+        const Gate *gate = gate_list[i];
+        if (gate->type != CLOCK || gate->output == NULL) continue;
+        fprintf(file, "%s\n    input w%d", num_of_ports++ > 0 ? "," : "",
+                gate->output->id);
+    }
+    bool *is_output = calloc(num_of_nets + 1, sizeof(bool));
+    for (int i = 0; i < num_of_outputs; i++) {
+        Gate *driver = outputs[i]->driver;
+        is_output[outputs[i]->net_index] = true;
+        if (driver != NULL &&
+            (driver->type == INPUT || driver->type == CLOCK))
+            continue; // Already an input port
+        fprintf(file, "%s\n    output %sw%d", num_of_ports++ > 0 ? "," : "",
+                driver != NULL && driver->type == DFF ? "reg " : "",
+                outputs[i]->id);
+    }
+    fprintf(file, "\n);\n");
+
+    for (int i = 0; i < num_of_nets; i++) { // Declare the other nets
+        const Wire *net = net_list[i];
+        if (net->instance != NULL || is_output[i]) continue;
+        if (net->driver != NULL &&
+            (net->driver->type == INPUT || net->driver->type == CLOCK))
+            continue;
+        if (net->driver != NULL && net->num_of_fanout == 0) continue;
+        fprintf(file, "%s w%d;\n", net->driver != NULL &&
+                net->driver->type == DFF ? "reg" : "wire", net->id);
+    }
+
+    for (int i = 0; i < gate_list_len; i++) {
+        if (gate_list[i]->instance != NULL) continue; // In their module
+        if (gate_list[i]->type == CUSTOM)
+            write_instance_verilog(file, gate_list[i]);
+        else
+            write_gate_verilog(file, gate_list[i]);
+    }
+    fprintf(file, "endmodule\n");
+
+    free(is_output);
+    free(inputs);
+    free(outputs);
+}
+
+bool save_verilog(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return false;
+
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+    build_representation_from_graphics();
+    write_verilog(file);
+    return fclose(file) == 0;
+}
+
+// Reads Verilog netlists made of assign statements and flip-flops. Nets are
+// created as they are first named, and the order they are named in is used as
+// their position. The names and the ports, in the order they are declared
+// in, are kept for --batch and the other command line tools. The components
+// aren't placed on the board.
+
+#define VERILOG_TOKEN_LEN 256
+
+typedef struct VerilogName {
+    char *name;
+    Wire *wire;
+    int port; // Index in the parser's ports, or -1
+} VerilogName;
+
+typedef struct VerilogParser {
+    const char *path;
+    const char *text; // Just after the current token
+    int line;
+    char token[VERILOG_TOKEN_LEN];
+    VerilogName *names; // Open addressing hash table
+    int num_of_names;
+    int name_capacity; // Always a power of two
+    int num_of_wires; // Also the position of the next wire
+    VerilogPort *ports;
+    int num_of_ports;
+    int port_capacity;
+    bool failed;
+} VerilogParser;
+
+void verilog_error(VerilogParser *parser, const char *message)
+{
+    if (parser->failed) return; // Only report the first error
+    fprintf(stderr, "%s:%d: %s\n", parser->path, parser->line, message);
+    parser->failed = true;
+}
+
+// Move on to the next token. At the end of the file the token is empty.
+void next_verilog_token(VerilogParser *parser)
+{
+    const char *text = parser->text;
+    int len = 0;
+
+    for (;;) { // Skip white space and comments
+        if (*text == '\n') parser->line++;
+        if (isspace((unsigned char)*text)) {
+            text++;
+        } else if (text[0] == '/' && text[1] == '/') {
+            while (*text != '\n' && *text != '\0') text++;
+        } else if (text[0] == '/' && text[1] == '*') {
+            for (text += 2; *text != '\0'; text++) {
+                if (text[0] == '*' && text[1] == '/') {
+                    text += 2;
+                    break;
+                }
+                if (*text == '\n') parser->line++;
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (isalnum((unsigned char)*text) || *text == '_' || *text == '\\') {
+        // Names, keywords and numbers. Escaped names end at white space.
+        bool escaped = *text == '\\';
+        while (*text != '\0' && (escaped ? !isspace((unsigned char)*text) :
+               isalnum((unsigned char)*text) || *text == '_' ||
+               *text == '$' || *text == '\'')) {
+            if (len < VERILOG_TOKEN_LEN - 1) parser->token[len++] = *text;
+            text++;
+        }
+    } else if (*text != '\0') {
+        parser->token[len++] = *text++;
+    }
+    parser->token[len] = '\0';
+    parser->text = text;
+}
+
+bool verilog_token_is(const VerilogParser *parser, const char *token)
+{
+    return strcmp(parser->token, token) == 0;
+}
+
+void expect_verilog_token(VerilogParser *parser, const char *token)
+{
+    if (!verilog_token_is(parser, token)) {
+        char message[VERILOG_TOKEN_LEN + 32];
+        snprintf(message, sizeof(message), "Expected '%s'.", token);
+        verilog_error(parser, message);
+    }
+    next_verilog_token(parser);
+}
+
+bool is_verilog_name(const char *token)
+{
+    return isalpha((unsigned char)token[0]) || token[0] == '_' ||
+           token[0] == '\\';
+}
+
+uint32_t hash_verilog_name(const char *name)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (; *name != '\0'; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+// The name in the current token, creating its net when it is first named
+VerilogName *get_verilog_name(VerilogParser *parser)
+{
+    if (!is_verilog_name(parser->token)) {
+        verilog_error(parser, "Expected a net name.");
+        return NULL;
+    }
+
+    if (parser->num_of_names * 2 >= parser->name_capacity) {
+        VerilogName *old_names = parser->names;
+        int old_capacity = parser->name_capacity;
+        parser->name_capacity = old_capacity ? old_capacity * 2 : 1024;
+        parser->names = calloc(parser->name_capacity, sizeof(VerilogName));
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_names[i].name == NULL) continue;
+            uint32_t slot = hash_verilog_name(old_names[i].name);
+            while (parser->names[slot & (parser->name_capacity - 1)].name)
+                slot++;
+            parser->names[slot & (parser->name_capacity - 1)] = old_names[i];
+        }
+        free(old_names);
+    }
+
+    uint32_t slot = hash_verilog_name(parser->token);
+    for (;; slot++) {
+        VerilogName *name = &parser->names[slot &
+                                           (parser->name_capacity - 1)];
+        if (name->name == NULL) {
+            name->name = strdup(parser->token);
+            name->wire = alloc_wire(0, parser->num_of_wires, 0,
+                                    parser->num_of_wires);
+            name->port = -1;
+            parser->num_of_wires++;
+            parser->num_of_names++;
+            return name;
+        }
+        if (strcmp(name->name, parser->token) == 0) return name;
+    }
+}
+
+// The net called by the current token
+Wire *get_verilog_net(VerilogParser *parser)
+{
+    VerilogName *name = get_verilog_name(parser);
+    return name != NULL ? name->wire : NULL;
+}
+
+// Make a gate drive a net, which is a new unnamed net if output is NULL
+Wire *add_verilog_gate(VerilogParser *parser, int type, Wire **inputs,
+                       int num_of_inputs, Wire *output)
+{
+    if (output == NULL) {
+        output = alloc_wire(0, parser->num_of_wires, 0, parser->num_of_wires);
+        parser->num_of_wires++;
+    }
+    if (output->driver != NULL) {
+        verilog_error(parser, "Net has more than one driver.");
+        return output;
+    }
+
+    Gate *gate = alloc_gate(num_of_inputs, type, 0, output->y0);
+    for (int i = 0; i < num_of_inputs; i++)
+        connect_gate_input(gate, inputs[i], 0);
+    gate->output = output;
+    output->driver = gate;
+    schedule_gate(gate);
+    return output;
+}
+
+// Look ahead for a binary operator in the current bracket
+bool verilog_expression_has_operator(VerilogParser *parser)
+{
+    const char *text = parser->text;
+    int depth = verilog_token_is(parser, "(") ? 1 : 0;
+
+    for (; *text != '\0' && *text != ';'; text++) {
+        if (*text == '(') depth++;
+        if (*text == ')' && --depth < 0) break;
+        if (*text == ',' && depth == 0) break;
+        if (depth == 0 && (*text == '&' || *text == '|' || *text == '^'))
+            return true;
+    }
+    return false;
+}
+
+Wire *parse_verilog_expression(VerilogParser *parser, Wire *output);
+
+// An operand is a net, an inverted operand or an expression in brackets.
+// The result is written to output, or to a new net if it is NULL.
+Wire *parse_verilog_operand(VerilogParser *parser, Wire *output)
+{
+    if (verilog_token_is(parser, "~") || verilog_token_is(parser, "!")) {
+        next_verilog_token(parser);
+        Wire *input = parse_verilog_operand(parser, NULL);
+        if (parser->failed) return NULL;
+        return add_verilog_gate(parser, NOT, &input, 1, output);
+    }
+    if (verilog_token_is(parser, "(")) {
+        next_verilog_token(parser);
+        Wire *result = parse_verilog_expression(parser, output);
+        expect_verilog_token(parser, ")");
+        return result;
+    }
+
+    Wire *net = get_verilog_net(parser);
+    if (net == NULL) return NULL;
+    next_verilog_token(parser);
+    if (output == NULL || output == net) return net;
+    return add_verilog_gate(parser, OR, &net, 1, output); // Buffer
+}
+
+// Operands joined by one kind of operator, which becomes a single gate
+Wire *parse_verilog_expression(VerilogParser *parser, Wire *output)
+{
+    if (!verilog_expression_has_operator(parser))
+        return parse_verilog_operand(parser, output);
+
+    Wire **inputs = NULL;
+    int num_of_inputs = 0;
+    char operator = 0;
+
+    for (;;) {
+        inputs = realloc(inputs, (num_of_inputs + 1) * sizeof(Wire *));
+        inputs[num_of_inputs] = parse_verilog_operand(parser, NULL);
+        if (parser->failed) break;
+        num_of_inputs++;
+
+        char next = parser->token[0];
+        if (parser->token[1] != '\0' ||
+            (next != '&' && next != '|' && next != '^'))
+            break;
+        if (operator != 0 && next != operator) {
+            verilog_error(parser, "Mixed operators need brackets.");
+            break;
+        }
+        operator = next;
+        next_verilog_token(parser);
+    }
+
+    if (!parser->failed) {
+        int type = operator == '&' ? AND : operator == '|' ? OR : XOR;
+        output = add_verilog_gate(parser, type, inputs, num_of_inputs,
+                                  output);
+    }
+    free(inputs);
+    return output;
+}
+
+// A flip-flop, always @(posedge clock) q <= d
+void parse_verilog_always(VerilogParser *parser)
+{
+    Wire *inputs[2];
+
+    expect_verilog_token(parser, "always");
+    expect_verilog_token(parser, "@");
+    expect_verilog_token(parser, "(");
+    expect_verilog_token(parser, "posedge");
+    inputs[1] = get_verilog_net(parser);
+    if (inputs[1] == NULL) return;
+    next_verilog_token(parser);
+    expect_verilog_token(parser, ")");
+
+    Wire *output = get_verilog_net(parser);
+    if (output == NULL) return;
+    next_verilog_token(parser);
+    expect_verilog_token(parser, "<");
+    expect_verilog_token(parser, "=");
+    inputs[0] = parse_verilog_expression(parser, NULL);
+    if (!parser->failed) add_verilog_gate(parser, DFF, inputs, 2, output);
+}
+
+// A net name after input, output, wire or reg, or in the port list of the
+// module. Every name in the port list is a port, even if its direction is
+// only declared later, and input and output declarations add the ones that
+// aren't. Inputs are driven by INPUT gates.
+void parse_verilog_declaration(VerilogParser *parser, int direction,
+                               bool in_port_list)
+{
+    if (verilog_token_is(parser, "[")) {
+        verilog_error(parser, "Vectors are not supported.");
+        return;
+    }
+    VerilogName *name = get_verilog_name(parser);
+    if (name == NULL) return;
+    next_verilog_token(parser);
+    if (!in_port_list && direction == PORT_NONE) return; // Wire or reg
+
+    if (name->port < 0) {
+        if (parser->num_of_ports == parser->port_capacity) {
+            parser->port_capacity = parser->port_capacity ?
+                                    parser->port_capacity * 2 : 64;
+            parser->ports = realloc(parser->ports, parser->port_capacity *
+                                                   sizeof(VerilogPort));
+        }
+        name->port = parser->num_of_ports++;
+        parser->ports[name->port] = (VerilogPort){
+            get_wire_handle(name->wire), PORT_NONE
+        };
+    } else if (in_port_list ||
+               parser->ports[name->port].direction != PORT_NONE) {
+        verilog_error(parser, "Port is declared twice.");
+        return;
+    }
+
+    parser->ports[name->port].direction = direction;
+    if (direction == PORT_INPUT)
+        add_verilog_gate(parser, INPUT, NULL, 0, name->wire);
+}
+
+void parse_verilog_module(VerilogParser *parser)
+{
+    expect_verilog_token(parser, "module");
+    next_verilog_token(parser); // Name
+    if (verilog_token_is(parser, "(")) { // Ports, with or without directions
+        int direction = PORT_NONE;
+        next_verilog_token(parser);
+        while (!parser->failed && !verilog_token_is(parser, ")")) {
+            if (verilog_token_is(parser, "input") ||
+                verilog_token_is(parser, "output")) {
+                direction = verilog_token_is(parser, "input") ? PORT_INPUT :
+                                                                PORT_OUTPUT;
+                next_verilog_token(parser);
+                if (verilog_token_is(parser, "wire") ||
+                    verilog_token_is(parser, "reg"))
+                    next_verilog_token(parser);
+            }
+            parse_verilog_declaration(parser, direction, true);
+            if (!verilog_token_is(parser, ")"))
+                expect_verilog_token(parser, ",");
+        }
+        next_verilog_token(parser);
+    }
+    expect_verilog_token(parser, ";");
+
+    while (!parser->failed && !verilog_token_is(parser, "endmodule")) {
+        if (verilog_token_is(parser, "input") ||
+            verilog_token_is(parser, "output") ||
+            verilog_token_is(parser, "wire") ||
+            verilog_token_is(parser, "reg")) {
+            int direction = verilog_token_is(parser, "input") ? PORT_INPUT :
+                            verilog_token_is(parser, "output") ? PORT_OUTPUT :
+                                                                 PORT_NONE;
+            do {
+                next_verilog_token(parser);
+                if (verilog_token_is(parser, "wire") ||
+                    verilog_token_is(parser, "reg"))
+                    next_verilog_token(parser);
+                parse_verilog_declaration(parser, direction, false);
+            } while (!parser->failed && verilog_token_is(parser, ","));
+        } else if (verilog_token_is(parser, "always")) {
+            parse_verilog_always(parser);
+        } else if (verilog_token_is(parser, "assign")) {
+            do {
+                next_verilog_token(parser);
+                Wire *net = get_verilog_net(parser);
+                if (net == NULL) break;
+                next_verilog_token(parser);
+                expect_verilog_token(parser, "=");
+                parse_verilog_expression(parser, net);
+            } while (!parser->failed && verilog_token_is(parser, ","));
+        } else if (parser->token[0] == '\0') {
+            verilog_error(parser, "Expected 'endmodule'.");
+        } else {
+            verilog_error(parser, "Only assign statements and flip-flops "
+                                  "are supported.");
+        }
+        expect_verilog_token(parser, ";");
+    }
+
+    for (int i = 0; i < parser->name_capacity && !parser->failed; i++) {
+        const VerilogName *name = &parser->names[i];
+        if (name->name == NULL || name->port < 0 ||
+            parser->ports[name->port].direction != PORT_NONE)
+            continue;
+        char message[VERILOG_TOKEN_LEN + 32];
+        snprintf(message, sizeof(message), "Port %s has no direction.",
+                 name->name);
+        verilog_error(parser, message);
+    }
+}
+
+// Forget the names and ports of the last circuit read from Verilog
+void clear_verilog_names()
+{
+    for (int i = 0; i < num_of_verilog_names; i++) free(verilog_names[i]);
+    free(verilog_names);
+    free(verilog_ports);
+    verilog_names = NULL;
+    verilog_ports = NULL;
+    num_of_verilog_names = 0;
+    num_of_verilog_ports = 0;
+}
+
+// Add the last module in a Verilog file to the netlist. Earlier modules are
+// skipped, so files written by write_verilog() can be read back as long as
+// they have no sub-circuits.
+bool load_verilog_circuit(const char *path, FILE *file)
+{
+    VerilogParser parser = { path };
+    char *text = NULL;
+    size_t len = 0;
+    size_t capacity = 0;
+
+    for (;;) { // Read the whole file
+        if (len + 4096 + 1 > capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 16;
+            text = realloc(text, capacity);
+        }
+        size_t read = fread(text + len, 1, capacity - len - 1, file);
+        if (read == 0) break;
+        len += read;
+    }
+    text[len] = '\0';
+    fclose(file);
+
+    // Find the last module
+    const char *module = NULL;
+    int module_line = 1;
+    parser.text = text;
+    parser.line = 1;
+    for (;;) {
+        const char *start = parser.text;
+        int start_line = parser.line;
+        next_verilog_token(&parser);
+        if (parser.token[0] == '\0') break;
+        if (verilog_token_is(&parser, "module")) {
+            module = start;
+            module_line = start_line;
+        }
+    }
+
+    if (module == NULL) {
+        verilog_error(&parser, "Expected 'module'.");
+    } else {
+        parser.text = module;
+        parser.line = module_line;
+        next_verilog_token(&parser);
+        parse_verilog_module(&parser);
+    }
+
+    // Keep the names and ports for the circuit
+    clear_verilog_names();
+    if (!parser.failed) {
+        num_of_verilog_names = last_wire_id + 1;
+        verilog_names = calloc(num_of_verilog_names, sizeof(char *));
+        verilog_ports = parser.ports;
+        num_of_verilog_ports = parser.num_of_ports;
+        parser.ports = NULL;
+    }
+    for (int i = 0; i < parser.name_capacity; i++) {
+        const VerilogName *name = &parser.names[i];
+        if (name->name == NULL) continue;
+        if (parser.failed) free(name->name);
+        else verilog_names[name->wire->id] = name->name;
+    }
+    free(parser.names);
+    free(parser.ports);
+    free(text);
+    order_dirty = true;
+    return !parser.failed;
+}
+
+// Files ending in .txt are saved as text, files ending in .v as a Verilog
+// netlist and everything else as binary
+bool save_circuit(const char *path)
+{
+    size_t len = strlen(path);
+    if (len >= 4 && strcmp(path + len - 4, ".txt") == 0)
+        return save_text_circuit(path);
+    if (is_verilog_path(path)) return save_verilog(path);
+    return save_binary_circuit(path);
+}
+
+// Add the components in a saved circuit. Prints an error and returns false
+// if the file can't be read.
+bool load_circuit(const char *path)
+{
+    char magic[4] = {0};
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        return false;
+    }
+
+    if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+        memcmp(magic, CIRCUIT_MAGIC, sizeof(magic)) == 0) {
+        bool loaded = load_binary_circuit(path, fd);
+        close(fd);
+        return loaded;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    FILE *file = fdopen(fd, "r");
+    if (is_verilog_path(path)) return load_verilog_circuit(path, file);
+    return load_text_circuit(path, file);
+}
+
+// Sub-circuit definitions
+
+// Number for a net of the board in the definition, numbering new nets as
+// they are found
+int get_definition_net(int *nets, int *num_of_nets, const Wire *wire)
+{
+    int *net = &nets[wire->net->net_index];
+    if (*net < 0) *net = (*num_of_nets)++;
+    return *net;
+}
+
+// Draw a box with the name on the first row and a pin on every other row
+char *make_definition_ascii(const Definition *definition)
+{
+    int rows = definition->height;
+    int width = definition->width;
+    char *ascii = malloc(rows * (width + 2) + 1);
+    char *c = ascii;
+
+    for (int y = 0; y < rows; y++) {
+        int pin = y % 2 == 1 ? y / 2 : -1;
+        *c++ = pin >= 0 && pin < definition->num_of_inputs ? '-' : ' ';
+        for (int x = 1; x < width; x++) {
+            if (y == 0 || y == rows - 1 || x == 1 || x == width - 1)
+                *c++ = '#';
+            else if (y == 1 && x >= 3 && x - 3 < (int)strlen(definition->name))
+                *c++ = definition->name[x - 3];
+            else
+                *c++ = ' ';
+        }
+        if (pin >= 0 && pin < definition->num_of_outputs) *c++ = '-';
+        *c++ = y < rows - 1 ? '\n' : '\0';
+    }
+    return ascii;
+}
+
+// Compile the circuit on the board into a definition. Only gates that an
+// output depends on are kept, in the order they are simulated, with INPUT
+// gates replaced by the input pins. Outputs wired straight to an input get
+// an OR gate reading the input twice as a buffer.
+Definition *compile_definition(Gate **inputs, int num_of_inputs,
+                               Wire **outputs, int num_of_outputs)
+{
+    int num_of_pins = num_of_inputs + num_of_outputs;
+    int num_of_gates = scc_start[num_of_sccs];
+    int *nets = malloc((num_of_nets + 1) * sizeof(int));
+    bool *live = calloc(num_of_nets + 1, sizeof(bool));
+    bool *used = calloc(gate_list_len + 1, sizeof(bool));
+    int through[MAX_PINS]; // Input wired to each output, or -1
+    int num_of_parts = 0;
+    int num_of_part_inputs = 0;
+
+    for (int i = 0; i < num_of_nets; i++)
+        nets[i] = -1;
+    for (int i = 0; i < num_of_inputs; i++)
+        if (inputs[i]->output != NULL)
+            nets[inputs[i]->output->net->net_index] = i;
+    for (int i = 0; i < num_of_outputs; i++) {
+        int net = outputs[i]->net_index;
+        through[i] = nets[net];
+        if (through[i] < 0) nets[net] = num_of_inputs + i;
+        live[net] = through[i] < 0;
+        if (through[i] >= 0) {
+            num_of_parts++;
+            num_of_part_inputs += 2;
+        }
+    }
+
+    // Walk back from the outputs, again until nothing changes for loops
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = num_of_gates - 1; i >= 0; i--) {
+            const Gate *gate = sim_order[i];
+            if (used[gate->index] || gate->type == INPUT ||
+                gate->type == CUSTOM || gate->output == NULL ||
+                gate->num_of_inputs == 0 ||
+                !live[gate->output->net->net_index])
+                continue;
+
+            used[gate->index] = true;
+            changed = true;
+            num_of_parts++;
+            num_of_part_inputs += gate->num_of_inputs;
+            for (int j = 0; j < gate->num_of_inputs; j++)
+                live[get_input(gate, j)->net->net_index] = true;
+        }
+    }
+
+    Definition *definition = calloc(1, sizeof(Definition));
+    definition->num_of_inputs = num_of_inputs;
+    definition->num_of_outputs = num_of_outputs;
+    definition->parts = malloc((num_of_parts + 1) * sizeof(Part));
+    definition->part_inputs = malloc((num_of_part_inputs + 1) * sizeof(int));
+    definition->num_of_part_inputs = num_of_part_inputs;
+    definition->num_of_nets = num_of_pins;
+    for (int i = 0; i < num_of_outputs; i++)
+        definition->output_parts[i] = -1;
+
+    int next_input = 0;
+    for (int i = 0; i < num_of_gates + num_of_outputs; i++) {
+        Part *part = &definition->parts[definition->num_of_parts];
+        int *part_inputs = definition->part_inputs + next_input;
+        part->first_input = next_input;
+
+        if (i < num_of_gates) {
+            const Gate *gate = sim_order[i];
+            if (!used[gate->index]) continue;
+
+            part->type = gate->type;
+            part->num_of_inputs = gate->num_of_inputs;
+            for (int j = 0; j < gate->num_of_inputs; j++)
+                part_inputs[j] = get_definition_net(nets,
+                                                    &definition->num_of_nets,
+                                                    get_input(gate, j));
+            part->output = get_definition_net(nets, &definition->num_of_nets,
+                                              gate->output);
+        } else {
+            int output = i - num_of_gates;
+            if (through[output] < 0) continue;
+
+            part->type = OR;
+            part->num_of_inputs = 2;
+            part_inputs[0] = through[output];
+            part_inputs[1] = through[output];
+            part->output = num_of_inputs + output;
+        }
+
+        part->uses_pins = part->output < num_of_pins;
+        for (int j = 0; j < part->num_of_inputs; j++)
+            if (part_inputs[j] < num_of_inputs) part->uses_pins = true;
+        if (part->output >= num_of_inputs && part->output < num_of_pins)
+            definition->output_parts[part->output - num_of_inputs] =
+                definition->num_of_parts;
+        next_input += part->num_of_inputs;
+        definition->num_of_parts++;
+    }
+
+    definition->net_fanout = calloc(definition->num_of_nets, sizeof(int));
+    for (int i = 0; i < definition->num_of_part_inputs; i++)
+        definition->net_fanout[definition->part_inputs[i]]++;
+
+    free(nets);
+    free(live);
+    free(used);
+    return definition;
+}
+
+// Remove every component from the board
+void clear_circuit()
+{
+    while (gate_list_len > 0) {
+        Gate *gate = gate_list[gate_list_len - 1];
+        delete_gate(gate->instance != NULL ? gate->instance : gate);
+    }
+    while (wire_list_len > 0)
+        delete_wire(wire_list[wire_list_len - 1]);
+    build_representation_from_graphics();
+    last_wire_id = 0;
+    clear_verilog_names();
+}
+
+// Load a circuit file as a sub-circuit named after the file. Its INPUT gates
+// become the input pins and its outputs the output pins, both top to bottom.
+// Must be called before anything is placed on the board.
+bool load_definition(const char *path)
+{
+    const char *file_name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    const char *extension = strrchr(file_name, '.');
+    int name_len = extension ? extension - file_name : (int)strlen(file_name);
+    char name[DEFINITION_NAME_LEN] = {0};
+
+    if (name_len == 0 || name_len >= DEFINITION_NAME_LEN) {
+        fprintf(stderr, "%s: Sub-circuit names must be 1 to %d characters.\n",
+                path, DEFINITION_NAME_LEN - 1);
+        return false;
+    }
+    memcpy(name, file_name, name_len);
+    if (find_definition(name) != NULL) {
+        fprintf(stderr, "%s: There is already a sub-circuit called %s.\n",
+                path, name);
+        return false;
+    }
+    if (!load_circuit(path)) return false;
+    build_representation_from_graphics();
+
+    Gate **inputs;
+    Wire **outputs;
+    int num_of_inputs, num_of_outputs;
+    Definition *definition = NULL;
+
+    get_circuit_ports(&inputs, &num_of_inputs, &outputs, &num_of_outputs);
+    if (num_of_inputs <= MAX_PINS && num_of_outputs <= MAX_PINS &&
+        num_of_outputs > 0)
+        definition = compile_definition(inputs, num_of_inputs, outputs,
+                                        num_of_outputs);
+    else
+        fprintf(stderr, "%s: Sub-circuits need at most %d inputs and 1 to %d "
+                "outputs.\n", path, MAX_PINS, MAX_PINS);
+    free(inputs);
+    free(outputs);
+    clear_circuit();
+    if (definition == NULL) return false;
+
+    strcpy(definition->name, name);
+    int rows = num_of_inputs > num_of_outputs ? num_of_inputs : num_of_outputs;
+    definition->height = 2 * rows + 1;
+    definition->width = name_len + 5 > 8 ? name_len + 5 : 8;
+    definition->ascii = make_definition_ascii(definition);
+
+    definition->index = num_of_definitions;
+    definitions = realloc(definitions,
+                          (num_of_definitions + 1) * sizeof(Definition *));
+    definitions[num_of_definitions++] = definition;
+    return true;
+}
+
+// Simulation thread
+
+long get_time_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Copy the state of every net and gate. Only called by the simulation
+// thread, or by the UI while the simulation is paused.
+void write_snapshot(Snapshot *snapshot)
+{
+    if (num_of_nets > snapshot->net_capacity) {
+        snapshot->net_capacity = num_of_nets * 2;
+        snapshot->net_states = realloc(snapshot->net_states,
+                                       snapshot->net_capacity);
+        snapshot->net_hazards = realloc(snapshot->net_hazards,
+                                        snapshot->net_capacity);
+    }
+    if (gate_list_len > snapshot->gate_capacity) {
+        snapshot->gate_capacity = gate_list_len * 2;
+        snapshot->gate_values = realloc(snapshot->gate_values,
+                                        snapshot->gate_capacity);
+        snapshot->gate_oscillating = realloc(snapshot->gate_oscillating,
+                                             snapshot->gate_capacity);
+    }
+
+    for (int i = 0; i < num_of_nets; i++) {
+        snapshot->net_states[i] = net_list[i]->state;
+        snapshot->net_hazards[i] = net_list[i]->transitions > 1;
+    }
+    for (int i = 0; i < gate_list_len; i++) {
+        snapshot->gate_values[i] = gate_list[i]->value;
+        snapshot->gate_oscillating[i] = gate_list[i]->oscillating;
+    }
+    snapshot->num_of_nets = num_of_nets;
+    snapshot->num_of_gates = gate_list_len;
+    snapshot->simulating = simulate_circuit;
+    snapshot->engine = sim_engine;
+    snapshot->num_of_oscillating = num_of_oscillating;
+    snapshot->free_running = free_running;
+    snapshot->clock_rate = clock_rates[clock_rate_index];
+    snapshot->clock_cycles = clock_cycles;
+    snapshot->sim_time = sim_time;
+    snapshot->stats = stats;
+}
+
+void publish_snapshot()
+{
+    write_snapshot(&snapshots[sim_snapshot]);
+    sim_snapshot = atomic_exchange(&ready_snapshot,
+                                   sim_snapshot | SNAPSHOT_NEW) & ~SNAPSHOT_NEW;
+}
+
+// Update the UI's copy of the states of the components on screen and mark
+// the ones that look different. The rest are brought up to date when they
+// are scrolled into view.
+void show_snapshot()
+{
+    const Snapshot *snapshot = &snapshots[ui_snapshot];
+    int num_of_gates, num_of_wires;
+    find_visible_components(get_view_rect(), &num_of_gates, &num_of_wires);
+
+    for (int i = 0; i < num_of_wires; i++) {
+        Wire *wire = visible_wires[i];
+        int net = wire->net->net_index;
+        if (net >= snapshot->num_of_nets) continue;
+        if (wire->shown_state != snapshot->net_states[net] ||
+            wire->shown_hazard != snapshot->net_hazards[net]) {
+            wire->shown_state = snapshot->net_states[net];
+            wire->shown_hazard = snapshot->net_hazards[net];
+            mark_wire_redraw(wire);
+        }
+    }
+    for (int i = 0; i < num_of_gates; i++) {
+        Gate *gate = visible_gates[i];
+        if (gate->index >= snapshot->num_of_gates) continue;
+        if (gate->shown_value != snapshot->gate_values[gate->index] ||
+            gate->shown_oscillating !=
+            snapshot->gate_oscillating[gate->index]) {
+            gate->shown_value = snapshot->gate_values[gate->index];
+            gate->shown_oscillating = snapshot->gate_oscillating[gate->index];
+            mark_gate_redraw(gate);
+        }
+    }
+}
+
+// Take the newest snapshot if the simulation published one since last time
+bool receive_snapshot()
+{
+    if (!(atomic_load(&ready_snapshot) & SNAPSHOT_NEW)) return false;
+    ui_snapshot = atomic_exchange(&ready_snapshot, ui_snapshot) & ~SNAPSHOT_NEW;
+    return true;
+}
+
+void run_command(const Command *command)
+{
+    switch (command->type) {
+    case COMMAND_TOGGLE_INPUT: {
+        Gate *gate = resolve_gate(command->gate);
+        if (gate != NULL && gate->type == INPUT) { // Not deleted since
+            gate->value = !gate->value;
+            schedule_gate(gate);
+        }
+        break;
+    }
+    case COMMAND_TOGGLE_SIMULATION:
+        simulate_circuit = !simulate_circuit;
+        break;
+    case COMMAND_NEXT_ENGINE:
+        sim_engine = (sim_engine + 1) % NUM_OF_ENGINES;
+        clear_timing_wheel();
+        schedule_all_gates();
+        program_synced = false;
+        break;
+    case COMMAND_CLOCK_CYCLE:
+        run_clock_cycle();
+        break;
+    case COMMAND_TOGGLE_FREE_RUNNING:
+        free_running = !free_running;
+        if (free_running) simulate_circuit = true;
+        next_clock_time = get_time_seconds();
+        break;
+    case COMMAND_CLOCK_FASTER:
+        if (clock_rate_index < NUM_OF_CLOCK_RATES - 1) clock_rate_index++;
+        break;
+    case COMMAND_CLOCK_SLOWER:
+        if (clock_rate_index > 0) clock_rate_index--;
+        break;
+    }
+}
+
+// Run every command in the queue, returns false if it was empty
+bool run_commands()
+{
+    unsigned int head = atomic_load_explicit(&command_head,
+                                             memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&command_tail,
+                                             memory_order_acquire);
+    if (head == tail) return false;
+
+    for (; head != tail; head++)
+        run_command(&command_queue[head % COMMAND_QUEUE_LEN]);
+    atomic_store_explicit(&command_head, head, memory_order_release);
+    return true;
+}
+
+bool has_commands()
+{
+    return atomic_load(&command_head) != atomic_load(&command_tail);
+}
+
+void push_command(Command command)
+{
+    if (!sim_thread_started) { // Nothing to hand it to
+        run_command(&command);
+        return;
+    }
+
+    unsigned int tail = atomic_load_explicit(&command_tail,
+                                             memory_order_relaxed);
+    while (tail - atomic_load_explicit(&command_head, memory_order_acquire) ==
+           COMMAND_QUEUE_LEN)
+        sched_yield(); // Full, let the simulation catch up
+    command_queue[tail % COMMAND_QUEUE_LEN] = command;
+    atomic_store_explicit(&command_tail, tail + 1, memory_order_release);
+
+    pthread_mutex_lock(&sim_lock);
+    pthread_cond_signal(&sim_wake);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+// Simulate as fast as possible while anything is changing and sleep when the
+// circuit has settled, or until the next clock cycle is due. Snapshots are
+// only published as fast as the UI picks them up, apart from the last one
+// before going to sleep.
+void *simulation_thread(void *arg)
+{
+    (void)arg;
+    bool idle = false;
+    bool publish = false;
+    bool timed = false; // Sleep until next_clock_time
+
+    pthread_mutex_lock(&sim_lock);
+    while (!sim_quit) {
+        if (pause_requested) {
+            sim_paused = true;
+            pthread_cond_signal(&sim_paused_cond);
+            while (pause_requested && !sim_quit)
+                pthread_cond_wait(&sim_wake, &sim_lock);
+            sim_paused = false;
+            idle = false; // The edit may have scheduled gates
+            continue;
+        }
+        if (idle && !has_commands()) {
+            if (timed) {
+                // Condition variables wait on the real time clock
+                double delay = next_clock_time - get_time_seconds();
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                if (delay > 0) {
+                    long nanoseconds = deadline.tv_nsec + (long)(delay * 1e9);
+                    deadline.tv_sec += nanoseconds / 1000000000;
+                    deadline.tv_nsec = nanoseconds % 1000000000;
+                }
+                pthread_cond_timedwait(&sim_wake, &sim_lock, &deadline);
+                idle = false;
+            } else {
+                pthread_cond_wait(&sim_wake, &sim_lock);
+            }
+            continue;
+        }
+        pthread_mutex_unlock(&sim_lock);
+
+        if (run_commands()) publish = true;
+        sim_changed = false;
+        if (simulate_circuit) {
+            double start = get_time_seconds();
+            settle_circuit();
+            if (free_running) run_free_clock();
+            stats.steps++;
+            stats.step_seconds += get_time_seconds() - start;
+            publish = true;
+        }
+
+        timed = false;
+        if (!simulate_circuit)
+            idle = true;
+        else if (sim_engine == ENGINE_EVENT)
+            idle = event_queue_len == 0;
+        else if (sim_engine == ENGINE_TIMED)
+            idle = event_queue_len == 0 && num_of_timed_changes == 0;
+        else
+            idle = !sim_changed && num_of_oscillating == 0;
+        if (simulate_circuit && free_running) {
+            timed = clock_rates[clock_rate_index] > 0;
+            idle = idle && timed && get_time_seconds() < next_clock_time;
+        }
+
+        bool ui_waiting = !(atomic_load(&ready_snapshot) & SNAPSHOT_NEW);
+        if (publish && (idle || ui_waiting)) {
+            publish_snapshot();
+            publish = false;
+        }
+        pthread_mutex_lock(&sim_lock);
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return NULL;
+}
+
+bool start_simulation_thread()
+{
+    write_snapshot(&snapshots[ui_snapshot]);
+    show_snapshot();
+    sim_quit = false;
+    if (pthread_create(&sim_thread, NULL, simulation_thread, NULL) != 0)
+        return false;
+    sim_thread_started = true;
+    return true;
+}
+
+void stop_simulation_thread()
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_quit = true;
+    pthread_cond_signal(&sim_wake);
+    pthread_mutex_unlock(&sim_lock);
+    pthread_join(sim_thread, NULL);
+    sim_thread_started = false;
+}
+
+// Wait for the simulation to stop before the UI touches the netlist
+void begin_edit()
+{
+    if (!sim_thread_started) return;
+
+    pthread_mutex_lock(&sim_lock);
+    pause_requested = true;
+    pthread_cond_signal(&sim_wake);
+    while (!sim_paused)
+        pthread_cond_wait(&sim_paused_cond, &sim_lock);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+// Rebuild the connections and let the simulation carry on
+void end_edit()
+{
+    build_representation_from_graphics();
+
+    // Anything published before the edit may use old indices
+    if (atomic_load(&ready_snapshot) & SNAPSHOT_NEW)
+        ui_snapshot = atomic_exchange(&ready_snapshot, ui_snapshot) &
+                      ~SNAPSHOT_NEW;
+    write_snapshot(&snapshots[ui_snapshot]);
+    show_snapshot();
+
+    if (!sim_thread_started) return;
+    pthread_mutex_lock(&sim_lock);
+    pause_requested = false;
+    pthread_cond_signal(&sim_wake);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+// Graphics
+
+// Wires that glitched in the timed engine are yellow
+void draw_wire(const Wire *wire)
+{
+    uint32_t color = wire->shown_state ? TB_BLUE : TB_RED;
+    if (wire->shown_hazard) color = TB_YELLOW;
+
+    int x0 = wire->x0 - view_x, y0 = wire->y0 - view_y;
+    int x1 = wire->x1 - view_x, y1 = wire->y1 - view_y;
+    draw_cell(x0, y0, '-', color|TB_BOLD, TB_DEFAULT);
+    draw_cell(x1, y1, '-', color|TB_BOLD, TB_DEFAULT);
+    draw_line(x0, y0 + 1, x0, y1, '-', color|TB_BOLD, TB_DEFAULT);
+    draw_line(x0, y1, x1, y1, '-', color|TB_BOLD, TB_DEFAULT);
+}
+
+char *get_gate_ascii(const Gate *gate)
+{
+    switch (gate->type) {
+    case AND:
+        return "-#######\n"
+               " # AND #-\n"
+               "-#######";
+    case OR:
+        return "-#######\n"
+               " # OR  #-\n"
+               "-#######";
+    case NOT:
+        return " #######\n"
+               "-# NOT #-\n"
+               " #######";
+    case XOR:
+        return "-#######\n"
+               " # XOR #-\n"
+               "-#######";
+    case INPUT:
+        return "########\n"
+               "# Inp  #-\n"
+               "########";
+    case DFF:
+        return "-#######\n"
+               " # DFF #-\n"
+               "->######";
+    case CLOCK:
+        return "########\n"
+               "# Clk  #-\n"
+               "########";
+    case CUSTOM:
+        return gate->definition->ascii;
+    }
+    return "";
+}
+
+void draw_gate(const Gate *gate)
+{
+    int x = gate->x - view_x;
+    int y = gate->y - view_y;
+
+    if (gate->type == INPUT || gate->type == DFF || gate->type == CLOCK) {
+        if (gate->shown_value == 1)
+            draw_text(get_gate_ascii(gate), x, y, TB_BLUE|TB_BOLD,
+                      TB_DEFAULT);
+        else
+            draw_text(get_gate_ascii(gate), x, y, TB_RED|TB_BOLD,
+                      TB_DEFAULT);
+    } else if (gate->shown_oscillating) {
+        draw_text(get_gate_ascii(gate), x, y, TB_YELLOW|TB_BOLD, TB_DEFAULT);
+    } else {
+        draw_text(get_gate_ascii(gate), x, y, TB_GREEN, TB_DEFAULT);
+    }
+}
+
+// Clear a rectangle of the board and draw the components that overlap it.
+// Only the part on screen is drawn, and components are drawn in the order
+// of the component lists so overlaps always look the same.
+void redraw_rect(Rect rect)
+{
+    Rect view = get_view_rect();
+    if (rect.x0 < view.x0) rect.x0 = view.x0;
+    if (rect.y0 < view.y0) rect.y0 = view.y0;
+    if (rect.x1 > view.x1) rect.x1 = view.x1;
+    if (rect.y1 > view.y1) rect.y1 = view.y1;
+    if (rect.x0 > rect.x1 || rect.y0 > rect.y1) return;
+
+    int num_of_gates, num_of_wires;
+    find_visible_components(rect, &num_of_gates, &num_of_wires);
+
+    set_clip_rect(rect.x0 - view_x, rect.y0 - view_y, rect.x1 - view_x,
+                  rect.y1 - view_y);
+    draw_rect(rect.x0 - view_x, rect.y0 - view_y, rect.x1 - rect.x0 + 1,
+              rect.y1 - rect.y0 + 1, ' ', TB_DEFAULT, TB_DEFAULT);
+    for (int i = 0; i < num_of_gates; i++)
+        draw_gate(visible_gates[i]);
+    for (int i = 0; i < num_of_wires; i++)
+        draw_wire(visible_wires[i]);
+    reset_clip_rect();
+}
+
+// Draw every component on screen
+void draw_circuit()
+{
+    redraw_rect(get_view_rect());
+}
+
+int get_gate_under_cursor()
+{
+    for (int e = spatial_find(&area_grid, cursor_x, cursor_y); e >= 0;
+         e = spatial_find_next(&area_grid, e)) {
+        Gate *gate = area_grid.entries[e].item;
+        if (area_grid.entries[e].tag == AREA_GATE &&
+            cursor_x >= gate->x &&
+            cursor_y >= gate->y &&
+            cursor_x < gate->width + gate->x &&
+            cursor_y < gate->height + gate->y)
+            return gate->index;
+    }
+    return -1;
+}
+
+int get_wire_under_cursor()
+{
+    for (int e = spatial_find(&area_grid, cursor_x, cursor_y); e >= 0;
+         e = spatial_find_next(&area_grid, e)) {
+        Wire *wire = area_grid.entries[e].item;
+        if (area_grid.entries[e].tag == AREA_WIRE &&
+            wire_covers_cell(wire, cursor_x, cursor_y))
+            return wire->index;
+    }
+    return -1;
+}
+
+// Draw the parts of the screen that changed since the last frame. Nothing is
+// sent to the terminal if the frame would be the same.
+void draw()
+{
+    double start = get_time_seconds();
+    if (receive_snapshot() || redraw_all) show_snapshot();
+    const Snapshot *snapshot = &snapshots[ui_snapshot];
+    // Status only redraws are left out of the draw time, otherwise showing
+    // the time would redraw the status line on every frame
+    bool circuit_changed = redraw_all || num_of_redraw_rects > 0 ||
+                           cursor_x != drawn_cursor_x ||
+                           cursor_y != drawn_cursor_y;
+
+    char status[256] = "";
+    int len = 0;
+    if (snapshot->simulating)
+        len = snprintf(status, sizeof(status), "Simulation running (%s).%s",
+                       engine_names[snapshot->engine],
+                       snapshot->num_of_oscillating > 0 ?
+                       " Oscillating feedback loop detected." : "");
+    if (snapshot->engine == ENGINE_TIMED) {
+        len += snprintf(status + len, sizeof(status) - len,
+                        "%sTick %ld.", len > 0 ? " " : "", snapshot->sim_time);
+        int gate_index = get_gate_under_cursor();
+        if (gate_index >= 0 && gate_list[gate_index]->type != CUSTOM)
+            len += snprintf(status + len, sizeof(status) - len,
+                            " Delay %d.", get_gate_delay(gate_list[gate_index]));
+    }
+    if (num_of_clocks > 0 || num_of_flip_flops > 0) {
+        char rate[32] = "as fast as possible";
+        if (snapshot->clock_rate > 0)
+            snprintf(rate, sizeof(rate), "at %d Hz", snapshot->clock_rate);
+        len += snprintf(status + len, sizeof(status) - len,
+                        "%sClock %s %s, cycle %ld.", len > 0 ? " " : "",
+                        snapshot->free_running ? "running" : "stopped",
+                        rate, snapshot->clock_cycles);
+    }
+    if (show_stats) {
+        const Stats *now = &snapshot->stats;
+        long steps = now->steps - drawn_stats.steps;
+        double step_seconds = now->step_seconds - drawn_stats.step_seconds;
+        char removed[32] = "";
+        if (snapshot->engine == ENGINE_COMPILED)
+            snprintf(removed, sizeof(removed), " (%d removed)",
+                     now->gates_removed);
+
+        snprintf(status + len, sizeof(status) - len,
+                 "%sbuild %.1f ms, step %.2f ms, draw %.1f ms, "
+                 "%ld evals/frame, %ld events/frame, "
+                 "%d gates%s, %d wires, %d nets",
+                 len > 0 ? " " : "", stats.last_build_seconds * 1e3,
+                 steps > 0 ? step_seconds / steps * 1e3 : 0.0,
+                 last_draw_seconds * 1e3,
+                 now->gate_evaluations - drawn_stats.gate_evaluations,
+                 now->events - drawn_stats.events,
+                 gate_list_len, removed, wire_list_len, num_of_nets);
+        drawn_stats = *now;
+    }
+
+    if (cursor_x != drawn_cursor_x || cursor_y != drawn_cursor_y) {
+        mark_rect_redraw(drawn_cursor_x, drawn_cursor_y,
+                         drawn_cursor_x, drawn_cursor_y);
+        mark_rect_redraw(cursor_x, cursor_y, cursor_x, cursor_y);
+    }
+    if (strcmp(status, drawn_status) != 0) { // Bottom row of the view
+        Rect view = get_view_rect();
+        mark_rect_redraw(view.x0, view.y1, view.x1, view.y1);
+    }
+
+    if (!redraw_all && num_of_redraw_rects == 0) return;
+
+    if (redraw_all) {
+        tb_clear();
+        draw_circuit();
+    } else {
+        for (int i = 0; i < num_of_redraw_rects; i++)
+            redraw_rect(redraw_rects[i]);
+    }
+
+    draw_cell(cursor_x - view_x, cursor_y - view_y, '+', TB_WHITE, TB_DEFAULT);
+    draw_text(status, 0, tb_height() - 1,
+              snapshot->num_of_oscillating > 0 ? TB_YELLOW|TB_BOLD : TB_WHITE,
+              TB_DEFAULT);
+    tb_present();
+
+    drawn_cursor_x = cursor_x;
+    drawn_cursor_y = cursor_y;
+    strcpy(drawn_status, status);
+    num_of_redraw_rects = 0;
+    redraw_all = false;
+    if (circuit_changed) last_draw_seconds = get_time_seconds() - start;
+}
+
+// User Input
+
+// Scroll the view so the cursor is on screen, centering it when it has left
+// the screen so the view doesn't scroll on every step. The last row is left
+// for the status line.
+void scroll_to_cursor()
+{
+    int width = tb_width();
+    int height = tb_height() - 1;
+    int x = view_x, y = view_y;
+
+    if (cursor_x < view_x || cursor_x >= view_x + width)
+        view_x = cursor_x - width / 2;
+    if (cursor_y < view_y || cursor_y >= view_y + height)
+        view_y = cursor_y - height / 2;
+    if (view_x < 0) view_x = 0;
+    if (view_y < 0) view_y = 0;
+    if (view_x != x || view_y != y) redraw_all = true;
+}
+
+// Arrow keys and hjkl move the cursor one cell, HJKL half a screen
+void handle_cursor_input(const struct tb_event *event)
+{
+    int page_x = tb_width() / 2 > 1 ? tb_width() / 2 : 1;
+    int page_y = tb_height() / 2 > 1 ? tb_height() / 2 : 1;
+
+    if (event->key == TB_KEY_ARROW_DOWN || event->ch == 'j')
+        cursor_y++;
+    else if (event->key == TB_KEY_ARROW_UP || event->ch == 'k')
+        cursor_y--;
+    else if (event->key == TB_KEY_ARROW_LEFT || event->ch == 'h')
+        cursor_x--;
+    else if (event->key == TB_KEY_ARROW_RIGHT || event->ch == 'l')
+        cursor_x++;
+    else if (event->ch == 'J')
+        cursor_y += page_y;
+    else if (event->ch == 'K')
+        cursor_y -= page_y;
+    else if (event->ch == 'H')
+        cursor_x -= page_x;
+    else if (event->ch == 'L')
+        cursor_x += page_x;
+
+    if (cursor_x < 0) cursor_x = 0;
+    if (cursor_y < 0) cursor_y = 0;
+    scroll_to_cursor();
+}
+
+void move_component_at_cursor()
+{
+    struct tb_event event;
+    int gate_index = get_gate_under_cursor();
+
+    if (gate_index >= 0) { // If there is a gate under the cursor
+        Gate *gate_to_move = gate_list[gate_index];
         int gate_start_x = gate_to_move->x;
         int gate_start_y = gate_to_move->y;
+        unindex_gate(gate_to_move);
+
+        tb_peek_event(&event, 1);
+        while (event.key != TB_KEY_ENTER) {
+            // Handle input
+            tb_poll_event(&event);
+            mark_gate_redraw(gate_to_move); // Old position
+            if (event.key == TB_KEY_ESC) {
+                gate_to_move->x = gate_start_x;
+                gate_to_move->y = gate_start_y;
+                break;
+            }
+            handle_cursor_input(&event);
+
+            // Move gate to cursor
+            gate_to_move->x = cursor_x;
+            gate_to_move->y = cursor_y;
+            mark_gate_redraw(gate_to_move);
+
+            // Draw to screen. The gate is out of the index while it moves.
+            draw();
+            draw_gate(gate_to_move);
+            draw_text("Press enter to place gate.", 0, tb_height() - 1,
+                      TB_WHITE, TB_DEFAULT);
+            tb_present();
+        }
+        index_gate(gate_to_move);
+        mark_gate_dirty(gate_to_move);
+    } else {
+        int wire_index = get_wire_under_cursor();
+
+        if (wire_index >= 0) { // If there is a gate under the cursor
+            Wire *wire_to_move = wire_list[wire_index];
+            int wire_start_x0 = wire_to_move->x0;
+            int wire_start_y0 = wire_to_move->y0;
+            int wire_start_x1 = wire_to_move->x1;
+            int wire_start_y1 = wire_to_move->y1;
+
+            int dx = abs(wire_start_x0 - wire_start_x1);
+            int dy = abs(wire_start_y0 - wire_start_y1);
+            mark_wire_dirty(wire_to_move); // Gates at the old ends
+            unindex_wire(wire_to_move);
+
+            tb_peek_event(&event, 1);
+            while (event.key != TB_KEY_ENTER) {
+                // Handle input
+                tb_poll_event(&event);
+                mark_wire_redraw(wire_to_move); // Old position
+                if (event.key == TB_KEY_ESC) { // Reset wire
+                    wire_to_move->x0 = wire_start_x0;
+                    wire_to_move->y0 = wire_start_y0;
+                    wire_to_move->x1 = wire_start_x1;
+                    wire_to_move->y1 = wire_start_y1;
+                    break;
+                }
+                handle_cursor_input(&event);
+
+                // Move wire to cursor
+                wire_to_move->x0 = cursor_x;
+                wire_to_move->y0 = cursor_y;
+                wire_to_move->x1 = cursor_x + dx;
+                wire_to_move->y1 = cursor_y + dy;
+                mark_wire_redraw(wire_to_move);
+
+                // Draw to screen
+                draw();
+                draw_wire(wire_to_move);
+                draw_text("Press enter to place wire.", 0, tb_height() - 1,
+                          TB_WHITE, TB_DEFAULT);
+                tb_present();
+            }
+            index_wire(wire_to_move);
+            mark_wire_dirty(wire_to_move);
+        }
+    }
+}
+
+void place_wire()
+{
+    struct tb_event event;
+    Wire *wire = new_wire(cursor_x, cursor_y, 0, 0);
+    unindex_wire(wire); // Indexed again once it is placed
+
+    tb_peek_event(&event, 1);
+    while (event.key != TB_KEY_ENTER) {
+        // Handle input
+        tb_poll_event(&event);
+        mark_wire_redraw(wire); // Old position
+        if (event.key == TB_KEY_ESC) {
+            delete_wire(wire);
+            return;
+        }
+        handle_cursor_input(&event);
+        wire->x1 = cursor_x;
+        wire->y1 = cursor_y;
+        mark_wire_redraw(wire);
+
+        // Draw to screen
+        draw();
+        draw_wire(wire);
+        draw_text("Press enter to place wire.", 0, tb_height() - 1,
+                  TB_WHITE, TB_DEFAULT);
+        tb_present();
+    }
+    index_wire(wire);
+    mark_wire_dirty(wire);
+}
+
+// List the sub-circuits and place the one picked
+void place_custom_gate_at_cursor()
+{
+    struct tb_event event;
+    int count = num_of_definitions < 9 ? num_of_definitions : 9;
+
+    draw_text("Select the sub-circuit to place.\n0. None", 0,
+              tb_height() - count - 2, TB_WHITE, TB_DEFAULT);
+    for (int i = 0; i < count; i++) {
+        char line[DEFINITION_NAME_LEN + 8];
+        sprintf(line, "%d. %s", i + 1, definitions[i]->name);
+        draw_text(line, 0, tb_height() - count + i, TB_WHITE, TB_DEFAULT);
+    }
+    tb_present();
+    tb_poll_event(&event);
+
+    if (event.ch >= '1' && event.ch < '1' + count)
+        new_custom_gate(definitions[event.ch - '1'], cursor_x, cursor_y);
+}
+
+void place_gate_at_cursor()
+{
+    struct tb_event event;
+    char last = num_of_definitions > 0 ? '8' : '7';
+
+    // Display the options
+    if (num_of_definitions > 0)
+        draw_text("Select the gate to place.\n0. None\n1. AND\n2. OR\n"
+                  "3. XOR\n4. NOT\n5. Input\n6. D flip-flop\n7. Clock\n"
+                  "8. Sub-circuit",
+                  0, tb_height() - 10, TB_WHITE, TB_DEFAULT);
+    else
+        draw_text("Select the gate to place.\n0. None\n1. AND\n2. OR\n"
+                  "3. XOR\n4. NOT\n5. Input\n6. D flip-flop\n7. Clock",
+                  0, tb_height() - 9, TB_WHITE, TB_DEFAULT);
+    tb_present();
+    tb_poll_event(&event);
+
+    if (event.ch < '0' || event.ch > last) {
+        draw_text("Invalid selection!", 0, tb_height() - 1,
+                  TB_RED|TB_BOLD, TB_DEFAULT);
+        tb_present();
+        tb_poll_event(&event);
+    }
+
+    switch (event.ch) {
+    case '1':
+        new_gate(2, AND, cursor_x, cursor_y);
+        break;
+    case '2':
+        new_gate(2, OR, cursor_x, cursor_y);
+        break;
+    case '3':
+        new_gate(2, XOR, cursor_x, cursor_y);
+        break;
+    case '4':
+        new_gate(1, NOT, cursor_x, cursor_y);
+        break;
+    case '5':
+        new_gate(0, INPUT, cursor_x, cursor_y);
+        break;
+    case '6':
+        new_gate(2, DFF, cursor_x, cursor_y);
+        break;
+    case '7':
+        new_gate(0, CLOCK, cursor_x, cursor_y);
+        break;
+    case '8':
+        if (num_of_definitions > 0) {
+            redraw_all = true; // Clear the menu
+            draw();
+            place_custom_gate_at_cursor();
+        }
+        break;
+    }
+}
+
+// Wait up to timeout milliseconds for an event and handle it
+void handle_input(int timeout)
+{
+    struct tb_event event;
+    if (tb_peek_event(&event, timeout) <= 0) return;
+
+    if (event.type == TB_EVENT_RESIZE) redraw_all = true;
+    handle_cursor_input(&event);
+
+    // Prompts and messages are drawn over the circuit, so the whole screen is
+    // redrawn once they are dismissed
+    if (event.key == TB_KEY_CTRL_Q) { // Quit
+        draw_text("Are you sure you want to quit? [y/n]", 0, tb_height() - 1,
+                  TB_WHITE, TB_DEFAULT);
+        tb_present();
+        tb_poll_event(&event);
+        if (event.ch == 'y' || event.ch == 'Y')
+            running = false;
+        redraw_all = true;
+    } else if (event.ch == '?') { // Help
+        draw_line(0, tb_height() - 24, tb_width(), tb_height() - 24, '_',
+                  TB_WHITE, TB_DEFAULT);
+        draw_text(help, 0, tb_height() - 23, TB_WHITE, TB_DEFAULT);
+        tb_present();
+        tb_poll_event(&event);
+        redraw_all = true;
+    } else if (event.ch == 'd' || event.ch == 'D') { // Delete gate
+        int gate_to_delete = get_gate_under_cursor();
+
+        begin_edit();
+        if (gate_to_delete >= 0) {
+            delete_gate(gate_list[gate_to_delete]);
+        } else {
+            int wire_to_delete = get_wire_under_cursor();
+            if (wire_to_delete >= 0)
+                delete_wire(wire_list[wire_to_delete]);
+        }
+        end_edit();
+    } else if (event.ch == 'm' || event.ch == 'M') { // Move component
+        begin_edit();
+        move_component_at_cursor();
+        end_edit();
+        redraw_all = true;
+    } else if (event.ch == 'a' || event.ch == 'A') { // Place gate
+        begin_edit();
+        place_gate_at_cursor();
+        end_edit();
+        redraw_all = true;
+    } else if (event.ch == 'w' || event.ch == 'W') { // Place wire
+        begin_edit();
+        place_wire();
+        end_edit();
+        redraw_all = true;
+    } else if (event.key == TB_KEY_SPACE) { // Toggle simulation
+        push_command((Command){ COMMAND_TOGGLE_SIMULATION });
+    } else if (event.ch == 'i' || event.ch == 'I') { // Toggle input's value
+        int gate_index = get_gate_under_cursor();
+        if (gate_index >= 0 && gate_list[gate_index]->type == INPUT)
+            push_command((Command){ COMMAND_TOGGLE_INPUT,
+                                    get_gate_handle(gate_list[gate_index]) });
+    } else if (event.ch == 'e' || event.ch == 'E') { // Switch engine
+        push_command((Command){ COMMAND_NEXT_ENGINE });
+    } else if (event.ch == 'c' || event.ch == 'C') { // One clock cycle
+        push_command((Command){ COMMAND_CLOCK_CYCLE });
+    } else if (event.ch == 'f' || event.ch == 'F') { // Free-running clock
+        push_command((Command){ COMMAND_TOGGLE_FREE_RUNNING });
+    } else if (event.ch == '+' || event.ch == '=') {
+        push_command((Command){ COMMAND_CLOCK_FASTER });
+    } else if (event.ch == '-') {
+        push_command((Command){ COMMAND_CLOCK_SLOWER });
+    } else if (event.ch == '<' || event.ch == '>') { // Gate delay
+        int gate_index = get_gate_under_cursor();
+        if (gate_index >= 0 && gate_list[gate_index]->type != CUSTOM) {
+            begin_edit();
+            Gate *gate = gate_list[gate_index];
+            int delay = get_gate_delay(gate) + (event.ch == '>' ? 1 : -1);
+            if (delay >= 1 && delay <= MAX_GATE_DELAY) gate->delay = delay;
+            end_edit();
+        }
+    } else if (event.ch == 'p' || event.ch == 'P') { // Performance counters
+        show_stats = !show_stats;
+    } else if (event.ch == 'v' || event.ch == 'V') { // Verilog
+        begin_edit();
+        bool saved = save_verilog("circuit.v");
+        end_edit();
+        if (saved)
+            draw_text("Verilog written to circuit.v.", 0, tb_height() - 1,
+                      TB_WHITE, TB_DEFAULT);
+        else
+            draw_text("Could not write circuit.v.", 0, tb_height() - 1,
+                      TB_RED|TB_BOLD, TB_DEFAULT);
+        tb_present();
+        tb_poll_event(&event);
+        redraw_all = true;
+    } else if (event.ch == 'r' || event.ch == 'R') { // Waveform
+        begin_edit(); // The states are the end of the recording
+        bool written = write_vcd("circuit.vcd", 0, wave_time);
+        end_edit();
+        if (written)
+            draw_text("Waveform written to circuit.vcd.", 0, tb_height() - 1,
+                      TB_WHITE, TB_DEFAULT);
+        else
+            draw_text("Could not write circuit.vcd.", 0, tb_height() - 1,
+                      TB_RED|TB_BOLD, TB_DEFAULT);
+        tb_present();
+        tb_poll_event(&event);
+        redraw_all = true;
+    } else if (event.ch == 's' || event.ch == 'S') { // Save
+        begin_edit(); // Wire states must not change while they are written
+        bool saved = save_circuit(circuit_path);
+        end_edit();
+        if (saved)
+            draw_text("Circuit saved.", 0, tb_height() - 1, TB_WHITE,
+                      TB_DEFAULT);
+        else
+            draw_text("Could not save the circuit.", 0, tb_height() - 1,
+                      TB_RED|TB_BOLD, TB_DEFAULT);
+        tb_present();
+        tb_poll_event(&event);
+        redraw_all = true;
+    } else if (event.ch == 't' || event.ch == 'T') { // Truth table
+        FILE *file = fopen("truth_table.txt", "w");
+        const char *error = NULL;
+        if (file != NULL) {
+            begin_edit();
+            error = write_truth_table(file);
+            end_edit();
+        }
+
+        if (file == NULL) {
+            draw_text("Could not open truth_table.txt.", 0, tb_height() - 1,
+                      TB_RED|TB_BOLD, TB_DEFAULT);
+        } else if (error == NULL) {
+            draw_text("Truth table written to truth_table.txt.", 0,
+                      tb_height() - 1, TB_WHITE, TB_DEFAULT);
+        } else {
+            draw_text(error, 0, tb_height() - 1, TB_RED|TB_BOLD, TB_DEFAULT);
+        }
+        if (file != NULL) fclose(file);
+        tb_present();
+        tb_poll_event(&event);
+        redraw_all = true;
+    }
+}
+
+// Batch mode
+
+// Read the input values for one step. Returns the number of values read, or
+// -1 at the end of the file. Blank lines and comments are skipped.
+int read_stimulus(FILE *file, bool *values, int max_values, int *line_num)
+{
+    int c;
+
+    for (;;) {
+        int num_of_values = 0;
+        bool comment = false;
+        bool blank = true;
+
+        while ((c = getc(file)) != EOF && c != '\n') {
+            if (c == '#') comment = true;
+            if (comment || c == ' ' || c == '\t' || c == '\r') continue;
+
+            blank = false;
+            if ((c != '0' && c != '1') || num_of_values == max_values)
+                num_of_values = max_values + 1; // Reported by the caller
+            else
+                values[num_of_values++] = c == '1';
+        }
+        (*line_num)++;
+
+        if (!blank) return num_of_values;
+        if (c == EOF) return -1;
+    }
+}
+
+void write_outputs(FILE *output, Wire **outputs, int num_of_outputs)
+{
+    for (int i = 0; i < num_of_outputs; i++)
+        putc('0' + outputs[i]->state, output);
+    putc('\n', output);
+}
+
+// Write the truth table of the loaded circuit for --truth-table, to stdout
+// if output_path is NULL. Returns the exit status.
+int run_truth_table(const char *output_path)
+{
+    FILE *output = output_path ? fopen(output_path, "w") : stdout;
+
+    if (output == NULL) {
+        fprintf(stderr, "Could not open %s.\n", output_path);
+        return 1;
+    }
+
+    build_representation_from_graphics();
+    const char *error = write_truth_table(output);
+    if (error != NULL) fprintf(stderr, "%s\n", error);
+    if (output != stdout && fclose(output) != 0 && error == NULL) {
+        fprintf(stderr, "Could not write %s.\n", output_path);
+        return 1;
+    }
+    return error != NULL;
+}
+
+// Simulate a saved circuit with the input values in a stimulus file, one step
+// per line, and write the outputs after each step. Combinational circuits are
+// simulated LANE_BITS steps at a time with the bit parallel engine, circuits
+// with feedback loops or flip-flops, or while the waveform is recorded, one
+// step at a time with the event driven engine. Circuits with CLOCK gates run
+// a number of clock cycles per step.
+int run_batch(const char *stimulus_path, const char *output_path,
+              long cycles_per_step)
+{
+    Gate **inputs;
+    Wire **outputs;
+    int num_of_inputs, num_of_outputs;
+    FILE *stimulus = fopen(stimulus_path, "r");
+    FILE *output = output_path ? fopen(output_path, "w") : stdout;
+    bool combinational = true;
+    int line_num = 0;
+    int status = 0;
+
+    if (stimulus == NULL || output == NULL) {
+        fprintf(stderr, "Could not open %s.\n",
+                stimulus == NULL ? stimulus_path : output_path);
+        return 1;
+    }
+    setvbuf(output, NULL, _IOFBF, 1 << 16);
+
+    build_representation_from_graphics();
+    get_circuit_ports(&inputs, &num_of_inputs, &outputs, &num_of_outputs);
+    for (int i = 0; i < num_of_sccs; i++)
+        if (scc_cyclic[i]) combinational = false;
+    if (num_of_flip_flops > 0 || num_of_clocks > 0) combinational = false;
+    if (wave_rings[0].data != NULL) combinational = false; // For the waveform
+    sim_engine = ENGINE_EVENT;
+
+    char buffer[16];
+    fprintf(output, "# outputs:");
+    for (int i = 0; i < num_of_outputs; i++)
+        fprintf(output, " %s",
+                get_net_name(outputs[i], buffer, sizeof(buffer)));
+    fprintf(output, "\n");
+
+    bool *values = malloc((num_of_inputs + 1) * LANE_BITS * sizeof(bool));
+    reset_lane_states();
+
+    for (;;) {
+        int num_of_steps = 0;
+
+        // Read a block of steps, only one if they have to run in order
+        while (num_of_steps < (combinational ? (int)LANE_BITS : 1)) {
+            int read = read_stimulus(stimulus,
+                                     values + num_of_steps * num_of_inputs,
+                                     num_of_inputs, &line_num);
+            if (read < 0) break;
+            if (read != num_of_inputs) {
+                fprintf(stderr, "%s:%d: Expected %d input values.\n",
+                        stimulus_path, line_num, num_of_inputs);
+                status = 1;
+                break;
+            }
+            num_of_steps++;
+        }
+        if (num_of_steps == 0 || status != 0) break;
+
+        if (combinational) {
+            for (int i = 0; i < num_of_inputs; i++) {
+                if (inputs[i]->output == NULL) continue;
+
+                Lanes lanes = {0};
+                for (int step = 0; step < num_of_steps; step++)
+                    lanes[step / 64] |= (uint64_t)values[step * num_of_inputs
+                                                         + i] << (step % 64);
+                lane_states[inputs[i]->output->net_index] = lanes;
+            }
+            double start = get_time_seconds();
+            sim_circuit_lanes(lane_states);
+            stats.steps++;
+            stats.step_seconds += get_time_seconds() - start;
+
+            for (int step = 0; step < num_of_steps; step++) {
+                for (int i = 0; i < num_of_outputs; i++) {
+                    int net = outputs[i]->net_index;
+                    uint64_t word = lane_states[net][step / 64];
+                    putc('0' + (word >> (step % 64) & 1), output);
+                }
+                putc('\n', output);
+            }
+        } else {
+            for (int i = 0; i < num_of_inputs; i++) {
+                if (inputs[i]->value != values[i]) {
+                    inputs[i]->value = values[i];
+                    schedule_gate(inputs[i]);
+                }
+            }
+            double start = get_time_seconds();
+            settle_circuit();
+            for (long cycle = 0; cycle < cycles_per_step && num_of_clocks > 0;
+                 cycle++)
+                run_clock_cycle();
+            stats.steps++;
+            stats.step_seconds += get_time_seconds() - start;
+            write_outputs(output, outputs, num_of_outputs);
+        }
+    }
+
+    free(values);
+    free(inputs);
+    free(outputs);
+    fclose(stimulus);
+    if (output != stdout) fclose(output);
+    else fflush(output);
+    return status;
+}
+
+// Grade the test vectors in a stimulus file by the single stuck-at faults
+// they detect. Every net on the board can be stuck at 0 or at 1. The bit
+// parallel engine simulates the good circuit in lane 0 and a different
+// fault in each of the other lanes, and a fault is detected when an output
+// in its lane differs from lane 0. Detected faults are dropped, so later
+// vectors only simulate the ones left. Writes the coverage and the faults
+// that were never detected.
+int run_fault_simulation(const char *stimulus_path, const char *output_path)
+{
+    Gate **inputs;
+    Wire **outputs;
+    int num_of_inputs, num_of_outputs;
+    FILE *stimulus = fopen(stimulus_path, "r");
+    FILE *output = output_path ? fopen(output_path, "w") : stdout;
+    int line_num = 0;
+    int status = 0;
+
+    if (stimulus == NULL || output == NULL) {
+        fprintf(stderr, "Could not open %s.\n",
+                stimulus == NULL ? stimulus_path : output_path);
+        return 1;
+    }
+
+    build_representation_from_graphics();
+    bool combinational = num_of_flip_flops == 0 && num_of_clocks == 0;
+    for (int i = 0; i < num_of_sccs; i++)
+        if (scc_cyclic[i]) combinational = false;
+    if (!combinational) {
+        fprintf(stderr, "Only circuits without feedback loops or flip-flops "
+                "can be fault simulated.\n");
+        fclose(stimulus);
+        if (output != stdout) fclose(output);
+        return 1;
+    }
+    get_circuit_ports(&inputs, &num_of_inputs, &outputs, &num_of_outputs);
+
+    // Read every vector first, they are all simulated once per fault group
+    bool *vectors = NULL;
+    int num_of_vectors = 0;
+    int vectors_capacity = 0;
+    for (;;) {
+        if (num_of_vectors == vectors_capacity) {
+            vectors_capacity = vectors_capacity ? vectors_capacity * 2 : 64;
+            vectors = realloc(vectors, vectors_capacity *
+                                       (num_of_inputs + 1) * sizeof(bool));
+        }
+        int read = read_stimulus(stimulus,
+                                 vectors + num_of_vectors * num_of_inputs,
+                                 num_of_inputs, &line_num);
+        if (read < 0) break;
+        if (read != num_of_inputs) {
+            fprintf(stderr, "%s:%d: Expected %d input values.\n",
+                    stimulus_path, line_num, num_of_inputs);
+            status = 1;
+            break;
+        }
+        num_of_vectors++;
+    }
+
+    // Faults are the net index times two plus the value it is stuck at
+    int *faults = malloc((2 * num_of_nets + 1) * sizeof(int));
+    int num_of_faults = 0;
+    for (int i = 0; i < num_of_nets; i++) {
+        if (net_list[i]->instance != NULL) continue;
+        faults[num_of_faults++] = 2 * i;
+        faults[num_of_faults++] = 2 * i + 1;
+    }
+    int total_faults = num_of_faults;
+
+    faulty_nets = calloc(num_of_nets + 1, sizeof(bool));
+    stuck_at_0 = aligned_alloc(sizeof(Lanes), (num_of_nets + 1) *
+                                              sizeof(Lanes));
+    stuck_at_1 = aligned_alloc(sizeof(Lanes), (num_of_nets + 1) *
+                                              sizeof(Lanes));
+    memset(stuck_at_0, 0, (num_of_nets + 1) * sizeof(Lanes));
+    memset(stuck_at_1, 0, (num_of_nets + 1) * sizeof(Lanes));
+    reset_lane_states();
+
+    for (int v = 0; v < num_of_vectors && num_of_faults > 0 && status == 0;
+         v++) {
+        const bool *values = vectors + v * num_of_inputs;
+        int kept = 0;
+
+        for (int first = 0; first < num_of_faults; first += LANE_BITS - 1) {
+            int group = num_of_faults - first;
+            if (group > (int)LANE_BITS - 1) group = LANE_BITS - 1;
+
+            // Every lane gets the same inputs and one fault, except lane 0
+            for (int i = 0; i < num_of_inputs; i++) {
+                Lanes lanes = {0};
+                if (inputs[i]->output != NULL)
+                    lane_states[inputs[i]->output->net_index] =
+                        lanes - (uint64_t)values[i];
+            }
+            for (int k = 0; k < group; k++) {
+                int net = faults[first + k] / 2;
+                int lane = k + 1;
+                Lanes *mask = faults[first + k] & 1 ? &stuck_at_1[net] :
+                                                      &stuck_at_0[net];
+                (*mask)[lane / 64] |= 1ull << (lane % 64);
+                faulty_nets[net] = true;
+            }
+            for (int k = 0; k < group; k++) { // Gates don't drive sources
+                int net = faults[first + k] / 2;
+                lane_states[net] = (lane_states[net] & ~stuck_at_0[net]) |
+                                   stuck_at_1[net];
+            }
+
+            double start = get_time_seconds();
+            sim_circuit_lanes(lane_states);
+            stats.steps++;
+            stats.step_seconds += get_time_seconds() - start;
+
+            Lanes detected = {0};
+            for (int i = 0; i < num_of_outputs; i++) {
+                Lanes value = lane_states[outputs[i]->net_index];
+                Lanes good = {0};
+                detected |= value ^ (good - (value[0] & 1));
+            }
+
+            // Keep the faults that went unnoticed and take the rest out of
+            // the circuit, putting floating nets back the way they were
+            for (int k = 0; k < group; k++) {
+                int fault = faults[first + k];
+                int net = fault / 2;
+                int lane = k + 1;
+                Lanes zero = {0};
+                stuck_at_0[net] = zero;
+                stuck_at_1[net] = zero;
+                faulty_nets[net] = false;
+                lane_states[net] = zero - (uint64_t)net_list[net]->state;
+                if (!(detected[lane / 64] >> (lane % 64) & 1))
+                    faults[kept++] = fault;
+            }
+        }
+        num_of_faults = kept;
+    }
+
+    if (status == 0) {
+        int num_of_detected = total_faults - num_of_faults;
+        fprintf(output, "# %d of %d faults detected by %d vectors, %.1f%% "
+                "coverage\n", num_of_detected, total_faults, num_of_vectors,
+                total_faults > 0 ? 100.0 * num_of_detected / total_faults :
+                100.0);
+        for (int i = 0; i < num_of_faults; i++) {
+            char buffer[16];
+            fprintf(output, "%s stuck at %d\n",
+                    get_net_name(net_list[faults[i] / 2], buffer,
+                                 sizeof(buffer)), faults[i] & 1);
+        }
+    }
+
+    free(faulty_nets);
+    free(stuck_at_0);
+    free(stuck_at_1);
+    faulty_nets = NULL;
+    free(faults);
+    free(vectors);
+    free(inputs);
+    free(outputs);
+    fclose(stimulus);
+    if (output != stdout) fclose(output);
+    return status;
+}
+
+// The names of a circuit's inputs followed by its outputs
+typedef struct PortNames {
+    const char *path;
+    char **names;
+    int num_of_inputs;
+    int num_of_outputs;
+    bool declared; // Ports declared by a Verilog module
+} PortNames;
+
+void free_port_names(PortNames *ports)
+{
+    for (int i = 0; i < ports->num_of_inputs + ports->num_of_outputs; i++)
+        free(ports->names[i]);
+    free(ports->names);
+}
+
+// Put the ports in the order of the ports with the same names in match,
+// which has as many of each. Returns false if one of them has no match.
+bool match_port_names(Gate **inputs, Wire **outputs, PortNames *ports,
+                      const PortNames *match)
+{
+    int num_of_inputs = ports->num_of_inputs;
+    int num_of_ports = num_of_inputs + ports->num_of_outputs;
+    int *order = malloc((num_of_ports + 1) * sizeof(int));
+    bool *used = calloc(num_of_ports + 1, sizeof(bool));
+    bool matched = true;
+
+    for (int i = 0; i < num_of_ports && matched; i++) {
+        bool input = i < num_of_inputs;
+        int j = input ? 0 : num_of_inputs;
+        int end = input ? num_of_inputs : num_of_ports;
+        while (j < end && (used[j] ||
+                           strcmp(ports->names[j], match->names[i]) != 0))
+            j++;
+        if (j == end) {
+            fprintf(stderr, "%s has no %s called %s.\n", ports->path,
+                    input ? "input" : "output", match->names[i]);
+            matched = false;
+        } else {
+            used[j] = true;
+            order[i] = j;
+        }
+    }
+
+    if (matched) {
+        Gate **old_inputs = malloc((num_of_inputs + 1) * sizeof(Gate *));
+        Wire **old_outputs = malloc((ports->num_of_outputs + 1) *
+                                    sizeof(Wire *));
+        char **old_names = malloc((num_of_ports + 1) * sizeof(char *));
+        memcpy(old_inputs, inputs, num_of_inputs * sizeof(Gate *));
+        memcpy(old_outputs, outputs, ports->num_of_outputs * sizeof(Wire *));
+        memcpy(old_names, ports->names, num_of_ports * sizeof(char *));
+        for (int i = 0; i < num_of_ports; i++) {
+            ports->names[i] = old_names[order[i]];
+            if (i < num_of_inputs)
+                inputs[i] = old_inputs[order[i]];
+            else
+                outputs[i - num_of_inputs] =
+                    old_outputs[order[i] - num_of_inputs];
+        }
+        free(old_inputs);
+        free(old_outputs);
+        free(old_names);
+    }
+    free(order);
+    free(used);
+    return matched;
+}
+
+// Load a circuit and find the functions of its outputs, adding to the BDDs
+// already built. If match is given, the ports have to line up with its
+// ports, by name if both circuits declare them and in order otherwise.
+// Prints an error and returns NULL if it can't. The caller frees the lists.
+int *build_output_bdds(PortNames *ports, const PortNames *match)
+{
+    Gate **inputs;
+    Wire **outputs;
+
+    if (!load_circuit(ports->path)) return NULL;
+    build_representation_from_graphics();
+    bool combinational = num_of_flip_flops == 0 && num_of_clocks == 0;
+    for (int i = 0; i < num_of_sccs; i++)
+        if (scc_cyclic[i]) combinational = false;
+    if (!combinational) {
+        fprintf(stderr, "%s has feedback loops or flip-flops, only "
+                "combinational circuits can be compared.\n", ports->path);
+        return NULL;
+    }
 
-        tb_peek_event(&event, 1);
-        while (event.key != TB_KEY_ENTER) {
-            // Handle input
-            tb_poll_event(&event);
-            if (event.key == TB_KEY_ESC) {
-                gate_to_move->x = gate_start_x;
-                gate_to_move->y = gate_start_y;
+    get_circuit_ports(&inputs, &ports->num_of_inputs, &outputs,
+                      &ports->num_of_outputs);
+    int num_of_inputs = ports->num_of_inputs;
+    int num_of_ports = num_of_inputs + ports->num_of_outputs;
+    ports->declared = num_of_verilog_names > 0;
+    ports->names = malloc((num_of_ports + 1) * sizeof(char *));
+    for (int i = 0; i < num_of_ports; i++) {
+        char buffer[16];
+        const Wire *net = i < num_of_inputs ?
+                          (inputs[i]->output ? inputs[i]->output->net : NULL) :
+                          outputs[i - num_of_inputs];
+        ports->names[i] = strdup(net != NULL ? get_net_name(net, buffer,
+                                                            sizeof(buffer)) :
+                                               "-");
+    }
+
+    bool matched = true;
+    if (match != NULL && (num_of_inputs != match->num_of_inputs ||
+                          ports->num_of_outputs != match->num_of_outputs)) {
+        fprintf(stderr, "%s has %d inputs and %d outputs but %s has %d "
+                "inputs and %d outputs.\n", match->path, match->num_of_inputs,
+                match->num_of_outputs, ports->path, num_of_inputs,
+                ports->num_of_outputs);
+        matched = false;
+    } else if (match != NULL && match->declared && ports->declared) {
+        matched = match_port_names(inputs, outputs, ports, match);
+    }
+
+    int *output_bdds = NULL;
+    int *net_bdds = matched ? build_net_bdds(inputs, num_of_inputs) : NULL;
+    if (matched && net_bdds == NULL && bdd_overflow) {
+        fprintf(stderr, "%s needs more than %d BDD nodes, use --bdd-nodes.\n",
+                ports->path, bdd_node_limit);
+    } else if (net_bdds != NULL) {
+        output_bdds = malloc((ports->num_of_outputs + 1) * sizeof(int));
+        for (int i = 0; i < ports->num_of_outputs; i++)
+            output_bdds[i] = net_bdds[outputs[i]->net_index];
+    }
+
+    free(net_bdds);
+    free(inputs);
+    free(outputs);
+    return output_bdds;
+}
+
+// Prove that two saved combinational circuits give the same outputs for
+// every input. Ports declared by Verilog modules are matched up by name,
+// other ports top to bottom. If the circuits differ, the inputs that tell
+// them apart are written as a stimulus line for the first circuit. Returns 0
+// if they are equivalent, 1 if they are not and 2 if they could not be
+// compared.
+int check_equivalence(const char *path_a, const char *path_b)
+{
+    PortNames ports[2] = { { path_a }, { path_b } };
+    int *output_bdds[2] = { NULL, NULL };
+    int status = 2;
+
+    reset_bdds();
+    output_bdds[0] = build_output_bdds(&ports[0], NULL);
+    if (output_bdds[0] != NULL) {
+        clear_circuit();
+        output_bdds[1] = build_output_bdds(&ports[1], &ports[0]);
+    }
+
+    if (output_bdds[1] != NULL) { // Otherwise the error was printed
+        int num_of_inputs = ports[0].num_of_inputs;
+        status = 0;
+        for (int i = 0; i < ports[0].num_of_outputs && status == 0; i++) {
+            if (output_bdds[0][i] == output_bdds[1][i]) continue;
+
+            // Same BDD nodes means the same function, so they differ
+            int difference = apply_bdd(OP_XOR, output_bdds[0][i],
+                                       output_bdds[1][i]);
+            if (bdd_overflow) {
+                fprintf(stderr, "Comparing the outputs needs more than %d "
+                        "BDD nodes, use --bdd-nodes.\n", bdd_node_limit);
+                status = 2;
                 break;
             }
-            handle_cursor_input(&event);
+            bool *values = calloc(num_of_inputs + 1, sizeof(bool));
+            find_bdd_solution(difference, values);
+            printf("# %s of %s and %s of %s differ for these inputs:\n# "
+                   "inputs:", ports[0].names[num_of_inputs + i], path_a,
+                   ports[1].names[num_of_inputs + i], path_b);
+            for (int j = 0; j < num_of_inputs; j++)
+                printf(" %s", ports[0].names[j]);
+            putchar('\n');
+            for (int j = 0; j < num_of_inputs; j++)
+                putchar('0' + values[j]);
+            putchar('\n');
+            free(values);
+            status = 1;
+        }
+        if (status == 0)
+            printf("# Equivalent, %d inputs and %d outputs.\n",
+                   num_of_inputs, ports[0].num_of_outputs);
+    }
 
-            // Move gate to cursor
-            gate_to_move->x = cursor_x;
-            gate_to_move->y = cursor_y;
+    for (int i = 0; i < 2; i++) {
+        free_port_names(&ports[i]);
+        free(output_bdds[i]);
+    }
+    return status;
+}
 
-            // Draw to screen
-            draw();
-            draw_text("Press enter to place gate.", 0, tb_height() - 1,
-                      TB_WHITE, TB_DEFAULT);
-            tb_present();
+// Write an instruction as C. Inside loops, c records whether the net changed.
+void write_instruction_c(FILE *file, const Instruction *instruction,
+                         const int *input_ports, bool in_loop)
+{
+    static const char operators[] = { [OP_AND] = '&', [OP_OR] = '|',
+                                      [OP_XOR] = '^', [OP_AND_N] = '&',
+                                      [OP_OR_N] = '|', [OP_XOR_N] = '^' };
+    if (in_loop)
+        fprintf(file, "        v = ");
+    else
+        fprintf(file, "    s[%d] = ", instruction->dest);
+    switch (instruction->op) {
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+        fprintf(file, "s[%d] %c s[%d]", instruction->a,
+                operators[instruction->op], instruction->b);
+        break;
+    case OP_NOT:
+        fprintf(file, "s[%d] ^ 1", instruction->a);
+        break;
+    case OP_AND_N:
+    case OP_OR_N:
+    case OP_XOR_N:
+        fprintf(file, "%s", instruction->op == OP_AND_N ? "1" : "0");
+        for (int i = 0; i < instruction->b; i++)
+            fprintf(file, " %c s[%d]", operators[instruction->op],
+                    program_sources[instruction->a + i]);
+        break;
+    case OP_INPUT:
+        fprintf(file, "in[%d]", input_ports[instruction->a]);
+        break;
+    case OP_CONST:
+        fprintf(file, "%d", instruction->a);
+        break;
+    case OP_COPY:
+        fprintf(file, "s[%d]", instruction->a);
+        break;
+    }
+    fprintf(file, ";\n");
+    if (in_loop)
+        fprintf(file, "        c |= v ^ s[%d];\n        s[%d] = v;\n",
+                instruction->dest, instruction->dest);
+}
+
+// Write a function that does the same as latch_flip_flops(), with the clock
+// each flip-flop saw last time kept in last
+void write_latch_c(FILE *file)
+{
+    fprintf(file, "\n// Latch the flip-flops whose clock rose since the last "
+                  "call. last holds one\n// byte per flip-flop, starting at "
+                  "0. Returns 1 if an output changed, so\n// simulate() has "
+                  "to be run again.\n");
+    fprintf(file, "int latch(unsigned char *s, unsigned char *last)\n{\n"
+                  "    unsigned char d[%d], c[%d];\n    int changed = 0;\n\n",
+            num_of_flip_flops, num_of_flip_flops);
+    for (int i = 0; i < num_of_flip_flops; i++) {
+        const Gate *flip_flop = flip_flops[i];
+        if (flip_flop->num_of_inputs < 2 || flip_flop->output == NULL) {
+            fprintf(file, "    c[%d] = 0;\n", i);
+            continue;
         }
-    } else {
-        int wire_index = get_wire_under_cursor();
+        fprintf(file, "    d[%d] = s[%d];\n    c[%d] = s[%d];\n", i,
+                get_input(flip_flop, 0)->net_index, i,
+                get_input(flip_flop, 1)->net_index);
+    }
+    for (int i = 0; i < num_of_flip_flops; i++) {
+        const Gate *flip_flop = flip_flops[i];
+        if (flip_flop->num_of_inputs < 2 || flip_flop->output == NULL)
+            continue;
+        int q = flip_flop->output->net_index;
+        fprintf(file, "    if (c[%d] && !last[%d] && s[%d] != d[%d]) {\n"
+                      "        s[%d] = d[%d];\n        changed = 1;\n    }\n",
+                i, i, q, i, q, i);
+    }
+    fprintf(file, "    for (int i = 0; i < %d; i++)\n        last[i] = c[i];\n"
+                  "    return changed;\n}\n", num_of_flip_flops);
+}
 
-        if (wire_index >= 0) { // If there is a gate under the cursor
-            Wire *wire_to_move = wire_list[wire_index];
-            int wire_start_x0 = wire_to_move->x0;
-            int wire_start_y0 = wire_to_move->y0;
-            int wire_start_x1 = wire_to_move->x1;
-            int wire_start_y1 = wire_to_move->y1;
+// Write the program as a C function that simulates the circuit once, for
+// building into other programs
+void write_program_c(FILE *file)
+{
+    Gate **inputs;
+    Wire **outputs;
+    int num_of_inputs, num_of_outputs;
+    int *input_ports = malloc((num_of_program_inputs + 1) * sizeof(int));
 
-            int dx = abs(wire_start_x0 - wire_start_x1);
-            int dy = abs(wire_start_y0 - wire_start_y1);
+    get_circuit_ports(&inputs, &num_of_inputs, &outputs, &num_of_outputs);
+    for (int i = 0; i < num_of_program_inputs; i++) {
+        input_ports[i] = -1; // Flip-flops and clocks keep their value in s
+        for (int j = 0; j < num_of_inputs; j++)
+            if (program_inputs[i] == inputs[j]) input_ports[i] = j;
+    }
 
-            tb_peek_event(&event, 1);
-            while (event.key != TB_KEY_ENTER) {
-                // Handle input
-                tb_poll_event(&event);
-                if (event.key == TB_KEY_ESC) { // Reset wire
-                    wire_to_move->x0 = wire_start_x0;
-                    wire_to_move->y0 = wire_start_y0;
-                    wire_to_move->x1 = wire_start_x1;
-                    wire_to_move->y1 = wire_start_y1;
-                    break;
-                }
-                handle_cursor_input(&event);
+    fprintf(file, "// Generated by logic-simulator. Nets are bytes in s, with "
+                  "one byte in in for\n// each input, top to bottom. Returns "
+                  "the number of feedback loops that did\n// not settle. "
+                  "Only the outputs and the nets flip-flops read are kept\n"
+                  "// up to date. Gates optimized away: %d.\n",
+            stats.gates_removed);
+    fprintf(file, "#define NUM_OF_NETS %d\n", num_of_nets);
+    fprintf(file, "#define NUM_OF_INPUTS %d\n", num_of_inputs);
+    fprintf(file, "#define MAX_FIXPOINT_PASSES %d\n\n", MAX_FIXPOINT_PASSES);
+    fprintf(file, "// Outputs, top to bottom:");
+    for (int i = 0; i < num_of_outputs; i++)
+        fprintf(file, " s[%d]", outputs[i]->net_index);
+    if (num_of_clocks > 0) fprintf(file, "\n// Clocks, set by the caller:");
+    for (int i = 0; i < num_of_clocks; i++)
+        if (clocks[i]->output != NULL)
+            fprintf(file, " s[%d]", clocks[i]->output->net_index);
+    fprintf(file, "\nint simulate(unsigned char *s, const unsigned char *in)\n"
+                  "{\n    int oscillating = 0;\n    unsigned char v, c;\n"
+                  "    (void)in;\n    (void)v;\n    (void)c;\n\n");
 
-                // Move wire to cursor
-                wire_to_move->x0 = cursor_x;
-                wire_to_move->y0 = cursor_y;
-                wire_to_move->x1 = cursor_x + dx;
-                wire_to_move->y1 = cursor_y + dy;
+    for (int pc = 0; pc < program_len; pc++) {
+        if (program[pc].op == OP_INPUT && input_ports[program[pc].a] < 0)
+            continue;
+        if (program[pc].op != OP_LOOP) {
+            write_instruction_c(file, &program[pc], input_ports, false);
+            continue;
+        }
 
-                // Draw to screen
-                draw();
-                draw_text("Press enter to place wire.", 0, tb_height() - 1,
-                          TB_WHITE, TB_DEFAULT);
-                tb_present();
+        int body_end = pc + 1 + program[pc].a;
+        fprintf(file, "    for (int pass = 0;; pass++) {\n        c = 0;\n");
+        for (pc++; pc < body_end; pc++)
+            write_instruction_c(file, &program[pc], input_ports, true);
+        fprintf(file, "        if (!c) break;\n"
+                      "        if (pass == MAX_FIXPOINT_PASSES - 1) {\n"
+                      "            oscillating++;\n"
+                      "            break;\n"
+                      "        }\n    }\n");
+        pc--;
+    }
+    fprintf(file, "    return oscillating;\n}\n");
+    if (num_of_flip_flops > 0) write_latch_c(file);
+
+    free(input_ports);
+    free(inputs);
+    free(outputs);
+}
+
+// Compile a saved circuit into C source with write_program_c()
+int write_program_file(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        return 1;
+    }
+
+    // Only the outputs have to be computed
+    build_representation_from_graphics();
+    Gate **inputs;
+    Wire **outputs;
+    int num_of_inputs, num_of_outputs;
+    get_circuit_ports(&inputs, &num_of_inputs, &outputs, &num_of_outputs);
+    bool *observable = calloc(num_of_nets + 1, sizeof(bool));
+    for (int i = 0; i < num_of_outputs; i++)
+        observable[outputs[i]->net_index] = true;
+    compile_program(observable);
+    write_program_c(file);
+    free(observable);
+    free(inputs);
+    free(outputs);
+    fclose(file);
+    return 0;
+}
+
+// Benchmarks. Circuits are generated as a list of gates and then drawn on
+// the board, so building the netlist from the graphics is measured as well.
+
+#define BENCH_GATE_SPACING_X 12
+#define BENCH_GATE_SPACING_Y 4
+#define BENCH_MAX_TOGGLES 1000
+
+typedef struct BenchCircuit {
+    const char *name;
+    int *types;
+    int (*inputs)[2]; // Indices of the driving gates, -1 if unused
+    int len;
+    int capacity;
+} BenchCircuit;
+
+int add_bench_gate(BenchCircuit *circuit, int type, int a, int b)
+{
+    if (circuit->len == circuit->capacity) {
+        circuit->capacity = circuit->capacity ? circuit->capacity * 2 : 256;
+        circuit->types = realloc(circuit->types,
+                                 circuit->capacity * sizeof(int));
+        circuit->inputs = realloc(circuit->inputs,
+                                  circuit->capacity * sizeof(int[2]));
+    }
+    circuit->types[circuit->len] = type;
+    circuit->inputs[circuit->len][0] = a;
+    circuit->inputs[circuit->len][1] = b;
+    return circuit->len++;
+}
+
+int add_bench_input(BenchCircuit *circuit)
+{
+    return add_bench_gate(circuit, INPUT, -1, -1);
+}
+
+// Returns the sum and sets *carry to the carry out
+int add_full_adder(BenchCircuit *circuit, int a, int b, int carry_in,
+                   int *carry)
+{
+    int half = add_bench_gate(circuit, XOR, a, b);
+    int sum = add_bench_gate(circuit, XOR, half, carry_in);
+    *carry = add_bench_gate(circuit, OR, add_bench_gate(circuit, AND, a, b),
+                            add_bench_gate(circuit, AND, half, carry_in));
+    return sum;
+}
+
+void generate_ripple_adder(BenchCircuit *circuit, int bits)
+{
+    int carry = add_bench_input(circuit);
+    for (int i = 0; i < bits; i++) {
+        int a = add_bench_input(circuit);
+        int b = add_bench_input(circuit);
+        add_full_adder(circuit, a, b, carry, &carry);
+    }
+}
+
+// Blocks of four bits, each computing all its carries from the carry in
+void generate_lookahead_adder(BenchCircuit *circuit, int bits)
+{
+    int carry = add_bench_input(circuit);
+    for (int block = 0; block < bits; block += 4) {
+        int generate[4], propagate[4];
+        int block_carry = carry;
+
+        for (int i = 0; i < 4; i++) {
+            int a = add_bench_input(circuit);
+            int b = add_bench_input(circuit);
+            generate[i] = add_bench_gate(circuit, AND, a, b);
+            propagate[i] = add_bench_gate(circuit, XOR, a, b);
+        }
+        for (int i = 0; i < 4; i++) {
+            // carry i = g(i-1) | p(i-1) g(i-2) | ... | p(i-1) ... p(0) c
+            int carry_i = block_carry;
+            for (int j = 0; j < i; j++)
+                carry_i = add_bench_gate(circuit, AND, carry_i, propagate[j]);
+            for (int j = 0; j < i; j++) {
+                int term = generate[j];
+                for (int k = j + 1; k < i; k++)
+                    term = add_bench_gate(circuit, AND, term, propagate[k]);
+                carry_i = add_bench_gate(circuit, OR, carry_i, term);
             }
+            add_bench_gate(circuit, XOR, propagate[i], carry_i); // Sum
+            if (i == 3)
+                carry = add_bench_gate(circuit, OR, generate[3],
+                        add_bench_gate(circuit, AND, propagate[3], carry_i));
         }
     }
 }
 
-void place_wire()
+// Adds up the partial products one row at a time with ripple carry adders
+void generate_array_multiplier(BenchCircuit *circuit, int bits)
 {
-    struct tb_event event;
-    Wire *wire = new_wire(cursor_x, cursor_y, 0, 0);
+    int *a = malloc(bits * sizeof(int));
+    int *b = malloc(bits * sizeof(int));
+    int *sum = malloc(2 * bits * sizeof(int));
 
-    tb_peek_event(&event, 1);
-    while (event.key != TB_KEY_ENTER) {
-        // Handle input
-        tb_poll_event(&event);
-        if (event.key == TB_KEY_ESC) {
-            wire_list_len--;
-            free(wire);
-            break;
+    for (int i = 0; i < bits; i++) a[i] = add_bench_input(circuit);
+    for (int i = 0; i < bits; i++) b[i] = add_bench_input(circuit);
+    for (int i = 0; i < bits; i++) {
+        sum[i] = add_bench_gate(circuit, AND, a[i], b[0]);
+        sum[bits + i] = -1;
+    }
+
+    for (int j = 1; j < bits; j++) {
+        int carry = -1;
+        for (int i = 0; i < bits; i++) {
+            int product = add_bench_gate(circuit, AND, a[i], b[j]);
+            int addend = sum[i + j];
+            if (addend < 0) { // Top bit of the first row
+                sum[i + j] = carry < 0 ? product :
+                             add_bench_gate(circuit, XOR, product, carry);
+                carry = carry < 0 ? -1 :
+                        add_bench_gate(circuit, AND, product, carry);
+            } else if (carry < 0) { // Half adder
+                sum[i + j] = add_bench_gate(circuit, XOR, product, addend);
+                carry = add_bench_gate(circuit, AND, product, addend);
+            } else {
+                sum[i + j] = add_full_adder(circuit, product, addend, carry,
+                                            &carry);
+            }
         }
-        handle_cursor_input(&event);
-        wire->x1 = cursor_x;
-        wire->y1 = cursor_y;
+        sum[j + bits] = carry;
+    }
 
-        // Draw to screen
-        draw();
-        draw_text("Press enter to place wire.", 0, tb_height() - 1,
-                  TB_WHITE, TB_DEFAULT);
-        tb_present();
+    free(a);
+    free(b);
+    free(sum);
+}
+
+// Every gate reads gates close before it, so the wires stay short
+void generate_random_dag(BenchCircuit *circuit, int num_of_gates)
+{
+    static const int types[] = { AND, OR, XOR, NOT };
+    const int window = 64;
+    srand(1);
+
+    for (int i = 0; i < 64; i++) add_bench_input(circuit);
+    while (circuit->len < num_of_gates) {
+        int type = types[rand() % 4];
+        int reach = circuit->len < window ? circuit->len : window;
+        int a = circuit->len - 1 - rand() % reach;
+        int b = circuit->len - 1 - rand() % reach;
+        add_bench_gate(circuit, type, a, type == NOT ? -1 : b);
     }
 }
 
-void place_gate_at_cursor()
+// An even number of NOT gates fed back into an OR gate, which latches once
+// the input is set
+void generate_not_chain(BenchCircuit *circuit, int length)
 {
-    struct tb_event event;
+    int input = add_bench_input(circuit);
+    int first = add_bench_gate(circuit, OR, input, -1);
+    int last = first;
+    for (int i = 0; i < (length & ~1); i++)
+        last = add_bench_gate(circuit, NOT, last, -1);
+    circuit->inputs[first][1] = last;
+}
 
-    // Display the options
-    draw_text("Select the gate to place.\n0. None\n1. AND\n2. OR\n3. XOR\n"
-              "4. NOT\n5. Input",
-              0, tb_height() - 7, TB_WHITE, TB_DEFAULT);
-    tb_present();
-    tb_poll_event(&event);
+// Gate i is drawn at (12 i, 4 i + 1), so every gate has a column and row of
+// its own for its output and no wire ends on a wire of another net. A net
+// runs from its output pin down through a branch point left of each gate it
+// feeds, with a short wire from there to the pin. Wires back to an earlier
+// gate go around it through the free row above it, so each gate can have one
+// of them.
+void draw_bench_circuit(const BenchCircuit *circuit)
+{
+    Gate **gates = malloc((circuit->len + 1) * sizeof(Gate *));
+    int (*branch)[2] = malloc((circuit->len + 1) * sizeof(int[2]));
 
-    if (event.ch < '0' || event.ch > '5') {
-        draw_text("Invalid selection!", 0, tb_height() - 1,
-                  TB_RED|TB_BOLD, TB_DEFAULT);
-        tb_present();
-        tb_poll_event(&event);
+    for (int i = 0; i < circuit->len; i++) {
+        int type = circuit->types[i];
+        gates[i] = new_gate(type == NOT ? 1 : 2, type,
+                            i * BENCH_GATE_SPACING_X,
+                            i * BENCH_GATE_SPACING_Y + 1);
+        branch[i][0] = gates[i]->x + gates[i]->width;
+        branch[i][1] = gates[i]->y + 1;
     }
+    for (int i = 0; i < circuit->len; i++) {
+        Gate *gate = gates[i];
+        int pin_y[MAX_PINS];
+        get_gate_input_pins(gate, pin_y);
 
-    switch (event.ch) {
-    case '1':
-        new_gate(2, AND, cursor_x, cursor_y);
-        break;
-    case '2':
-        new_gate(2, OR, cursor_x, cursor_y);
-        break;
-    case '3':
-        new_gate(2, XOR, cursor_x, cursor_y);
-        break;
-    case '4':
-        new_gate(1, NOT, cursor_x, cursor_y);
-        break;
-    case '5':
-        new_gate(0, INPUT, cursor_x, cursor_y);
-        break;
+        for (int j = 0; j < 2; j++) {
+            int source = circuit->inputs[i][j];
+            if (source < 0) continue;
+
+            if (source >= i) { // Around the gate from above
+                const Gate *driver = gates[source];
+                int x = driver->x + driver->width;
+                new_wire(x, driver->y + 1, gate->x - 2, gate->y - 1);
+                new_wire(gate->x - 2, gate->y - 1, gate->x, pin_y[j]);
+                continue;
+            }
+
+            int x = gate->x - 1 - 2 * j; // Branch point
+            new_wire(branch[source][0], branch[source][1], x, pin_y[j]);
+            new_wire(x, pin_y[j], gate->x, pin_y[j]);
+            branch[source][0] = x;
+            branch[source][1] = pin_y[j];
+        }
     }
+    for (int i = 0; i < circuit->len; i++) { // Outputs
+        int x = gates[i]->x + gates[i]->width;
+        if (branch[i][0] == x)
+            new_wire(x, gates[i]->y + 1, x + 2, gates[i]->y + 1);
+    }
+
+    free(gates);
+    free(branch);
 }
 
-void handle_input()
+// Memory used by the components on the board. Memory that the lists and
+// pools keep after components are deleted is not counted.
+size_t get_circuit_memory()
 {
-    struct tb_event event;
-    tb_peek_event(&event, 1);
+    return gate_pool.num_of_items * gate_pool.item_size +
+           wire_pool.num_of_items * wire_pool.item_size +
+           (gate_inputs.len + wire_fanouts.len) * sizeof(Edge) +
+           (pin_grid.count + area_grid.count) * sizeof(SpatialEntry) +
+           (gate_list_len + wire_list_len + num_of_nets) * sizeof(void *);
+}
 
-    handle_cursor_input(&event);
+void print_bench_time(const char *phase, double seconds, int num_of_gates)
+{
+    printf("  %-14s %10.3f ms %10.2f M gates/s\n", phase, seconds * 1e3,
+           num_of_gates / seconds * 1e-6);
+}
 
-    if (event.key == TB_KEY_CTRL_Q) { // Quit
-        draw_text("Are you sure you want to quit? [y/n]", 0, tb_height() - 1,
-                  TB_WHITE, TB_DEFAULT);
-        tb_present();
-        tb_poll_event(&event);
-        if (event.ch == 'y' || event.ch == 'Y')
-            running = false;
-    } else if (event.ch == '?') { // Help
-        draw_line(0, tb_height() - 14, tb_width(), tb_height() - 14, '_',
-                  TB_WHITE, TB_DEFAULT);
-        draw_text(help, 0, tb_height() - 13, TB_WHITE, TB_DEFAULT);
-        tb_present();
-        tb_poll_event(&event);
-    } else if (event.ch == 'd' || event.ch == 'D') { // Delete gate
-        int gate_to_delete = get_gate_under_cursor();
+// Time every phase on a generated circuit, then clear the board. Drawing
+// opens the terminal, so nothing is printed until it has been closed again.
+void run_bench_circuit(BenchCircuit *circuit, bool draw)
+{
+    double start = get_time_seconds();
+    draw_bench_circuit(circuit);
+    double place_time = get_time_seconds() - start;
 
-        if (gate_to_delete >= 0) {
-            free(gate_list[gate_to_delete]);
-            for(int i = gate_to_delete; i < gate_list_len; i++)
-                gate_list[i] = gate_list[i + 1];
-            gate_list_len--;
-        } else {
-            int wire_to_delete = get_wire_under_cursor();
+    start = get_time_seconds();
+    build_representation_from_graphics();
+    double extract_time = get_time_seconds() - start;
 
-            if (wire_to_delete >= 0) {
-                free(wire_list[wire_to_delete]);
-                for(int i = wire_to_delete; i < wire_list_len; i++)
-                    wire_list[i] = wire_list[i + 1];
-                wire_list_len--;
-            }
+    start = get_time_seconds();
+    update_circuit();
+    double levelized_time = get_time_seconds() - start;
+
+    program_synced = false;
+    start = get_time_seconds();
+    update_circuit_compiled();
+    double compiled_time = get_time_seconds() - start;
+
+    start = get_time_seconds();
+    schedule_all_gates();
+    update_circuit_events();
+    double event_time = get_time_seconds() - start;
+
+    start = get_time_seconds();
+    schedule_all_gates();
+    update_circuit_timed();
+    double timed_time = get_time_seconds() - start;
+
+    // Toggle the inputs one at a time, with and without delays
+    int num_of_toggles = 0;
+    double toggle_time = 0;
+    double timed_toggle_time = 0;
+    for (int timed = 0; timed < 2; timed++) {
+        num_of_toggles = 0;
+        start = get_time_seconds();
+        for (int i = 0;
+             i < gate_list_len && num_of_toggles < BENCH_MAX_TOGGLES; i++) {
+            if (gate_list[i]->type != INPUT) continue;
+            gate_list[i]->value = !gate_list[i]->value;
+            schedule_gate(gate_list[i]);
+            if (timed)
+                update_circuit_timed();
+            else
+                update_circuit_events();
+            num_of_toggles++;
         }
-    } else if (event.ch == 'm' || event.ch == 'M') { // Move component
-        move_component_at_cursor();
-    } else if (event.ch == 'a' || event.ch == 'A') { // Place gate
-        place_gate_at_cursor();
-    } else if (event.ch == 'w' || event.ch == 'W') { // Place wire
-        place_wire();
-    } else if (event.key == TB_KEY_SPACE) { // Toggle simulation
-        simulate_circuit = !simulate_circuit;
-    } else if (event.ch == 'i' || event.ch == 'I') { // Toggle input's value
-        Gate *gate_under_cursor = gate_list[get_gate_under_cursor()];
-        if (gate_under_cursor->type == INPUT)
-            gate_under_cursor->value = !gate_under_cursor->value;
-    } else if (event.ch == 'v' || event.ch == 'V') {
-        create_verilog();
-        draw_text("Verilog output.", 0, tb_height() - 1, TB_WHITE, TB_DEFAULT);
+        if (timed)
+            timed_toggle_time = get_time_seconds() - start;
+        else
+            toggle_time = get_time_seconds() - start;
+    }
+    clear_timing_wheel();
+
+    double draw_time = 0;
+    if (draw && tb_init() == 0) {
+        start = get_time_seconds();
+        draw_circuit();
         tb_present();
-        tb_poll_event(&event);
+        draw_time = get_time_seconds() - start;
+        tb_shutdown();
+    }
+
+    int num_of_gates = gate_list_len;
+    printf("%s: %d gates, %d wires, %d nets, %zu bytes per gate\n",
+           circuit->name, num_of_gates, wire_list_len, num_of_nets,
+           get_circuit_memory() / num_of_gates);
+    print_bench_time("place", place_time, num_of_gates);
+    print_bench_time("extract", extract_time, num_of_gates);
+    print_bench_time("levelized", levelized_time, num_of_gates);
+    print_bench_time("compiled", compiled_time, num_of_gates);
+    print_bench_time("event driven", event_time, num_of_gates);
+    print_bench_time("timed", timed_time, num_of_gates);
+    if (num_of_toggles > 0) {
+        printf("  %-14s %10.3f us per toggle\n", "toggle",
+               toggle_time / num_of_toggles * 1e6);
+        printf("  %-14s %10.3f us per toggle\n", "timed toggle",
+               timed_toggle_time / num_of_toggles * 1e6);
+    }
+    if (draw_time > 0) // Only the components on screen are drawn
+        printf("  %-14s %10.3f ms\n", "draw", draw_time * 1e3);
+
+    clear_circuit();
+    free(circuit->types);
+    free(circuit->inputs);
+}
+
+// Run every generator at a size of about num_of_gates gates. Drawing is only
+// timed when there is a terminal to draw on.
+int run_benchmarks(int num_of_gates)
+{
+    bool draw = isatty(STDOUT_FILENO);
+    printf("%d threads\n", num_of_workers);
+
+    for (int i = 0; i < 5; i++) {
+        BenchCircuit circuit = {0};
+        switch (i) {
+        case 0:
+            circuit.name = "ripple carry adder";
+            generate_ripple_adder(&circuit, num_of_gates / 5);
+            break;
+        case 1:
+            circuit.name = "carry lookahead adder";
+            generate_lookahead_adder(&circuit, num_of_gates / 8);
+            break;
+        case 2:
+            // Its wires get longer with its width, so it is kept smaller
+            circuit.name = "array multiplier";
+            generate_array_multiplier(&circuit, (int)sqrt(num_of_gates / 24));
+            break;
+        case 3:
+            circuit.name = "random DAG";
+            generate_random_dag(&circuit, num_of_gates);
+            break;
+        case 4:
+            circuit.name = "NOT chain with feedback";
+            generate_not_chain(&circuit, num_of_gates);
+            break;
+        }
+        run_bench_circuit(&circuit, draw);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// Set the delay of a gate type from a type=ticks argument
+bool parse_gate_delay(const char *arg)
+{
+    char type_name[16];
+    int delay;
+
+    if (sscanf(arg, "%15[^=]=%d", type_name, &delay) == 2) {
+        for (int i = 0; i < NUM_OF_GATE_TYPES; i++) {
+            if (i == CUSTOM || strcasecmp(type_name, gate_type_names[i]) != 0)
+                continue;
+            if (delay < 1 || delay > MAX_GATE_DELAY) break;
+            gate_delays[i] = delay;
+            return true;
+        }
     }
+    fprintf(stderr, "Invalid delay %s, expected type=ticks with ticks from 1 "
+            "to %d.\n", arg, MAX_GATE_DELAY);
+    return false;
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    const char *stimulus_path = NULL;
+    const char *output_path = NULL;
+    const char *c_path = NULL;
+    const char *verilog_path = NULL;
+    const char *equiv_path = NULL;
+    const char *vcd_path = NULL;
+    long vcd_first = 0, vcd_last = LONG_MAX;
+    int bench_gates = 0;
+    bool batch = false;
+    bool faults = false;
+    bool truth_table = false;
+    bool print_stats = false;
+    long cycles_per_step = 1;
+
+    num_of_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    spatial_init(&pin_grid, 0);
+    spatial_init(&area_grid, 3);
+
+    // Arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 2 < argc) {
+            batch = true;
+            circuit_path = argv[++i];
+            stimulus_path = argv[++i];
+        } else if (strcmp(argv[i], "--faults") == 0 && i + 2 < argc) {
+            faults = true;
+            circuit_path = argv[++i];
+            stimulus_path = argv[++i];
+        } else if (strcmp(argv[i], "--truth-table") == 0 && i + 1 < argc) {
+            truth_table = true;
+            circuit_path = argv[++i];
+        } else if (strcmp(argv[i], "--emit-c") == 0 && i + 2 < argc) {
+            c_path = argv[++i];
+            circuit_path = argv[++i];
+        } else if (strcmp(argv[i], "--verilog") == 0 && i + 2 < argc) {
+            verilog_path = argv[++i];
+            circuit_path = argv[++i];
+        } else if (strcmp(argv[i], "--equiv") == 0 && i + 2 < argc) {
+            circuit_path = argv[++i];
+            equiv_path = argv[++i];
+        } else if (strcmp(argv[i], "--bdd-nodes") == 0 && i + 1 < argc) {
+            bdd_node_limit = atoi(argv[++i]);
+            if (bdd_node_limit < 2) bdd_node_limit = 2;
+        } else if (strcmp(argv[i], "--vcd") == 0 && i + 1 < argc) {
+            vcd_path = argv[++i];
+        } else if (strcmp(argv[i], "--vcd-window") == 0 && i + 2 < argc) {
+            vcd_first = atol(argv[++i]);
+            vcd_last = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--wave-memory") == 0 && i + 1 < argc) {
+            wave_memory = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench_gates = 100000;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                bench_gates = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            print_stats = true;
+        } else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            cycles_per_step = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) {
+            if (!parse_gate_delay(argv[++i])) return 1;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_of_workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lib") == 0 && i + 1 < argc) {
+            if (!load_definition(argv[++i])) return 1;
+        } else if (argv[i][0] != '-') {
+            circuit_path = argv[i];
+        } else {
+            fprintf(stderr, usage, argv[0], argv[0], argv[0], argv[0], argv[0],
+                    argv[0], argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_of_workers < 1) num_of_workers = 1;
+    if (num_of_workers > MAX_WORKERS) num_of_workers = MAX_WORKERS;
+
+    if (bench_gates > 0) return run_benchmarks(bench_gates);
+    if (equiv_path != NULL) {
+        int status = check_equivalence(circuit_path, equiv_path);
+        if (print_stats) write_stats(stderr, &stats);
+        return status;
+    }
+    if (batch || faults || truth_table || c_path != NULL ||
+        verilog_path != NULL) {
+        if (!load_circuit(circuit_path)) return 1;
+
+        int status = 0;
+        if (batch) {
+            if (vcd_path != NULL) start_waveform();
+            status = run_batch(stimulus_path, output_path, cycles_per_step);
+            if (status == 0 && vcd_path != NULL &&
+                !write_vcd(vcd_path, vcd_first, vcd_last)) {
+                fprintf(stderr, "Could not write %s.\n", vcd_path);
+                status = 1;
+            }
+        } else if (faults) {
+            status = run_fault_simulation(stimulus_path, output_path);
+        } else if (truth_table) {
+            status = run_truth_table(output_path);
+        } else if (c_path != NULL) {
+            status = write_program_file(c_path);
+        } else if (!save_verilog(verilog_path)) {
+            fprintf(stderr, "Could not write %s.\n", verilog_path);
+            status = 1;
+        }
+        if (print_stats) write_stats(stderr, &stats);
+        return status;
+    }
+    if (is_verilog_path(circuit_path)) {
+        fprintf(stderr, "Verilog netlists can't be drawn, use --batch.\n");
+        return 1;
+    }
+
+    FILE *existing = fopen(circuit_path, "r");
+    if (existing != NULL) {
+        fclose(existing);
+        if (!load_circuit(circuit_path)) return 1;
+    }
+
     // Graphics
     if (tb_init()) { // Initialize termbox
         printf("Error initializing termbox.");
         return 1;
     }
-    
+
     // Center cursor
     cursor_x = tb_width() / 2;
     cursor_y = tb_height() / 2;
 
-    // Main loop
-    while (running) {
-        handle_input();
-        draw();
-        build_representation_from_graphics();
-        if (simulate_circuit) update_circuit();
+    build_representation_from_graphics();
+    if (wave_memory > 0) start_waveform();
+    if (!start_simulation_thread()) {
+        tb_shutdown();
+        printf("Error starting the simulation thread.");
+        return 1;
     }
 
+    // Main loop. Sleeps until there is input or it is time for the next
+    // frame, so the screen is drawn at most every FRAME_TIME_MS.
+    long next_frame = get_time_ms();
+    while (running) {
+        long now = get_time_ms();
+        if (now >= next_frame) {
+            draw();
+            next_frame = now + FRAME_TIME_MS;
+        }
+        handle_input(next_frame - now);
+    }
 
+    stop_simulation_thread();
     tb_shutdown();
 }
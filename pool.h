@@ -0,0 +1,96 @@
+/*
+A pool allocator for lots of objects of the same size.
+
+Objects are carved out of chunks that double in size as the pool grows, so
+they never move once allocated and objects allocated together sit next to
+each other in memory. Freed objects are kept on a free list and handed out
+again by the next call to pool_alloc(). New chunks are zeroed, so fields that
+are not set by the caller start at zero and keep their value when an item is
+freed and handed out again.
+
+Example program:
+int main()
+{
+    Pool pool = { sizeof(double) };
+
+    double *a = pool_alloc(&pool);
+    double *many = pool_alloc_many(&pool, 100);
+    pool_free(&pool, a);
+
+    pool_destroy(&pool);
+}
+
+*/
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+
+#define POOL_FIRST_CHUNK_LEN 64
+
+typedef struct Pool {
+    size_t item_size; // At least the size of a pointer
+    char **chunks;
+    int num_of_chunks;
+    int chunk_len; // Items in the newest chunk
+    int chunk_used;
+    void *free_items; // Linked through the first bytes of each item
+    int num_of_items; // Items currently allocated
+    size_t bytes; // Memory taken from malloc
+} Pool;
+
+// Allocate a run of items that are next to each other in memory
+void *pool_alloc_many(Pool *pool, int count)
+{
+    if (pool->chunks == NULL || pool->chunk_used + count > pool->chunk_len) {
+        int len = pool->chunk_len ? pool->chunk_len * 2 : POOL_FIRST_CHUNK_LEN;
+        if (len < count) len = count;
+
+        pool->chunks = realloc(pool->chunks,
+                               (pool->num_of_chunks + 1) * sizeof(char *));
+        pool->chunks[pool->num_of_chunks++] = calloc(len, pool->item_size);
+        pool->chunk_len = len;
+        pool->chunk_used = 0;
+        pool->bytes += len * pool->item_size;
+    }
+
+    char *items = pool->chunks[pool->num_of_chunks - 1] +
+                  pool->chunk_used * pool->item_size;
+    pool->chunk_used += count;
+    pool->num_of_items += count;
+    return items;
+}
+
+void *pool_alloc(Pool *pool)
+{
+    if (pool->free_items != NULL) {
+        void *item = pool->free_items;
+        pool->free_items = *(void **)item;
+        pool->num_of_items++;
+        return item;
+    }
+    return pool_alloc_many(pool, 1);
+}
+
+void pool_free(Pool *pool, void *item)
+{
+    *(void **)item = pool->free_items;
+    pool->free_items = item;
+    pool->num_of_items--;
+}
+
+void pool_destroy(Pool *pool)
+{
+    for (int i = 0; i < pool->num_of_chunks; i++)
+        free(pool->chunks[i]);
+    free(pool->chunks);
+    pool->chunks = NULL;
+    pool->num_of_chunks = 0;
+    pool->chunk_len = 0;
+    pool->chunk_used = 0;
+    pool->free_items = NULL;
+    pool->num_of_items = 0;
+    pool->bytes = 0;
+}
+
+#endif
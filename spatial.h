@@ -0,0 +1,217 @@
+/*
+A spatial hash for finding things by the terminal cells they cover.
+
+Cells are grouped into square tiles of (1 << shift) cells. Every item is
+stored once for each tile it touches, so a lookup only has to look at the
+items near a point instead of every item on the board.
+
+Example program:
+int main()
+{
+    SpatialHash hash;
+    spatial_init(&hash, 0);
+
+    spatial_insert(&hash, 3, 5, "pin", 0);
+    for (int e = spatial_find(&hash, 3, 5); e >= 0;
+         e = spatial_find_next(&hash, e))
+        printf("%s\n", (char *)hash.entries[e].item);
+
+    spatial_free(&hash);
+}
+
+*/
+#ifndef SPATIAL_HASH_H
+#define SPATIAL_HASH_H
+
+#include <stdlib.h>
+
+typedef struct SpatialEntry {
+    int x, y; // Tile
+    void *item;
+    int tag;
+    int next; // Next entry in the bucket, -1 ends the chain
+} SpatialEntry;
+
+typedef struct SpatialHash {
+    int shift;
+    int *buckets; // First entry of each chain
+    int num_of_buckets; // Always a power of two
+    SpatialEntry *entries;
+    int num_of_entries;
+    int entry_capacity;
+    int free_entry; // Removed entries waiting to be reused
+    int count; // Entries in use
+} SpatialHash;
+
+unsigned int spatial_bucket(const SpatialHash *hash, int x, int y)
+{
+    unsigned int key = (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u;
+    return (key ^ key >> 16) & (hash->num_of_buckets - 1);
+}
+
+void spatial_init(SpatialHash *hash, int shift)
+{
+    hash->shift = shift;
+    hash->num_of_buckets = 256;
+    hash->buckets = malloc(hash->num_of_buckets * sizeof(int));
+    for (int i = 0; i < hash->num_of_buckets; i++)
+        hash->buckets[i] = -1;
+    hash->entries = NULL;
+    hash->num_of_entries = 0;
+    hash->entry_capacity = 0;
+    hash->free_entry = -1;
+    hash->count = 0;
+}
+
+void spatial_free(SpatialHash *hash)
+{
+    free(hash->buckets);
+    free(hash->entries);
+    hash->buckets = NULL;
+    hash->entries = NULL;
+}
+
+// Double the number of buckets and move every entry to its new chain
+void spatial_grow(SpatialHash *hash)
+{
+    hash->num_of_buckets *= 2;
+    hash->buckets = realloc(hash->buckets, hash->num_of_buckets * sizeof(int));
+    for (int i = 0; i < hash->num_of_buckets; i++)
+        hash->buckets[i] = -1;
+
+    for (int i = 0; i < hash->num_of_entries; i++) {
+        SpatialEntry *entry = &hash->entries[i];
+        if (entry->item == NULL) continue; // On the free list
+
+        unsigned int bucket = spatial_bucket(hash, entry->x, entry->y);
+        entry->next = hash->buckets[bucket];
+        hash->buckets[bucket] = i;
+    }
+}
+
+// Make room for a number of new entries before adding them all at once
+void spatial_reserve(SpatialHash *hash, int num_of_entries)
+{
+    int count = hash->count + num_of_entries;
+
+    if (count > hash->entry_capacity) {
+        hash->entry_capacity = count;
+        hash->entries = realloc(hash->entries,
+                                hash->entry_capacity * sizeof(SpatialEntry));
+    }
+    if (count >= hash->num_of_buckets * 2) {
+        while (count >= hash->num_of_buckets * 2)
+            hash->num_of_buckets *= 2;
+        hash->num_of_buckets /= 2; // spatial_grow() doubles it again
+        spatial_grow(hash);
+    }
+}
+
+// Add an item to the tile containing cell (x, y)
+void spatial_insert(SpatialHash *hash, int x, int y, void *item, int tag)
+{
+    int index;
+
+    if (hash->count >= hash->num_of_buckets * 2)
+        spatial_grow(hash);
+
+    if (hash->free_entry >= 0) {
+        index = hash->free_entry;
+        hash->free_entry = hash->entries[index].next;
+    } else {
+        if (hash->num_of_entries == hash->entry_capacity) {
+            hash->entry_capacity = hash->entry_capacity ?
+                                   hash->entry_capacity * 2 : 256;
+            hash->entries = realloc(hash->entries,
+                    hash->entry_capacity * sizeof(SpatialEntry));
+        }
+        index = hash->num_of_entries++;
+    }
+
+    SpatialEntry *entry = &hash->entries[index];
+    entry->x = x >> hash->shift;
+    entry->y = y >> hash->shift;
+    entry->item = item;
+    entry->tag = tag;
+
+    unsigned int bucket = spatial_bucket(hash, entry->x, entry->y);
+    entry->next = hash->buckets[bucket];
+    hash->buckets[bucket] = index;
+    hash->count++;
+}
+
+// Remove every entry of an item from the tile containing cell (x, y)
+void spatial_remove(SpatialHash *hash, int x, int y, const void *item)
+{
+    x >>= hash->shift;
+    y >>= hash->shift;
+
+    int *link = &hash->buckets[spatial_bucket(hash, x, y)];
+    while (*link >= 0) {
+        int index = *link;
+        SpatialEntry *entry = &hash->entries[index];
+
+        if (entry->item == item && entry->x == x && entry->y == y) {
+            *link = entry->next;
+            entry->item = NULL;
+            entry->next = hash->free_entry;
+            hash->free_entry = index;
+            hash->count--;
+        } else {
+            link = &entry->next;
+        }
+    }
+}
+
+// Add an item to every tile overlapping the rectangle between two corners
+void spatial_insert_rect(SpatialHash *hash, int x0, int y0, int x1, int y1,
+                         void *item, int tag)
+{
+    int size = 1 << hash->shift;
+    if (x1 < x0) { int tmp = x0; x0 = x1; x1 = tmp; }
+    if (y1 < y0) { int tmp = y0; y0 = y1; y1 = tmp; }
+
+    for (int y = y0 >> hash->shift; y <= y1 >> hash->shift; y++)
+        for (int x = x0 >> hash->shift; x <= x1 >> hash->shift; x++)
+            spatial_insert(hash, x * size, y * size, item, tag);
+}
+
+void spatial_remove_rect(SpatialHash *hash, int x0, int y0, int x1, int y1,
+                         const void *item)
+{
+    int size = 1 << hash->shift;
+    if (x1 < x0) { int tmp = x0; x0 = x1; x1 = tmp; }
+    if (y1 < y0) { int tmp = y0; y0 = y1; y1 = tmp; }
+
+    for (int y = y0 >> hash->shift; y <= y1 >> hash->shift; y++)
+        for (int x = x0 >> hash->shift; x <= x1 >> hash->shift; x++)
+            spatial_remove(hash, x * size, y * size, item);
+}
+
+// Continue a search from an entry, returns -1 when there are no more items
+int spatial_find_next(const SpatialHash *hash, int index)
+{
+    int x = hash->entries[index].x;
+    int y = hash->entries[index].y;
+
+    for (index = hash->entries[index].next; index >= 0;
+         index = hash->entries[index].next)
+        if (hash->entries[index].x == x && hash->entries[index].y == y)
+            return index;
+    return -1;
+}
+
+// First entry in the tile containing cell (x, y), or -1 if it is empty
+int spatial_find(const SpatialHash *hash, int x, int y)
+{
+    x >>= hash->shift;
+    y >>= hash->shift;
+
+    for (int index = hash->buckets[spatial_bucket(hash, x, y)]; index >= 0;
+         index = hash->entries[index].next)
+        if (hash->entries[index].x == x && hash->entries[index].y == y)
+            return index;
+    return -1;
+}
+
+#endif
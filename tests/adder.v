@@ -0,0 +1,12 @@
+// Two bit adder, with the ports declared in the module body
+module adder(a0, b0, a1, b1, cin, s0, s1, cout);
+    input a0, b0, a1, b1, cin;
+    output s0, s1, cout;
+    wire p0, p1, c0;
+    assign p0 = a0 ^ b0;
+    assign s0 = p0 ^ cin;
+    assign c0 = (a0 & b0) | (p0 & cin);
+    assign p1 = a1 ^ b1;
+    assign s1 = p1 ^ c0;
+    assign cout = (a1 & b1) | (p1 & c0);
+endmodule
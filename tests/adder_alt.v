@@ -0,0 +1,9 @@
+// The same adder with majority carries and its ports in another order
+module adder(input cin, input a1, input b1, input a0, input b0,
+             output cout, output s1, output s0);
+    wire c0;
+    assign s0 = a0 ^ b0 ^ cin;
+    assign c0 = (a0 & b0) | (a0 & cin) | (b0 & cin);
+    assign s1 = a1 ^ b1 ^ c0;
+    assign cout = (a1 & b1) | (a1 & c0) | (b1 & c0);
+endmodule
@@ -0,0 +1,11 @@
+// Two bit counter clocked by an input
+module counter(clk, q0, q1);
+    input clk;
+    output q0, q1;
+    reg q0, q1;
+    wire d0, d1;
+    assign d0 = ~q0;
+    assign d1 = q1 ^ q0;
+    always @(posedge clk) q0 <= d0;
+    always @(posedge clk) q1 <= d1;
+endmodule
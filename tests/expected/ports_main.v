@@ -0,0 +1,9 @@
+module main(
+    input w1,
+    input w2,
+    output w3,
+    output w4
+);
+assign w3 = w1 & w2;
+assign w4 = ~w3;
+endmodule
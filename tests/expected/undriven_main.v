@@ -0,0 +1,7 @@
+module main(
+    input w1,
+    output w2,
+    output w3
+);
+assign w2 = w1;
+endmodule
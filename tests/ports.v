@@ -0,0 +1,7 @@
+// An output that another output reads is still an output
+module top(a, b, y, z);
+    input a, b;
+    output y, z;
+    assign y = a & b;
+    assign z = ~y;
+endmodule
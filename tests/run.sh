@@ -0,0 +1,63 @@
+#!/bin/bash
+# Runs the command line tools on the circuits in this directory and compares
+# what they write with the files in expected/. ./run.sh -u rewrites them.
+# Extra compiler flags can be passed in CFLAGS.
+cd "$(dirname "$0")"
+gcc ../main.c $CFLAGS -lm -ltermbox -lpthread -O2 -Wall -o logic || exit 1
+out=$(mktemp -d)
+trap 'rm -rf "$out" logic' EXIT
+failed=0
+
+# run name status command...: run a command that should exit with status,
+# writing its output and errors to $out/name
+run() {
+    local name=$1 status=$2
+    shift 2
+    "$@" > "$out/$name" 2>&1
+    local actual=$?
+    if [ $actual -ne $status ]; then
+        echo "$name: exit status $actual, expected $status"
+        failed=1
+    fi
+}
+
+run truth_table_gates.txt 0 ./logic --truth-table gates.txt
+run truth_table_loop.txt 1 ./logic --truth-table loop.txt
+run batch_gates.txt 0 ./logic --batch gates.txt gates_stimulus.txt
+run batch_adder.txt 0 ./logic --batch adder.v adder.txt
+run batch_ports.txt 0 ./logic --batch ports.v ports.txt
+run truth_table_ports.txt 0 ./logic --truth-table ports.v
+# Write circuits as Verilog and read them back
+run verilog_ports.txt 0 ./logic --verilog "$out/ports_main.v" ports.v
+run batch_ports_main.txt 0 ./logic --batch "$out/ports_main.v" ports.txt
+run verilog_undriven.txt 0 ./logic --verilog "$out/undriven_main.v" undriven.v
+run batch_undriven_main.txt 0 ./logic --batch "$out/undriven_main.v" \
+    undriven.txt
+run truth_table_adder.txt 0 ./logic --truth-table adder_alt.v
+run equiv_same.txt 0 ./logic --equiv adder.v adder_alt.v
+run equiv_different.txt 1 ./logic --equiv adder.v adder_bug.v
+run equiv_count.txt 2 ./logic --equiv adder.v gates.txt
+run faults_adder.txt 0 ./logic --faults adder.v faults.txt
+run batch_counter.txt 0 ./logic --vcd "$out/counter.vcd" --batch counter.v \
+    counter.txt
+# Two blocks of waveform fill up long before 3000 cycles, so a window from 0
+# starts at the oldest block left
+run batch_toggle_wrap.txt 0 ./logic --threads 1 --wave-memory 1 \
+    --vcd-window 0 7002 --vcd "$out/toggle_wrap.vcd" --cycles 3000 \
+    --batch toggle.txt toggle_stimulus.txt
+run batch_toggle_window.txt 0 ./logic --threads 1 --wave-memory 1 \
+    --vcd-window 8000 8006 --vcd "$out/toggle_window.vcd" --cycles 3000 \
+    --batch toggle.txt toggle_stimulus.txt
+
+for file in "$out"/*; do
+    name=$(basename "$file")
+    if [ "$1" = "-u" ]; then
+        cp "$file" "expected/$name"
+    elif ! diff -u "expected/$name" "$file"; then
+        echo "$name differs"
+        failed=1
+    fi
+done
+
+[ $failed -eq 0 ] && echo "All tests passed."
+exit $failed
@@ -0,0 +1,4 @@
+// An output that nothing drives
+module top(input a, output y, output z);
+    assign y = a;
+endmodule
@@ -23,6 +23,31 @@ int main()
 
 #include <termbox.h>
 #include <math.h>
+#include <limits.h>
+
+// The draw functions leave cells outside the clip rectangle alone
+int clip_x0 = INT_MIN, clip_y0 = INT_MIN;
+int clip_x1 = INT_MAX, clip_y1 = INT_MAX;
+
+// Only draw inside the rectangle between two corners, inclusive
+void set_clip_rect(int x0, int y0, int x1, int y1)
+{
+    clip_x0 = x0;
+    clip_y0 = y0;
+    clip_x1 = x1;
+    clip_y1 = y1;
+}
+
+void reset_clip_rect()
+{
+    set_clip_rect(INT_MIN, INT_MIN, INT_MAX, INT_MAX);
+}
+
+void draw_cell(int x, int y, uint32_t ch, uint32_t fg, uint32_t bg)
+{
+    if (x >= clip_x0 && x <= clip_x1 && y >= clip_y0 && y <= clip_y1)
+        tb_change_cell(x, y, ch, fg, bg);
+}
 
 void draw_text(const char *txt, int x, int y, uint32_t fg, uint32_t bg)
 {
@@ -31,7 +56,7 @@ void draw_text(const char *txt, int x, int y, uint32_t fg, uint32_t bg)
             draw_text(txt + i + 1, x, y + 1, fg, bg);
             break;
         }
-        tb_change_cell(x + i, y, txt[i], fg, bg);
+        draw_cell(x + i, y, txt[i], fg, bg);
     }
 }
 
@@ -40,7 +65,7 @@ void draw_rect(int x, int y, int width, int height,
 {
     for (int j = 0; j < height; j++)
         for (int i = 0; i < width; i++)
-            tb_change_cell(x + i, y + j, ch, fg, bg);
+            draw_cell(x + i, y + j, ch, fg, bg);
 }
 
 void draw_line(int x0, int y0, int x1, int y1, char ch,
@@ -67,7 +92,7 @@ void draw_line(int x0, int y0, int x1, int y1, char ch,
 
     if (dx == 0) {
         for (int i = 0; i < dy; i++)
-            tb_change_cell(x, i + y0, ch, fg, bg);
+            draw_cell(x, i + y0, ch, fg, bg);
     } else {
         while (x < x1) {
             if (temp < 0) {
@@ -77,7 +102,7 @@ void draw_line(int x0, int y0, int x1, int y1, char ch,
                 temp = temp + 2 * dy - 2 * dx;
             }
 
-            tb_change_cell(x, y, ch, fg, bg);
+            draw_cell(x, y, ch, fg, bg);
 
             x++;
         }